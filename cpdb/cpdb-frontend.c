@@ -4,8 +4,300 @@
 #include <sys/un.h>
 #include <stdbool.h>
 
-static void                 fetchPrinterListFromBackend     (cpdb_frontend_obj_t *      frontend_obj,
-                                                             const char *               backend);
+/* Format of the printer catalog, bump the version on changes */
+#define CPDB_CATALOG_VERSION 1
+#define CPDB_CATALOG_ARGS "(uas" CPDB_PRINTER_ARRAY_ARGS ")"
+#define CPDB_OPTIONS_CACHE_VERSION 1
+
+#define CPDB_ALL_OPTIONS_REPLY_ARGS "(ia(sssia(s))ia(siiia(iiii)))"
+/* Version, backend name, printer id, make and model, capability generation
+ * and the GetAllOptions reply */
+#define CPDB_OPTIONS_CACHE_ARGS "(usssu" CPDB_ALL_OPTIONS_REPLY_ARGS ")"
+#define CPDB_PRINTER_CHANGES_REPLY_ARGS "(uba(v)as)"
+#define CPDB_PRINTERS_CHANGED_ARGS "(suua(v)asa(ssb))"
+
+/* Last printer list generation seen from a backend, kept on its proxy */
+#define CPDB_GENERATION_KEY         "cpdb-printer-generation"
+#define CPDB_NO_CHANGES_KEY         "cpdb-no-printer-changes"
+#define CPDB_NO_FILTER_KEY          "cpdb-no-printer-filter"
+#define CPDB_NO_GENERATION_KEY      "cpdb-no-capability-generation"
+
+/* Arena block sizes, a printer's options typically fit in a few blocks */
+#define CPDB_OPTIONS_ARENA_SIZE     16384
+#define CPDB_TRANSLATIONS_ARENA_SIZE 8192
+
+/* Default timeouts in ms of the backend calls, short enough for a
+ * hung backend not to freeze the dialog */
+static const int cpdb_default_timeouts[CPDB_CALL_COUNT] = {
+    [CPDB_CALL_LISTING]         = 10000,
+    [CPDB_CALL_STATE]           = 2000,
+    [CPDB_CALL_OPTIONS]         = 10000,
+    [CPDB_CALL_TRANSLATIONS]    = 5000,
+    [CPDB_CALL_PRINT]           = -1,
+    [CPDB_CALL_CONTROL]         = 5000,
+};
+
+/* Connection to the session bus, shared by the whole process except
+ * for the frontend objects: backends keep their listing and hiding of
+ * printers per bus name, so each of them needs its own */
+G_LOCK_DEFINE_STATIC(shared_connection);
+static GDBusConnection *shared_connection = NULL;
+static gboolean lazy_reconnect = TRUE;
+
+/* Protects swapping the cancellable of a printer */
+G_LOCK_DEFINE_STATIC(printer_cancellable);
+
+/* Protects unpacking the tables of shared options */
+G_LOCK_DEFINE_STATIC(option_tables);
+
+/* Protects the replaced fields printers keep for their readers */
+G_LOCK_DEFINE_STATIC(printer_retired);
+
+/* Backend health, kept on the backend proxy */
+#define CPDB_HEALTH_KEY             "cpdb-backend-health"
+#define CPDB_HEALTH_ALPHA           0.2     /* Weight of the last call in the rolling averages */
+#define CPDB_SLOW_BACKEND_MS        1000    /* Average latency above which a backend is slow */
+#define CPDB_BREAKER_TIMEOUTS       3       /* Timeouts in a row tripping the breaker */
+#define CPDB_BREAKER_MIN_CALLS      5       /* Calls needed before the error rate counts */
+#define CPDB_BREAKER_ERROR_RATE     0.5     /* Error rate tripping the breaker */
+#define CPDB_PROBE_INTERVAL_MS      2000    /* First delay between probes, doubled each time */
+#define CPDB_PROBE_INTERVAL_MAX_MS  60000
+#define CPDB_PROBE_TIMEOUT_MS       2000
+
+typedef struct cpdb_health_s
+{
+    GMutex lock;
+    GCond cond;                 /** Signalled when probing gets stopped */
+    cpdb_backend_health_t health;
+    gboolean probing;           /** A probe thread is running */
+    gboolean stopped;           /** The backend is gone, don't probe it anymore */
+} cpdb_health_t;
+
+/* Protects attaching the health to a backend proxy */
+G_LOCK_DEFINE_STATIC(backend_health);
+
+/* Printer updates waiting to be delivered to the batch callback */
+typedef struct cpdb_batch_s
+{
+    GMutex lock;
+    int window_msec;
+    GArray *changes;            /** cpdb_printer_change_t, printer NULL if dropped */
+    GHashTable *index;          /** [cpdb_printer_obj_t] --> [position in changes + 1] */
+    GSource *source;            /** Delivers the batch, NULL if none is pending */
+    GMainContext *context;      /** Context of the caller setting the callback */
+} cpdb_batch_t;
+
+/* Printer fields covered by cpdbSearchPrinters() */
+enum {
+    CPDB_SEARCH_NAME,
+    CPDB_SEARCH_INFO,
+    CPDB_SEARCH_LOCATION,
+    CPDB_SEARCH_MAKE_AND_MODEL,
+    CPDB_SEARCH_FIELDS
+};
+
+typedef struct cpdb_search_entry_s
+{
+    cpdb_printer_obj_t *printer;
+    char *folded[CPDB_SEARCH_FIELDS];   /** Case folded fields */
+    GPtrArray *tokens;                  /** Iterators of its words in the index */
+} cpdb_search_entry_t;
+
+typedef struct cpdb_search_token_s
+{
+    char *word;                         /** Case folded word of a field */
+    cpdb_search_entry_t *entry;
+} cpdb_search_token_t;
+
+/* Index of the printers for searching, words of all fields sorted to find
+ * the ones starting with a prefix, and the trigrams of the folded fields
+ * to find the ones containing a substring */
+typedef struct cpdb_search_index_s
+{
+    GHashTable *entries;                /** [cpdb_printer_obj_t] --> [cpdb_search_entry_t] */
+    GSequence *tokens;                  /** cpdb_search_token_t, sorted by word */
+    GHashTable *trigrams;               /** [3 bytes of a field] --> [set of cpdb_search_entry_t] */
+} cpdb_search_index_t;
+
+typedef struct cpdb_sort_item_s
+{
+    cpdb_printer_obj_t *printer;
+    char *collate_key;                  /** For CPDB_SORT_BY_COLLATION only */
+} cpdb_sort_item_t;
+
+/* Printers of a frontend instance in one sort order */
+typedef struct cpdb_sorted_view_s
+{
+    cpdb_sort_order_t order;
+    GSequence *items;                   /** cpdb_sort_item_t, sorted */
+    GHashTable *iters;                  /** [cpdb_printer_obj_t] --> [GSequenceIter] */
+} cpdb_sorted_view_t;
+
+typedef void (*cpdb_call_callback)(GVariant *reply, const GError *error, gpointer user_data);
+
+typedef struct cpdb_activation_s cpdb_activation_t;
+
+/* See cpdbSetDefaultPrinterPrefetch() */
+typedef struct cpdb_default_prefetch_s
+{
+    char *locale;
+    GPtrArray *candidates;      /* "id#backend" of the probable default printers, best first */
+    guint best;                 /* Rank of the best candidate prefetched yet, len if none */
+    GPtrArray *pending;         /* Printers to prefetch once the registry is unlocked */
+    GMainContext *context;      /* Where the prefetch calls are made */
+} cpdb_default_prefetch_t;
+
+/* Prefetch calls handed over to the main context of the prefetch, as
+ * the registry may be unlocked in one which is only iterated until the
+ * backends got activated */
+typedef struct
+{
+    cpdb_frontend_obj_t *f;
+    GMainContext *context;
+    GCancellable *cancellable;  /* Of the frontend when the work got queued */
+    GPtrArray *printers;        /* Printers to prefetch, or NULL */
+    char *locale;
+    PrintBackend *proxy;        /* CUPS backend to ask its default printer, or NULL */
+    int timeout;
+} cpdb_prefetch_work_t;
+
+/* Basic attributes of a printer as sent by its backend, borrowed from
+ * the GVariant they were unpacked from while it's being merged */
+typedef struct {
+    const char *id;
+    const char *name;
+    const char *info;
+    const char *location;
+    const char *make_and_model;
+    gboolean accepting_jobs;
+    const char *state;
+    const char *backend_name;
+} cpdb_printer_record_t;
+
+static void                 cpdbGetPrinterRecord            (GVariant *                 printer,
+                                                             cpdb_printer_record_t *    record);
+static gboolean             cpdbApplyPrinterChanges         (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name,
+                                                             PrintBackend *             proxy,
+                                                             GError **                  error);
+static void                 cpdbUpdatePrinterState          (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               printer_id,
+                                                             const char *               backend_name,
+                                                             const char *               state,
+                                                             gboolean                   accepting_jobs);
+static void                 cpdbQueuePrinterChange          (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_printer_update_t      change);
+static void                 cpdbFreeBatch                   (cpdb_batch_t *             batch);
+static void                 cpdbUseSavedSettings            (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static cpdb_settings_t *    cpdbGetOwnSettings              (cpdb_printer_obj_t *       printer_obj);
+static gboolean            cpdbGetBackendMatches           (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name,
+                                                             PrintBackend *             proxy,
+                                                             GVariant *                 filter,
+                                                             GHashTable *               matches);
+static void                 cpdbFilterBackendPrinters       (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name,
+                                                             GVariant *                 filter,
+                                                             GHashTable *               matches);
+static void                 cpdbFreePrinterStrings          (cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbFreeDefaultPrefetch         (cpdb_default_prefetch_t *  prefetch);
+static void                 cpdbPrefetchIfDefault           (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbStartDefaultPrefetch        (GPtrArray *                printers,
+                                                             const char *               locale);
+static cpdb_prefetch_work_t *cpdbNewPrefetchWork            (cpdb_frontend_obj_t *      frontend_obj);
+static void                 cpdbQueuePrefetchWork           (cpdb_prefetch_work_t *     work);
+static void                 cpdbLockRegistry                (cpdb_frontend_obj_t *      frontend_obj);
+static void                 cpdbUnlockRegistry              (cpdb_frontend_obj_t *      frontend_obj);
+static PrintBackend *       cpdbRefBackend                  (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name);
+static void                 cpdbForeachBackend              (cpdb_frontend_obj_t *      frontend_obj,
+                                                             GHFunc                     func,
+                                                             gpointer                   user_data);
+static void                 cpdbPublishPrinters             (cpdb_frontend_obj_t *      frontend_obj);
+static void                 cpdbTrackPrinter                (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbUntrackPrinter              (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbFreeSortedView              (cpdb_sorted_view_t *       view);
+static void                 cpdbIndexPrinter                (cpdb_search_index_t *      index,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbUnindexPrinter              (cpdb_search_index_t *      index,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbFreeSearchIndex             (cpdb_search_index_t *      index);
+static void                 cpdbSyncBackendPrinters         (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name,
+                                                             GVariant *                 printers,
+                                                             gboolean                   notify);
+static cpdb_activation_t *  cpdbNewActivation               (cpdb_frontend_obj_t *      frontend_obj,
+                                                             gboolean                   notify);
+static void                 cpdbActivateBackend             (cpdb_activation_t *        activation,
+                                                             const char *               service_name);
+static void                 cpdbFinishActivation            (cpdb_activation_t *        activation);
+static cpdb_activation_t *  cpdbStartActivation             (cpdb_frontend_obj_t *      frontend_obj,
+                                                             gboolean                   notify,
+                                                             gboolean                   waiting);
+static void                 cpdbRemoveBackend               (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name);
+static void                 cpdbNotifyPrinterChange         (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_printer_update_t      change);
+static void                 cpdbDeliverPrinterChange        (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_printer_update_t      change);
+static void                 cpdbDropPrinterChanges          (GArray *                   changes);
+static void                 cpdbScheduleBackendWatch        (cpdb_frontend_obj_t *      frontend_obj);
+static cpdb_printer_obj_t * cpdbLookupPrinter               (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               printer_id,
+                                                             const char *               backend_name);
+static void                 cpdbInsertPrinter               (cpdb_frontend_obj_t *      frontend_obj,
+                                                             cpdb_printer_obj_t *       printer_obj);
+static cpdb_printer_obj_t * cpdbMergePrinter                (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const cpdb_printer_record_t *record,
+                                                             gboolean                   notify);
+static void                 cpdbRemoveMatchingPrinters      (cpdb_frontend_obj_t *      frontend_obj,
+                                                             const char *               backend_name);
+static void                 cpdbRemoveUninstalledPrinters   (cpdb_frontend_obj_t *      frontend_obj,
+                                                             GHashTable *               installed);
+static void                 cpdbLoadPrinterCatalog          (cpdb_frontend_obj_t *      frontend_obj);
+static void                 cpdbSavePrinterCatalog          (cpdb_frontend_obj_t *      frontend_obj);
+static gboolean             cpdbIsPrinterConnected          (cpdb_printer_obj_t *       printer_obj);
+static GVariant *           cpdbCallBackendSync             (PrintBackend *             proxy,
+                                                             const char *               method,
+                                                             GVariant *                 parameters,
+                                                             const GVariantType *       reply_type,
+                                                             int                        timeout_msec,
+                                                             GCancellable *             cancellable,
+                                                             GError **                  error);
+static GVariant *           cpdbCallPrinterSync             (cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_call_t                call,
+                                                             const char *               method,
+                                                             GVariant *                 parameters,
+                                                             const GVariantType *       reply_type,
+                                                             GError **                  error);
+static void                 cpdbCallBackend                 (PrintBackend *             proxy,
+                                                             const char *               method,
+                                                             GVariant *                 parameters,
+                                                             const GVariantType *       reply_type,
+                                                             int                        timeout_msec,
+                                                             GCancellable *             cancellable,
+                                                             cpdb_call_callback         callback,
+                                                             gpointer                   user_data);
+static void                 cpdbCallPrinter                 (cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_call_t                call,
+                                                             const char *               method,
+                                                             GVariant *                 parameters,
+                                                             const GVariantType *       reply_type,
+                                                             cpdb_call_callback         callback,
+                                                             gpointer                   user_data);
+static cpdb_health_t *      cpdbGetHealth                   (PrintBackend *             proxy);
+static gboolean             cpdbIsBackendAvailable          (PrintBackend *             proxy);
+static void                 cpdbRecordBackendCall           (PrintBackend *             proxy,
+                                                             gint64                     started,
+                                                             const GError *             error);
+static void                 cpdbStopBackendProbe            (PrintBackend *             proxy);
                                              
 static GList *              cpdbLoadDefaultPrinters         (const char *               path);
 
@@ -19,11 +311,44 @@ static void                 cpdbUnpackOptions               (int
                                                              int                        num_media,
                                                              GVariant *                 media_var,
                                                              cpdb_options_t *           options);
+static cpdb_options_t *     cpdbOptionsFromReply            (GVariant *                 reply);
+static void                 cpdbSetPrinterOptions           (cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_options_t *           options,
+                                                             gboolean                   unpack);
+static cpdb_options_t *     cpdbGetPrinterOptions           (cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbReplacePrinterOptions       (cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_options_t *           options);
+static void                 cpdbEnsureOptionTables          (cpdb_options_t *           options);
+static char *               cpdbShareOptionString           (cpdb_options_t *           options,
+                                                             GHashTable *               strings,
+                                                             const char *               str);
+static void                 cpdbGroupOptions                (cpdb_options_t *           options,
+                                                             const cpdb_option_t *      unpacked,
+                                                             int                        num_options);
+static void                 cpdbFetchDetails                (cpdb_printer_obj_t *       printer_obj,
+                                                             cpdb_async_callback        caller_cb,
+                                                             cpdb_async_callback        cancelled_cb,
+                                                             void *                     user_data,
+                                                             gboolean                   unpack);
+static char *               cpdbGetOptionsCachePath         (const cpdb_printer_obj_t * printer_obj);
+static gboolean             cpdbLoadCachedOptions           (cpdb_printer_obj_t *       printer_obj,
+                                                             gboolean                   unpack,
+                                                             guint *                    generation);
+static void                 cpdbSaveCachedOptions           (const cpdb_printer_obj_t * printer_obj,
+                                                             guint                      generation,
+                                                             GVariant *                 reply);
+static guint                cpdbGetCapabilityGeneration     (cpdb_printer_obj_t *       printer_obj);
+static void                 cpdbCheckCapabilityGeneration   (cpdb_printer_obj_t *       printer_obj,
+                                                             guint                      generation,
+                                                             const GError *             error);
+static void                 cpdbValidateCachedOptions       (cpdb_printer_obj_t *       printer_obj,
+                                                             guint                      generation);
 static void                 cpdbUnpackJobArray              (GVariant *                 var,
                                                              int                        num_jobs,
                                                              cpdb_job_t *               jobs,
                                                              char *                     backend_name);
-static GHashTable *         cpdbUnpackTranslations          (GVariant *                 translations);
+static GHashTable *         cpdbUnpackTranslations          (GVariant *                 translations,
+                                                             cpdb_arena_t *             arena);
 static void                 add_to_hash_table               (gpointer                   key,
                                                              gpointer                   value, 
                                                              gpointer                   user_data);
@@ -45,20 +370,55 @@ cpdb_frontend_obj_t *cpdbGetNewFrontendObj(cpdb_printer_callback printer_cb)
                                        free,
                                        g_object_unref);
     f->num_printers = 0;
-    f->printer = g_hash_table_new_full(g_str_hash,
-                                       g_str_equal,
-                                       free,
-                                       NULL);
+    f->printer = g_hash_table_new(cpdbPrinterKeyHash,
+                                  cpdbPrinterKeyEqual);
+    f->activating_backends = g_hash_table_new_full(g_str_hash,
+                                                   g_str_equal,
+                                                   free,
+                                                   NULL);
+    f->cancellable = g_cancellable_new();
+    g_rec_mutex_init(&f->registry_lock);
+    g_mutex_init(&f->snapshot_lock);
+    f->pending_changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+    f->deferred_changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+    memcpy(f->timeouts, cpdb_default_timeouts, sizeof(f->timeouts));
     f->last_saved_settings = cpdbReadSettingsFromDisk();
+
+    /* Readers get an empty snapshot until the first printers come */
+    cpdbLockRegistry(f);
+    cpdbPublishPrinters(f);
+    cpdbUnlockRegistry(f);
     return f;
 }
 
+void cpdbShowCachedPrinters(cpdb_frontend_obj_t *f)
+{
+    if (f == NULL || f->connection != NULL)
+    {
+        logwarn("Invalid params: cpdbShowCachedPrinters()\n");
+        return;
+    }
+
+    cpdbLockRegistry(f);
+    cpdbLoadPrinterCatalog(f);
+    f->catalog_shown = TRUE;
+    f->registry_dirty = TRUE;
+    cpdbUnlockRegistry(f);
+}
+
 void cpdbDeleteFrontendObj(cpdb_frontend_obj_t *f)
 {
+    int i;
+
     if (f == NULL)
         return;
     logdebug("Deleting frontend obj \n");
 
+    cpdbCancelAllPrinterCalls(f);
+
+    /* Keep the changes since the initial enumeration for the next session */
+    if (f->catalog_synced)
+        cpdbSavePrinterCatalog(f);
     cpdbDisconnectFromDBus(f);
 
 
@@ -66,8 +426,39 @@ void cpdbDeleteFrontendObj(cpdb_frontend_obj_t *f)
         g_hash_table_destroy(f->backend);
     if (f->printer)
         g_hash_table_destroy(f->printer);
+    if (f->activating_backends)
+        g_hash_table_destroy(f->activating_backends);
+    if (f->cancellable)
+    {
+        g_cancellable_cancel(f->cancellable);
+        g_object_unref(f->cancellable);
+    }
+    if (f->batch)
+        cpdbFreeBatch(f->batch);
+    if (f->default_prefetch)
+        cpdbFreeDefaultPrefetch(f->default_prefetch);
+    if (f->search)
+        cpdbFreeSearchIndex(f->search);
+    for (i = 0; i < CPDB_SORT_COUNT; i++)
+    {
+        if (f->sorted[i])
+            cpdbFreeSortedView(f->sorted[i]);
+    }
+    if (f->snapshot)
+        cpdbUnrefPrinterSnapshot(f->snapshot);
+    g_mutex_clear(&f->snapshot_lock);
+    g_array_free(f->pending_changes, TRUE);
+    if (f->deferred_source)
+    {
+        g_source_destroy(f->deferred_source);
+        g_source_unref(f->deferred_source);
+    }
+    cpdbDropPrinterChanges(f->deferred_changes);
+    if (f->callback_context)
+        g_main_context_unref(f->callback_context);
+    g_rec_mutex_clear(&f->registry_lock);
     if (f->last_saved_settings)
-        cpdbDeleteSettings(f->last_saved_settings);
+        cpdbUnrefSettings(f->last_saved_settings);
     
     free(f);
 }
@@ -91,6 +482,264 @@ void cpdbPrinterCallback(cpdb_frontend_obj_t *f, cpdb_printer_obj_t *p, cpdb_pri
     }
 }
 
+/* Changes are made with the registry locked and only reported once it's
+ * unlocked, so that callbacks never run with the lock held */
+static void cpdbNotifyPrinterChange(cpdb_frontend_obj_t *f,
+                                    cpdb_printer_obj_t *p,
+                                    cpdb_printer_update_t change)
+{
+    cpdb_printer_change_t c = { p, change };
+
+    if (p == NULL)
+        return;
+
+    /* A removed printer is handed over to the callback already */
+    if (change != CPDB_CHANGE_PRINTER_REMOVED)
+        cpdbRefPrinterObj(p);
+    g_array_append_val(f->pending_changes, c);
+    f->registry_dirty = TRUE;
+}
+
+static void cpdbDeliverPrinterChange(cpdb_frontend_obj_t *f,
+                                     cpdb_printer_obj_t *p,
+                                     cpdb_printer_update_t change)
+{
+    if (f->printer_batch_cb)
+        cpdbQueuePrinterChange(f, p, change);
+    else if (f->printer_cb)
+        f->printer_cb(f, p, change);
+    else if (change == CPDB_CHANGE_PRINTER_REMOVED)
+        cpdbDeletePrinterObj(p);
+}
+
+/* Deliver changes taken from the registry and free them */
+static void cpdbDeliverPrinterChanges(cpdb_frontend_obj_t *f,
+                                      GArray *changes)
+{
+    cpdb_printer_change_t *c;
+    guint i;
+
+    for (i = 0; i < changes->len; i++)
+    {
+        c = &g_array_index(changes, cpdb_printer_change_t, i);
+        cpdbDeliverPrinterChange(f, c->printer, c->update);
+        if (c->update != CPDB_CHANGE_PRINTER_REMOVED)
+            cpdbUnrefPrinterObj(c->printer);
+    }
+    g_array_free(changes, TRUE);
+}
+
+/* Free changes nobody will get anymore */
+static void cpdbDropPrinterChanges(GArray *changes)
+{
+    cpdb_printer_change_t *c;
+    guint i;
+
+    for (i = 0; i < changes->len; i++)
+    {
+        c = &g_array_index(changes, cpdb_printer_change_t, i);
+        if (c->update == CPDB_CHANGE_PRINTER_REMOVED)
+            cpdbDeletePrinterObj(c->printer);
+        else
+            cpdbUnrefPrinterObj(c->printer);
+    }
+    g_array_free(changes, TRUE);
+}
+
+static gboolean cpdbOnDeferredChanges(gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = user_data;
+    GArray *changes;
+
+    cpdbLockRegistry(f);
+    changes = f->deferred_changes;
+    f->deferred_changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+    g_source_unref(f->deferred_source);
+    f->deferred_source = NULL;
+    cpdbUnlockRegistry(f);
+
+    cpdbDeliverPrinterChanges(f, changes);
+    return G_SOURCE_REMOVE;
+}
+
+/* Hand the pending changes of the background thread over to the main
+ * context which started it, the registry lock has to be held */
+static void cpdbDeferPrinterChanges(cpdb_frontend_obj_t *f)
+{
+    g_array_append_vals(f->deferred_changes,
+                        f->pending_changes->data,
+                        f->pending_changes->len);
+    g_array_set_size(f->pending_changes, 0);
+    if (f->deferred_source == NULL)
+    {
+        f->deferred_source = g_idle_source_new();
+        g_source_set_callback(f->deferred_source, cpdbOnDeferredChanges, f, NULL);
+        g_source_attach(f->deferred_source, f->callback_context);
+    }
+}
+
+static void cpdbFreeBatch(cpdb_batch_t *b)
+{
+    cpdb_printer_change_t *c;
+    guint i;
+
+    if (b->source)
+    {
+        g_source_destroy(b->source);
+        g_source_unref(b->source);
+    }
+    /* Nobody will get the removed printers anymore */
+    for (i = 0; i < b->changes->len; i++)
+    {
+        c = &g_array_index(b->changes, cpdb_printer_change_t, i);
+        if (c->printer && c->update == CPDB_CHANGE_PRINTER_REMOVED)
+            cpdbDeletePrinterObj(c->printer);
+    }
+    g_array_free(b->changes, TRUE);
+    g_hash_table_destroy(b->index);
+    if (b->context)
+        g_main_context_unref(b->context);
+    g_mutex_clear(&b->lock);
+    g_free(b);
+}
+
+static gboolean cpdbOnBatchWindowEnd(gpointer user_data)
+{
+    cpdbFlushPrinterChanges((cpdb_frontend_obj_t *) user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void cpdbQueuePrinterChange(cpdb_frontend_obj_t *f,
+                                   cpdb_printer_obj_t *p,
+                                   cpdb_printer_update_t change)
+{
+    cpdb_batch_t *b = f->batch;
+    cpdb_printer_change_t *c, new_change = { p, change };
+    guint pos;
+
+    g_mutex_lock(&b->lock);
+    pos = GPOINTER_TO_UINT(g_hash_table_lookup(b->index, p));
+    if (pos == 0)
+    {
+        g_array_append_val(b->changes, new_change);
+        g_hash_table_insert(b->index, p, GUINT_TO_POINTER(b->changes->len));
+    }
+    else
+    {
+        c = &g_array_index(b->changes, cpdb_printer_change_t, pos - 1);
+        if (change == CPDB_CHANGE_PRINTER_REMOVED &&
+            c->update == CPDB_CHANGE_PRINTER_ADDED)
+        {
+            /* Came and went within the batch */
+            g_hash_table_remove(b->index, p);
+            c->printer = NULL;
+            cpdbDeletePrinterObj(p);
+        }
+        else if (change == CPDB_CHANGE_PRINTER_REMOVED)
+        {
+            c->update = CPDB_CHANGE_PRINTER_REMOVED;
+        }
+        /* A change after an addition or another change is already covered */
+    }
+
+    if (b->source == NULL)
+    {
+        if (b->window_msec > 0)
+            b->source = g_timeout_source_new(b->window_msec);
+        else
+            b->source = g_idle_source_new();
+        g_source_set_callback(b->source, cpdbOnBatchWindowEnd, f, NULL);
+        g_source_attach(b->source, b->context);
+    }
+    g_mutex_unlock(&b->lock);
+}
+
+void cpdbFlushPrinterChanges(cpdb_frontend_obj_t *f)
+{
+    cpdb_batch_t *b;
+    GArray *changes;
+    cpdb_printer_change_t *c;
+    guint i, n = 0;
+
+    if (f == NULL || (b = f->batch) == NULL)
+    {
+        logwarn("Invalid params: cpdbFlushPrinterChanges()\n");
+        return;
+    }
+
+    g_mutex_lock(&b->lock);
+    changes = b->changes;
+    b->changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+    g_hash_table_remove_all(b->index);
+    if (b->source)
+    {
+        g_source_destroy(b->source);
+        g_source_unref(b->source);
+        b->source = NULL;
+    }
+    g_mutex_unlock(&b->lock);
+
+    /* Close the gaps left by the dropped changes */
+    for (i = 0; i < changes->len; i++)
+    {
+        c = &g_array_index(changes, cpdb_printer_change_t, i);
+        if (c->printer)
+            g_array_index(changes, cpdb_printer_change_t, n++) = *c;
+    }
+    g_array_set_size(changes, n);
+
+    if (n > 0)
+    {
+        logdebug("Delivering a batch of %u printer changes\n", n);
+        if (f->printer_batch_cb)
+        {
+            f->printer_batch_cb(f, (cpdb_printer_change_t *) changes->data, n);
+        }
+        else
+        {
+            for (i = 0; i < n; i++)
+            {
+                c = &g_array_index(changes, cpdb_printer_change_t, i);
+                cpdbDeliverPrinterChange(f, c->printer, c->update);
+            }
+        }
+    }
+    g_array_free(changes, TRUE);
+}
+
+void cpdbSetPrinterBatchCallback(cpdb_frontend_obj_t *f,
+                                 cpdb_printer_batch_callback batch_cb,
+                                 int window_msec)
+{
+    if (f == NULL)
+    {
+        logwarn("Invalid params: cpdbSetPrinterBatchCallback()\n");
+        return;
+    }
+
+    if (f->batch == NULL)
+    {
+        f->batch = g_new0(cpdb_batch_t, 1);
+        g_mutex_init(&f->batch->lock);
+        f->batch->changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+        f->batch->index = g_hash_table_new(NULL, NULL);
+    }
+    g_mutex_lock(&f->batch->lock);
+    f->batch->window_msec = MAX(window_msec, 0);
+    /* Changes are queued from whatever thread the backend calls or
+     * signals got dispatched in, batches go to the caller's one */
+    if (f->batch->context)
+        g_main_context_unref(f->batch->context);
+    f->batch->context = g_main_context_ref_thread_default();
+    g_mutex_unlock(&f->batch->lock);
+
+    /* Pending changes go to the new callback, or one by one to the
+     * printer callback if batching gets turned off */
+    f->printer_batch_cb = batch_cb;
+    if (batch_cb == NULL)
+        cpdbFlushPrinterChanges(f);
+}
+
 void cpdbOnPrinterAdded(GDBusConnection *connection,
                         const gchar *sender_name,
                         const gchar *object_path,
@@ -100,17 +749,12 @@ void cpdbOnPrinterAdded(GDBusConnection *connection,
                         gpointer user_data)
 {
     cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
-    cpdb_printer_obj_t *p = cpdbGetNewPrinterObj();
-    
-    /* If some previously saved settings were retrieved, 
-     * use them in this new cpdb_printer_obj_t */
-    if (f->last_saved_settings != NULL)
-    {
-        cpdbCopySettings(f->last_saved_settings, p->settings);
-    }
-    cpdbFillBasicOptions(p, parameters);
-    cpdbAddPrinter(f, p);
-    f->printer_cb(f, p, CPDB_CHANGE_PRINTER_ADDED);
+    cpdb_printer_record_t record;
+
+    cpdbGetPrinterRecord(parameters, &record);
+    cpdbLockRegistry(f);
+    cpdbMergePrinter(f, &record, TRUE);
+    cpdbUnlockRegistry(f);
 }
 
 void cpdbOnPrinterRemoved(GDBusConnection *connection,
@@ -125,9 +769,11 @@ void cpdbOnPrinterRemoved(GDBusConnection *connection,
     char *printer_id;
     char *backend_name;
     
-    g_variant_get(parameters, "(ss)", &printer_id, &backend_name);
+    g_variant_get(parameters, "(&s&s)", &printer_id, &backend_name);
+    cpdbLockRegistry(f);
     cpdb_printer_obj_t *p = cpdbRemovePrinter(f, printer_id, backend_name);
-    f->printer_cb(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    cpdbUnlockRegistry(f);
 }
 
 void cpdbOnPrinterStateChanged(GDBusConnection *connection,
@@ -142,17 +788,100 @@ void cpdbOnPrinterStateChanged(GDBusConnection *connection,
     gboolean printer_is_accepting_jobs;
     char *printer_id, *printer_state, *backend_name;
 
-    g_variant_get(parameters, "(ssbs)", &printer_id, &printer_state,
+    g_variant_get(parameters, "(&s&sb&s)", &printer_id, &printer_state,
                     &printer_is_accepting_jobs, &backend_name);
-    cpdb_printer_obj_t *p = cpdbFindPrinterObj(f, printer_id, backend_name);
-    if (p->state)
-        free(p->state);
-    p->state = g_strdup(printer_state);
-    p->accepting_jobs = printer_is_accepting_jobs;
-    f->printer_cb(f, p, CPDB_CHANGE_PRINTER_STATE_CHANGED);
+    cpdbLockRegistry(f);
+    cpdbUpdatePrinterState(f, printer_id, backend_name,
+                           printer_state, printer_is_accepting_jobs);
+    cpdbUnlockRegistry(f);
 }
 
-GDBusConnection *cpdbGetDbusConnection()
+void cpdbOnPrintersChanged(GDBusConnection *connection,
+                           const gchar *sender_name,
+                           const gchar *object_path,
+                           const gchar *interface_name,
+                           const gchar *signal_name,
+                           GVariant *parameters,
+                           gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *) user_data;
+    GVariantIter *printers, *removed, *states;
+    GVariant *printer;
+    PrintBackend *proxy;
+    cpdb_printer_record_t record;
+    cpdb_printer_obj_t *p;
+    const char *backend_name, *printer_id, *printer_state;
+    gboolean printer_is_accepting_jobs;
+    guint previous, generation;
+
+    if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE(CPDB_PRINTERS_CHANGED_ARGS)))
+    {
+        logwarn("Ignoring %s signal with unexpected arguments %s\n",
+                CPDB_SIGNAL_PRINTERS_CHANGED, g_variant_get_type_string(parameters));
+        return;
+    }
+    g_variant_get(parameters, "(&suua(v)asa(ssb))", &backend_name, &previous,
+                  &generation, &printers, &removed, &states);
+    logdebug("Got a batch of %d added, %d removed and %d changed printers from %s\n",
+             (int) g_variant_iter_n_children(printers),
+             (int) g_variant_iter_n_children(removed),
+             (int) g_variant_iter_n_children(states), backend_name);
+
+    cpdbLockRegistry(f);
+    while (g_variant_iter_loop(printers, "(v)", &printer))
+    {
+        cpdbGetPrinterRecord(printer, &record);
+        if (strcmp(record.backend_name, backend_name) == 0)
+            cpdbMergePrinter(f, &record, TRUE);
+    }
+    while (g_variant_iter_next(removed, "&s", &printer_id))
+    {
+        if (cpdbLookupPrinter(f, printer_id, backend_name) == NULL)
+            continue;
+        p = cpdbRemovePrinter(f, printer_id, backend_name);
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    }
+    while (g_variant_iter_next(states, "(&s&sb)", &printer_id, &printer_state,
+                               &printer_is_accepting_jobs))
+    {
+        cpdbUpdatePrinterState(f, printer_id, backend_name,
+                               printer_state, printer_is_accepting_jobs);
+    }
+
+    /* Our view is current if we had seen everything before this batch,
+     * which we can't tell if we haven't synced with this instance yet */
+    proxy = g_hash_table_lookup(f->backend, backend_name);
+    if (proxy && previous != 0 &&
+        GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(proxy),
+                                           CPDB_GENERATION_KEY)) == previous)
+        g_object_set_data(G_OBJECT(proxy), CPDB_GENERATION_KEY, GUINT_TO_POINTER(generation));
+    cpdbUnlockRegistry(f);
+
+    g_variant_iter_free(printers);
+    g_variant_iter_free(removed);
+    g_variant_iter_free(states);
+}
+
+static void cpdbUpdatePrinterState(cpdb_frontend_obj_t *f,
+                                   const char *printer_id,
+                                   const char *backend_name,
+                                   const char *state,
+                                   gboolean accepting_jobs)
+{
+    cpdb_printer_obj_t *p;
+
+    if ((p = cpdbLookupPrinter(f, printer_id, backend_name)) == NULL)
+        return;
+    state = cpdbInternString(state);
+    if (p->state == state && p->accepting_jobs == accepting_jobs)
+        return;
+
+    p->state = (char *) state;
+    p->accepting_jobs = accepting_jobs;
+    cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_STATE_CHANGED);
+}
+
+static GDBusConnection *cpdbNewDbusConnection()
 {
     gchar *bus_addr;
     GError *error = NULL;
@@ -161,6 +890,12 @@ GDBusConnection *cpdbGetDbusConnection()
     bus_addr = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION,
                                                NULL,
                                                &error);
+    if (error)
+    {
+        logerror("Error acquiring bus address : %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
     
     connection = g_dbus_connection_new_for_address_sync(bus_addr,
                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
@@ -168,26 +903,61 @@ GDBusConnection *cpdbGetDbusConnection()
                                                         NULL,
                                                         NULL,
                                                         &error);
+    g_free(bus_addr);
     if (error)
     {
         logerror("Error acquiring bus connection : %s\n", error->message);
+        g_error_free(error);
         return NULL;
     }
     logdebug("Acquired bus connection\n");
     return connection;
 }
 
-void cpdbConnectToDBus(cpdb_frontend_obj_t *f)
+GDBusConnection *cpdbGetDbusConnection()
+{
+    GDBusConnection *connection = NULL;
+
+    G_LOCK(shared_connection);
+    if (shared_connection && g_dbus_connection_is_closed(shared_connection))
+    {
+        if (!lazy_reconnect)
+        {
+            logerror("Error acquiring bus connection : Connection was closed\n");
+            goto out;
+        }
+        loginfo("Bus connection was closed, reconnecting\n");
+        g_clear_object(&shared_connection);
+    }
+
+    if (shared_connection == NULL)
+        shared_connection = cpdbNewDbusConnection();
+    if (shared_connection)
+        connection = g_object_ref(shared_connection);
+
+out:
+    G_UNLOCK(shared_connection);
+    return connection;
+}
+
+void cpdbSetDbusLazyReconnect(gboolean enabled)
+{
+    G_LOCK(shared_connection);
+    lazy_reconnect = enabled;
+    G_UNLOCK(shared_connection);
+}
+
+static gboolean cpdbConnectSignals(cpdb_frontend_obj_t *f)
 {
-    GMainContext *context;
     GError *error = NULL;
 
-    if ((f->connection = cpdbGetDbusConnection()) == NULL)
+    if ((f->connection = cpdbNewDbusConnection()) == NULL)
     {
         loginfo("Couldn't connect to DBus\n");
-        return;
+        return FALSE;
     }
     
+    f->printer_added_id =
     g_dbus_connection_signal_subscribe(f->connection,
                                        NULL,                            //Sender name
                                        "org.openprinting.PrintBackend", //Sender interface
@@ -199,6 +969,7 @@ void cpdbConnectToDBus(cpdb_frontend_obj_t *f)
                                        f,                            //user_data
                                        NULL);
 
+    f->printer_removed_id =
     g_dbus_connection_signal_subscribe(f->connection,
                                        NULL,                            //Sender name
                                        "org.openprinting.PrintBackend", //Sender interface
@@ -209,6 +980,7 @@ void cpdbConnectToDBus(cpdb_frontend_obj_t *f)
                                        cpdbOnPrinterRemoved,              //callback
                                        f,                            //user_data
                                        NULL);
+    f->printer_state_changed_id =
     g_dbus_connection_signal_subscribe(f->connection,
                                        NULL,                                //Sender name
                                        "org.openprinting.PrintBackend",     //Sender interface
@@ -219,16 +991,54 @@ void cpdbConnectToDBus(cpdb_frontend_obj_t *f)
                                        cpdbOnPrinterStateChanged,            //callback
                                        f,                                //user_data
                                        NULL);
+    f->printers_changed_id =
+    g_dbus_connection_signal_subscribe(f->connection,
+                                       NULL,                                //Sender name
+                                       "org.openprinting.PrintBackend",     //Sender interface
+                                       CPDB_SIGNAL_PRINTERS_CHANGED,        //Signal name
+                                       NULL,                                /**match on all object paths**/
+                                       NULL,                                /**match on all arguments**/
+                                       0,                                   //Flags
+                                       cpdbOnPrintersChanged,               //callback
+                                       f,                                //user_data
+                                       NULL);
 
 
     if (error)
     {
         logerror("Error exporting frontend interface : %s\n", error->message);
-        return;
+        return FALSE;
     }
-    
+
+    return TRUE;
+}
+
+void cpdbConnectToDBus(cpdb_frontend_obj_t *f)
+{
+    if (!cpdbConnectSignals(f))
+        return;
+
     cpdbActivateBackends(f); 
-    
+
+    /* Backends coming and going from now on are picked up by the
+     * background thread, if it is running */
+    if (f->background_context)
+        cpdbScheduleBackendWatch(f);
+}
+
+void cpdbConnectToDBusAsync(cpdb_frontend_obj_t *f)
+{
+    if (!cpdbConnectSignals(f))
+    {
+        if (f->enumeration_cb)
+            f->enumeration_cb(f, NULL, CPDB_ENUMERATION_COMPLETE);
+        return;
+    }
+
+    cpdbStartActivation(f, TRUE, FALSE);
+
+    if (f->background_context)
+        cpdbScheduleBackendWatch(f);
 }
 
 void stopListingLookup(gpointer key, gpointer value, gpointer user_data){
@@ -239,111 +1049,255 @@ void stopListingLookup(gpointer key, gpointer value, gpointer user_data){
 
 void cpdbDisconnectFromDBus(cpdb_frontend_obj_t *f)
 {
-    if (f->connection == NULL || g_dbus_connection_is_closed(f->connection))
+    GHashTableIter iter;
+    gpointer key, value;
+    guint *signal_ids[] = {
+        &f->printer_added_id,
+        &f->printer_removed_id,
+        &f->printer_state_changed_id,
+        &f->printers_changed_id,
+        &f->name_owner_changed_id,
+        &f->activatable_changed_id,
+        NULL
+    };
+
+    if (f->connection == NULL)
     {
         logwarn("Already disconnected from DBus\n");
         return;
     }
-    g_hash_table_foreach(f->backend, stopListingLookup, NULL);
-    g_dbus_connection_flush_sync(f->connection, NULL, NULL);
-    g_dbus_connection_close_sync(f->connection, NULL, NULL);
+    /* Abort activations still in flight */
+    g_cancellable_cancel(f->cancellable);
+    g_object_unref(f->cancellable);
+    f->cancellable = g_cancellable_new();
+    cpdbLockRegistry(f);
+    if (f->background_cancellable)
+    {
+        g_cancellable_cancel(f->background_cancellable);
+        g_object_unref(f->background_cancellable);
+        f->background_cancellable = g_cancellable_new();
+    }
+    g_hash_table_remove_all(f->activating_backends);
+    cpdbUnlockRegistry(f);
+
+    if (!g_dbus_connection_is_closed(f->connection))
+        cpdbForeachBackend(f, stopListingLookup, NULL);
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->backend);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        cpdbStopBackendProbe(value);
+    cpdbUnlockRegistry(f);
+
+    /* The printers' proxies keep the connection alive, so nothing may
+     * call back into f */
+    for (int i = 0; signal_ids[i]; i++)
+    {
+        if (*signal_ids[i])
+            g_dbus_connection_signal_unsubscribe(f->connection, *signal_ids[i]);
+        *signal_ids[i] = 0;
+    }
+    if (!g_dbus_connection_is_closed(f->connection))
+    {
+        g_dbus_connection_flush_sync(f->connection, NULL, NULL);
+        g_dbus_connection_close_sync(f->connection, NULL, NULL);
+    }
     g_clear_object(&f->connection);
 }
 
-static void fetchPrinterListFromBackend(cpdb_frontend_obj_t *f, const char *backend)
+static void cpdbGetPrinterRecord(GVariant *printer,
+                                 cpdb_printer_record_t *r)
+{
+    g_variant_get(printer, "(&s&s&s&s&sb&s&s)",
+                  &r->id,
+                  &r->name,
+                  &r->info,
+                  &r->location,
+                  &r->make_and_model,
+                  &r->accepting_jobs,
+                  &r->state,
+                  &r->backend_name);
+}
+
+/* Bring the printers of a backend in line with the full list it sent:
+ * add the new ones, update the known ones in place and remove the ones
+ * missing from the list, reporting only what changed */
+static void cpdbSyncBackendPrinters(cpdb_frontend_obj_t *f,
+                                    const char *backend_name,
+                                    GVariant *printers,
+                                    gboolean notify)
 {
-    int num_printers;
     GVariantIter iter;
-    GVariant *printers, *printer;
-    PrintBackend *proxy;
-    GError *error = NULL;
+    GVariant *printer;
+    GHashTableIter hash_iter;
+    gpointer key, value;
+    GHashTable *listed;
+    GList *gone = NULL, *l;
+    cpdb_printer_record_t record;
     cpdb_printer_obj_t *p;
 
-    if ((proxy = g_hash_table_lookup(f->backend, backend)) == NULL)
+    listed = g_hash_table_new(NULL, NULL);
+    g_variant_iter_init(&iter, printers);
+    while (g_variant_iter_loop(&iter, "(v)", &printer))
     {
-        logerror("Couldn't get %s proxy object\n", backend);
-        return;
+        cpdbGetPrinterRecord(printer, &record);
+        if ((p = cpdbMergePrinter(f, &record, notify)) != NULL)
+            g_hash_table_add(listed, p);
     }
-    print_backend_call_get_all_printers_sync (proxy, &num_printers,
-                                                &printers, NULL, &error);
-    if (error)
+
+    g_hash_table_iter_init(&hash_iter, f->printer);
+    while (g_hash_table_iter_next(&hash_iter, &key, &value))
     {
-        logerror("Error getting %s printer list : %s\n", backend, error->message);
-        return;
+        p = value;
+        if (strcmp(p->backend_name, backend_name) == 0 &&
+            !g_hash_table_contains(listed, p))
+            gone = g_list_prepend(gone, p);
     }
-    logdebug("Fetched %d printers from backend %s\n", num_printers, backend);
-    g_variant_iter_init(&iter, printers);
-    while (g_variant_iter_loop(&iter, "(v)", &printer))
+    for (l = gone; l != NULL; l = l->next)
     {
-        p = cpdbGetNewPrinterObj();
-        cpdbFillBasicOptions(p, printer);
-        if (f->last_saved_settings != NULL)
-            cpdbCopySettings(f->last_saved_settings, p->settings);
-        cpdbAddPrinter(f, p);
+        p = l->data;
+        p = cpdbRemovePrinter(f, p->id, p->backend_name);
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    }
+
+    logdebug("Synced %u printers of backend %s, %u removed\n",
+             g_hash_table_size(listed), backend_name, g_list_length(gone));
+    g_list_free(gone);
+    g_hash_table_destroy(listed);
+}
+
+/* Ask a backend for what changed in its printer list since the last
+ * generation we saw, and apply it. A backend may answer with its whole
+ * list instead, e.g. if it can't tell what changed since then. */
+static gboolean cpdbApplyPrinterChanges(cpdb_frontend_obj_t *f,
+                                        const char *backend,
+                                        PrintBackend *proxy,
+                                        GError **error)
+{
+    GVariant *reply, *printers, *removed;
+    GVariantIter iter;
+    GVariant *printer;
+    const char *printer_id;
+    cpdb_printer_record_t record;
+    cpdb_printer_obj_t *p;
+    guint since, generation;
+    gboolean full;
+
+    since = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(proxy), CPDB_GENERATION_KEY));
+    reply = cpdbCallBackendSync(proxy,
+                                "GetPrinterChanges",
+                                g_variant_new("(u)", since),
+                                G_VARIANT_TYPE(CPDB_PRINTER_CHANGES_REPLY_ARGS),
+                                f->timeouts[CPDB_CALL_LISTING],
+                                NULL,
+                                error);
+    if (reply == NULL)
+        return FALSE;
+
+    g_variant_get(reply, "(ub@a(v)@as)", &generation, &full, &printers, &removed);
+    logdebug("Fetched %s changes %u..%u from backend %s : %d printers, %d removed\n",
+             full ? "full" : "incremental", since, generation, backend,
+             (int) g_variant_n_children(printers), (int) g_variant_n_children(removed));
+
+    cpdbLockRegistry(f);
+    if (full)
+    {
+        cpdbSyncBackendPrinters(f, backend, printers, TRUE);
+    }
+    else
+    {
+        g_variant_iter_init(&iter, printers);
+        while (g_variant_iter_loop(&iter, "(v)", &printer))
+        {
+            cpdbGetPrinterRecord(printer, &record);
+            if (strcmp(record.backend_name, backend) == 0)
+                cpdbMergePrinter(f, &record, TRUE);
+        }
+
+        g_variant_iter_init(&iter, removed);
+        while (g_variant_iter_next(&iter, "&s", &printer_id))
+        {
+            if (cpdbLookupPrinter(f, printer_id, backend) == NULL)
+                continue;
+            p = cpdbRemovePrinter(f, printer_id, backend);
+            cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+        }
     }
+    g_object_set_data(G_OBJECT(proxy), CPDB_GENERATION_KEY, GUINT_TO_POINTER(generation));
+    cpdbUnlockRegistry(f);
+
+    g_variant_unref(printers);
+    g_variant_unref(removed);
+    g_variant_unref(reply);
+    return TRUE;
 }
 
 bool cpdbRefreshPrinterList(cpdb_frontend_obj_t *f, const char *backend)
 { 
-    int num_printers; 
-    GVariantIter iter; 
-    GVariant *printers, *printer;
+    GVariant *reply, *printers;
     PrintBackend *proxy; 
     GError *error = NULL; 
-    cpdb_printer_obj_t *p; 
+    bool ret = false;
  
-    if ((proxy = g_hash_table_lookup(f->backend, backend)) == NULL) 
+    /* No lock held during the calls, the proxy stays ours even if
+     * the backend goes away meanwhile */
+    if ((proxy = cpdbRefBackend(f, backend)) == NULL) 
     { 
         logerror("Couldn't get %s proxy object\n", backend); 
         return false; 
     } 
-    print_backend_call_get_all_printers_sync (proxy, &num_printers, 
-                                                &printers, NULL, &error); 
+    if (!cpdbIsBackendAvailable(proxy))
+    {
+        logwarn("Not refreshing printers of %s : Backend isn't answering\n", backend);
+        goto out;
+    }
+
+    if (g_object_get_data(G_OBJECT(proxy), CPDB_NO_CHANGES_KEY) == NULL)
+    {
+        if (cpdbApplyPrinterChanges(f, backend, proxy, &error))
+        {
+            ret = true;
+            goto out;
+        }
+        if (!g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+            logerror("Error getting %s printer changes : %s\n", backend, error->message);
+            g_error_free(error);
+            goto out;
+        }
+        /* Older backend, always fetch the whole list from now on */
+        logdebug("Backend %s doesn't report printer changes\n", backend);
+        g_object_set_data(G_OBJECT(proxy), CPDB_NO_CHANGES_KEY, GINT_TO_POINTER(TRUE));
+        g_clear_error(&error);
+    }
+
+    reply = cpdbCallBackendSync(proxy,
+                                "GetAllPrinters",
+                                NULL,
+                                G_VARIANT_TYPE("(ia(v))"),
+                                f->timeouts[CPDB_CALL_LISTING],
+                                NULL,
+                                &error);
     if (error) 
     { 
         logerror("Error getting %s printer list : %s\n", backend, error->message); 
-        return false; 
-    } 
-    logdebug("Fetched %d printers from backend %s\n", num_printers, backend); 
-    g_variant_iter_init(&iter, printers); 
-    while (g_variant_iter_loop(&iter, "(v)", &printer)) 
-    { 
-        p = cpdbGetNewPrinterObj(); 
-        cpdbFillBasicOptions(p, printer); 
-        if (f->last_saved_settings != NULL) 
-            cpdbCopySettings(f->last_saved_settings, p->settings); 
-        cpdbAddPrinter(f, p); 
+        g_error_free(error);
+        goto out;
     } 
- 
-    GHashTableIter iterator; 
-    gpointer key, value; 
- 
-    g_hash_table_iter_init(&iterator, f->printer); 
- 
-    while (g_hash_table_iter_next(&iterator, &key, &value)) { 
-        cpdb_printer_obj_t* printer_obj = (cpdb_printer_obj_t*)value; 
-        char* backend_name = printer_obj->backend_name; 
- 
-        // Compare the backend_name with the provided one 
-        if (strcmp(backend_name, backend) == 0) { 
-            // Check if backend_name is not in the printers hashtable 
-            char *printer_name = cpdbConcatSep(printer_obj->id, backend_name); 
-            g_variant_iter_init(&iter, printers); 
-            int printer_exists = 0;
-            while (g_variant_iter_loop(&iter, "(v)", &printer)) 
-            { 
-                cpdb_printer_obj_t *temp = cpdbGetNewPrinterObj();
-                cpdbFillBasicOptions(temp, printer);
-                if (strcmp(temp->name, printer_obj->name) == 0){
-                    printer_exists = 1;
-                    break;
-                }
-                cpdbDeletePrinterObj(temp);
-            }
-            if(printer_exists == 0) cpdbRemovePrinter(f, printer_obj->id, backend_name);
-        }
-    }
-    return true;
+
+    printers = g_variant_get_child_value(reply, 1);
+    logdebug("Fetched %d printers from backend %s\n",
+             (int) g_variant_n_children(printers), backend);
+    cpdbLockRegistry(f);
+    cpdbSyncBackendPrinters(f, backend, printers, TRUE);
+    cpdbUnlockRegistry(f);
+
+    g_variant_unref(printers);
+    g_variant_unref(reply);
+    ret = true;
+
+out:
+    g_object_unref(proxy);
+    return ret;
 }
 
 // Helper function to add existing backends to a hash table
@@ -352,715 +1306,3760 @@ static void add_to_hash_table(gpointer key, gpointer value, gpointer user_data)
     g_hash_table_add(hash_table, key);
 }
 
-void cpdbActivateBackends(cpdb_frontend_obj_t *f) {
-    int len, i;
-    char *service_name, *backend_suffix;
-    GDBusProxy *dbus_proxy;
-    PrintBackend *backend_proxy;
-    GVariantIter iter;
+static GVariant *cpdbListBusNames(GDBusConnection *connection,
+                                  const char *method)
+{
     GError *error = NULL;
-    GVariant *service_names, *service_names_tuple;
-    GHashTable *existing_backends;
-    GHashTableIter hash_iter;
-    gpointer key, value;
-    const char * const name_lists[] = {
-        "ListNames",
-        "ListActivatableNames",
-        NULL
-    };
-
-    // Create a hash table to track existing backends
-    existing_backends = g_hash_table_new(g_str_hash, g_str_equal);
-    g_hash_table_foreach(f->backend, add_to_hash_table, existing_backends);
-
-    logdebug("Activating backends\n");
-    dbus_proxy = g_dbus_proxy_new_sync(f->connection,
-                                       G_DBUS_PROXY_FLAGS_NONE,
-                                       NULL,
-                                       "org.freedesktop.DBus",
-                                       "/org/freedesktop/DBus",
-                                       "org.freedesktop.DBus",
-                                       NULL,
-                                       &error);
+    GVariant *service_names_tuple, *service_names;
+
+    service_names_tuple = g_dbus_connection_call_sync(connection,
+                                                      "org.freedesktop.DBus",
+                                                      "/org/freedesktop/DBus",
+                                                      "org.freedesktop.DBus",
+                                                      method,
+                                                      NULL,
+                                                      G_VARIANT_TYPE("(as)"),
+                                                      G_DBUS_CALL_FLAGS_NONE,
+                                                      -1,
+                                                      NULL,
+                                                      &error);
     if (error) {
-        logerror("Error getting dbus proxy: %s", error->message);
+        logerror("Couldn't get service names (%s): %s", method, error->message);
         g_error_free(error);
-        g_hash_table_destroy(existing_backends);
-        return;
+        return NULL;
     }
 
-    for (i = 0; name_lists[i]; i++) {
-        service_names_tuple = g_dbus_proxy_call_sync(dbus_proxy,
-                                                     name_lists[i],
-                                                     NULL,
-                                                     G_DBUS_CALL_FLAGS_NONE,
-                                                     -1,
-                                                     NULL,
-                                                     &error);
-        if (error) {
-            logerror("Couldn't get service names (%s): %s",
-                     name_lists[i], error->message);
-            g_error_free(error);
-            continue;
-        }
+    service_names = g_variant_get_child_value(service_names_tuple, 0);
+    g_variant_unref(service_names_tuple);
+    return service_names;
+}
 
-        service_names = g_variant_get_child_value(service_names_tuple, 0);
+static gboolean cpdbIsActivatableName(GDBusConnection *connection,
+                                      const char *name)
+{
+    GVariantIter iter;
+    GVariant *service_names;
+    const char *service_name;
+    gboolean found = FALSE;
 
-        len = strlen(CPDB_BACKEND_PREFIX);
-        g_variant_iter_init(&iter, service_names);
-        while (g_variant_iter_next(&iter, "s", &service_name)) {
-            if (g_str_has_prefix(service_name, CPDB_BACKEND_PREFIX)) {
-                backend_suffix = g_strdup(service_name + len);
-                if (!g_hash_table_lookup(f->backend, backend_suffix)) {
-                    loginfo("Found backend %s (%s)\n", backend_suffix,
-                            i ? "Starting now" : "Already running");
-                    backend_proxy = cpdbCreateBackend(f->connection, service_name);
-                    if (backend_proxy) {
-                        g_hash_table_insert(f->backend, strdup(backend_suffix), backend_proxy);
-                        f->num_backends++;
-                        if (!g_hash_table_contains(existing_backends, backend_suffix)) {
-                            fetchPrinterListFromBackend(f, backend_suffix);
-                        }
-                    }
-                }
-                g_hash_table_remove(existing_backends, backend_suffix);
-                g_free(backend_suffix);
-            }
-        }
+    if ((service_names = cpdbListBusNames(connection, "ListActivatableNames")) == NULL)
+        return FALSE;
 
-        g_variant_unref(service_names);
-        g_variant_unref(service_names_tuple);
-    }
+    g_variant_iter_init(&iter, service_names);
+    while (!found && g_variant_iter_next(&iter, "&s", &service_name))
+        found = (strcmp(service_name, name) == 0);
 
-    // Remove backends that are no longer present
-    g_hash_table_iter_init(&hash_iter, existing_backends);
-    while (g_hash_table_iter_next(&hash_iter, &key, &value)) {
-        loginfo("Removing backend %s\n", (char *)key);
-        g_hash_table_remove(f->backend, key);
-    }
+    g_variant_unref(service_names);
+    return found;
+}
 
-    g_hash_table_destroy(existing_backends);
-    g_object_unref(dbus_proxy);
+/**
+ * One round of backend activations. The backends get activated and
+ * their printers fetched concurrently, the activation is finished when
+ * the last of them has answered.
+ */
+struct cpdb_activation_s
+{
+    cpdb_frontend_obj_t *f;
+    gboolean notify;            /** Report the fetched printers through the printer callback */
+    gboolean initial;           /** Initial enumeration, report its completion */
+    gboolean waiting;           /** Someone iterates the main context until we are done */
+    int pending;                /** Backends in flight, plus one while still issuing */
+    gboolean background;        /** Started by the background thread, drained when it stops */
+    GCancellable *cancellable;  /** Cancelled when the frontend disconnects */
+    GHashTable *installed;      /** Names of the backends found on the bus, initial only */
+};
 
-    if (f->hide_remote) cpdbHideRemotePrinters(f);
-    if (f->hide_temporary) cpdbHideTemporaryPrinters(f);
-}
+typedef struct {
+    cpdb_activation_t *activation;
+    char *backend_name;
+    gint64 started;             /** When the printers were requested */
+} cpdb_backend_activation_t;
 
-gpointer background_thread(gpointer user_data) {
-    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
-    while (1) {
-        for (int i = 0; i < 50; i ++) {
-            if (f->stop_flag) break;
-            usleep(100000);
-        }
-        if (f->stop_flag) break;
-        cpdbActivateBackends(f);
-    }
-}
+static cpdb_activation_t *cpdbNewActivation(cpdb_frontend_obj_t *f,
+                                            gboolean notify)
+{
+    cpdb_activation_t *a = g_new0(cpdb_activation_t, 1);
 
-// Start the background thread
-void cpdbStartBackendListRefreshing(cpdb_frontend_obj_t *f) {
-    f->stop_flag = FALSE;
-    f->background_thread = g_thread_new("background_thread", background_thread, f);
+    a->f = f;
+    a->notify = notify;
+    a->pending = 1;
+    a->cancellable = g_object_ref(f->cancellable);
+    return a;
 }
 
-// Stop the background thread
-void cpdbStopBackendListRefreshing(cpdb_frontend_obj_t *f) {
-    f->stop_flag = TRUE;
-    g_thread_join(f->background_thread);
+/* Activation of backends found by the background thread, which is
+ * also cancelled when the thread stops */
+static cpdb_activation_t *cpdbNewBackgroundActivation(cpdb_frontend_obj_t *f)
+{
+    cpdb_activation_t *a = cpdbNewActivation(f, TRUE);
+
+    a->background = TRUE;
+    g_object_unref(a->cancellable);
+    cpdbLockRegistry(f);
+    a->cancellable = g_object_ref(f->background_cancellable);
+    cpdbUnlockRegistry(f);
+    g_atomic_int_inc(&f->background_activations);
+    return a;
 }
 
-cpdb_frontend_obj_t *cpdbStartListingPrinters(cpdb_printer_callback printer_cb){
-    cpdbInit();
-    cpdb_frontend_obj_t *f = cpdbGetNewFrontendObj(printer_cb);
-    cpdbConnectToDBus(f);
-    cpdbStartBackendListRefreshing(f); // Start bg task to check for backends coming/going
-    return f;
+static void cpdbDeleteActivation(cpdb_activation_t *a)
+{
+    if (a->background)
+        g_atomic_int_add(&a->f->background_activations, -1);
+    g_object_unref(a->cancellable);
+    if (a->installed)
+        g_hash_table_destroy(a->installed);
+    free(a);
 }
 
-void cpdbStopListingPrinters(cpdb_frontend_obj_t *f){
-    cpdbStopBackendListRefreshing(f); // Stop bg task
-    cpdbDeleteFrontendObj(f);
+static gboolean cpdbNeedsActivation(cpdb_frontend_obj_t *f,
+                                    const char *backend_name)
+{
+    gboolean needed;
+
+    cpdbLockRegistry(f);
+    needed = !g_hash_table_contains(f->backend, backend_name) &&
+             !g_hash_table_contains(f->activating_backends, backend_name);
+    cpdbUnlockRegistry(f);
+    return needed;
 }
 
-PrintBackend *cpdbCreateBackend(GDBusConnection *connection,
-                                const char *service_name)
+static void cpdbFinishActivation(cpdb_activation_t *a)
 {
-    FILE *file = NULL;
-    PrintBackend *proxy;
-    GError *error = NULL;
-    char *path, *backend_name;
-    const char *info_dir_name;
-    char obj_path[CPDB_BSIZE];
-    
-    backend_name = g_strdup(service_name);
-    proxy = print_backend_proxy_new_sync(connection,
-                                         0,
-                                         backend_name,
-                                         CPDB_BACKEND_OBJ_PATH,
-                                         NULL,
-                                         &error);
-    if (error)
+    cpdb_frontend_obj_t *f = a->f;
+
+    if (--a->pending > 0)
+        return;
+
+    if (!g_cancellable_is_cancelled(a->cancellable))
     {
-        logerror("Error creating backend proxy for %s : %s\n",
-                    backend_name, error->message);
-        return NULL;
+        logdebug("Finished activating backends\n");
+        if (a->initial)
+        {
+            /* Backends which answered already dropped their catalog
+             * printers they didn't list, the ones of backends which
+             * failed to answer are kept until they do. Only the ones
+             * of backends which are gone from the bus are dropped. */
+            cpdbLockRegistry(f);
+            cpdbRemoveUninstalledPrinters(f, a->installed);
+            f->catalog_synced = TRUE;
+            cpdbUnlockRegistry(f);
+            cpdbSavePrinterCatalog(f);
+            if (f->enumeration_cb)
+                f->enumeration_cb(f, NULL, CPDB_ENUMERATION_COMPLETE);
+        }
     }
-    return proxy;
+    if (!a->waiting)
+        cpdbDeleteActivation(a);
 }
 
-void cpdbIgnoreLastSavedSettings(cpdb_frontend_obj_t *f)
+static void cpdbFinishBackendActivation(cpdb_backend_activation_t *ba,
+                                        gboolean report)
 {
-    loginfo("Ignoring previous settings\n");
-    cpdbDeleteSettings(f->last_saved_settings);
-    f->last_saved_settings = cpdbGetNewSettings();
-}
+    cpdb_activation_t *a = ba->activation;
+    cpdb_frontend_obj_t *f = a->f;
+    gboolean cancelled = g_cancellable_is_cancelled(a->cancellable);
 
-gboolean cpdbAddPrinter(cpdb_frontend_obj_t *f, 
-                        cpdb_printer_obj_t *p)
-{
-    p->backend_proxy = g_hash_table_lookup(f->backend, p->backend_name);
-    if (p->backend_proxy == NULL)
+    /* Disconnecting forgets the backends being activated, stopping the
+     * background thread leaves it to its activations */
+    if (!cancelled || a->background)
     {
-        logerror("Couldn't add printer %s : Backend doesn't exist %s\n",
-                    p->id, p->backend_name);
-        return FALSE;
+        cpdbLockRegistry(f);
+        g_hash_table_remove(f->activating_backends, ba->backend_name);
+        cpdbUnlockRegistry(f);
+    }
+    if (!cancelled)
+    {
+        /* Backends found later by the background thread only get
+         * their printers reported */
+        if (report && a->initial && f->enumeration_cb)
+            f->enumeration_cb(f, ba->backend_name, CPDB_ENUMERATION_BACKEND_DONE);
     }
-    g_object_ref(p->backend_proxy);
-
-    loginfo("Adding printer %s %s\n", p->id, p->backend_name);
-    cpdbDebugPrinter(p);
-    g_hash_table_insert(f->printer, cpdbConcatSep(p->id, p->backend_name), p);
-    f->num_printers++;
 
-    return TRUE;
+    cpdbFinishActivation(a);
+    free(ba->backend_name);
+    free(ba);
 }
 
-cpdb_printer_obj_t *cpdbRemovePrinter(cpdb_frontend_obj_t *f,
-                                      const char *printer_id,
-                                      const char *backend_name)
+static void cpdbOnBackendPrintersReady(GObject *source,
+                                       GAsyncResult *res,
+                                       gpointer user_data)
 {
-    char *key;
-    cpdb_printer_obj_t *p = NULL;
+    cpdb_backend_activation_t *ba = user_data;
+    cpdb_frontend_obj_t *f = ba->activation->f;
+    int num_printers;
+    GVariant *printers;
+    GError *error = NULL;
 
-    loginfo("Removing printer %s %s\n", printer_id, backend_name);
-    key = cpdbConcatSep(printer_id, backend_name);
-    if (g_hash_table_contains(f->printer, key))
+    print_backend_call_get_all_printers_finish(PRINT_BACKEND(source),
+                                               &num_printers,
+                                               &printers,
+                                               res,
+                                               &error);
+    cpdbRecordBackendCall(PRINT_BACKEND(source), ba->started, error);
+    if (error)
     {
-        p = cpdbFindPrinterObj(f, printer_id, backend_name);
-        g_hash_table_remove(f->printer, key);
-        f->num_printers--;
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            logerror("Error getting %s printer list : %s\n",
+                     ba->backend_name, error->message);
+        g_error_free(error);
     }
     else
     {
-        logwarn("Printer %s %s not found\n", printer_id, backend_name);
+        logdebug("Fetched %d printers from backend %s\n",
+                 num_printers, ba->backend_name);
+        if (!g_cancellable_is_cancelled(ba->activation->cancellable))
+        {
+            cpdbLockRegistry(f);
+            cpdbSyncBackendPrinters(f, ba->backend_name, printers,
+                                    ba->activation->notify);
+            cpdbUnlockRegistry(f);
+        }
+        g_variant_unref(printers);
     }
-    
-    free(key);
-    return p;
-}
 
-void cpdbPrintBasicOptions(const cpdb_printer_obj_t *p)
-{
-    printf("-------------------------\n");
-    printf("Printer %s\n", p->id);
-    printf("name: %s\n", p->name);
-    printf("location: %s\n", p->location);
-    printf("info: %s\n", p->info);
-    printf("make and model: %s\n", p->make_and_model);
-    printf("accepting jobs? %s\n", (p->accepting_jobs ? "yes" : "no"));
-    printf("state: %s\n", p->state);
-    printf("backend: %s\n", p->backend_name);
-    printf("-------------------------\n\n");
+    cpdbFinishBackendActivation(ba, TRUE);
 }
 
-void getAllPrintersLookup(gpointer key, gpointer value, gpointer user_data){
-    PrintBackend *proxy = value;
-    GError *error = NULL; 
-    
-    int num_printers;
-    GVariantIter iter;
-    GVariant *printers, *printer;
-    cpdb_printer_obj_t *p;
+static void cpdbOnBackendProxyReady(GObject *source,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
+{
+    cpdb_backend_activation_t *ba = user_data;
+    cpdb_frontend_obj_t *f = ba->activation->f;
+    cpdb_prefetch_work_t *work = NULL;
+    PrintBackend *proxy;
+    GError *error = NULL;
 
-    print_backend_call_get_filtered_printer_list_sync (proxy, &num_printers,
-                                                &printers, NULL, &error);
+    proxy = print_backend_proxy_new_finish(res, &error);
     if (error)
     {
-        logerror("Error getting printer list : %s\n", error->message);
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            logerror("Error creating backend proxy for %s : %s\n",
+                     ba->backend_name, error->message);
+        g_error_free(error);
+        cpdbFinishBackendActivation(ba, TRUE);
         return;
     }
-    g_variant_iter_init(&iter, printers);
-    while (g_variant_iter_loop(&iter, "(v)", &printer))
+
+    /* Someone else was faster activating this backend */
+    cpdbLockRegistry(f);
+    if (g_cancellable_is_cancelled(ba->activation->cancellable) ||
+        g_hash_table_contains(f->backend, ba->backend_name))
     {
-        p = cpdbGetNewPrinterObj();
-        cpdbFillBasicOptions(p, printer);
-        cpdbPrintBasicOptions(p);
+        cpdbUnlockRegistry(f);
+        g_object_unref(proxy);
+        cpdbFinishBackendActivation(ba, FALSE);
+        return;
+    }
+
+    g_hash_table_insert(f->backend, g_strdup(ba->backend_name), proxy);
+    f->num_backends++;
+    if (f->default_prefetch && strcmp(ba->backend_name, "CUPS") == 0)
+    {
+        /* Learn the default printer of the backend as a last candidate */
+        work = cpdbNewPrefetchWork(f);
+        work->proxy = g_object_ref(proxy);
     }
+    cpdbUnlockRegistry(f);
+    g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(proxy),
+                                     f->timeouts[CPDB_CALL_LISTING]);
+
+    if (work)
+        cpdbQueuePrefetchWork(work);
+
+    if (f->hide_remote)
+        print_backend_call_show_remote_printers(proxy, false, NULL, NULL, NULL);
+    if (f->hide_temporary)
+        print_backend_call_show_temporary_printers(proxy, false, NULL, NULL, NULL);
+
+    ba->started = g_get_monotonic_time();
+    print_backend_call_get_all_printers(proxy,
+                                        ba->activation->cancellable,
+                                        cpdbOnBackendPrintersReady,
+                                        ba);
 }
 
-void cpdbGetAllPrinters(cpdb_frontend_obj_t *f)
+/* Start activating a backend, the callbacks get dispatched in the
+ * thread-default main context of the caller */
+static void cpdbActivateBackend(cpdb_activation_t *a,
+                                const char *service_name)
 {
-    loginfo("Fetching all printers\n");
-    g_hash_table_foreach(f->backend, getAllPrintersLookup, NULL);    
-}
+    cpdb_backend_activation_t *ba;
+    const char *backend_name = service_name + strlen(CPDB_BACKEND_PREFIX);
 
-void hideRemoteLookup(gpointer key, gpointer value, gpointer user_data){
-    PrintBackend *proxy = value;
-    GError *error = NULL; 
-    print_backend_call_show_remote_printers_sync(proxy, false, NULL,
-                                       &error);
+    cpdbLockRegistry(a->f);
+    if (!cpdbNeedsActivation(a->f, backend_name))
+    {
+        cpdbUnlockRegistry(a->f);
+        return;
+    }
+    g_hash_table_add(a->f->activating_backends, g_strdup(backend_name));
+    cpdbUnlockRegistry(a->f);
+
+    ba = g_new0(cpdb_backend_activation_t, 1);
+    ba->activation = a;
+    ba->backend_name = g_strdup(backend_name);
+    a->pending++;
+
+    /* The proxy may be created in a short-lived main context, so it must
+     * not subscribe to anything, backend signals are subscribed to on
+     * the connection */
+    print_backend_proxy_new(a->f->connection,
+                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                            G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                            service_name,
+                            CPDB_BACKEND_OBJ_PATH,
+                            a->cancellable,
+                            cpdbOnBackendProxyReady,
+                            ba);
 }
 
-void cpdbHideRemotePrinters(cpdb_frontend_obj_t *f)
+/* Remove the printers of a backend, or of all backends if backend_name
+ * is NULL, and report them through the printer callback */
+static void cpdbRemoveMatchingPrinters(cpdb_frontend_obj_t *f,
+                                       const char *backend_name)
 {
-    loginfo("Hiding remote printers\n");
-    g_hash_table_foreach(f->backend, hideRemoteLookup, NULL);
-    
-}
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *printers = NULL, *l;
+    cpdb_printer_obj_t *p;
 
-void showRemoteLookup(gpointer key, gpointer value, gpointer user_data){
-    PrintBackend *proxy = value;
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        p = value;
+        if (backend_name == NULL || strcmp(p->backend_name, backend_name) == 0)
+            printers = g_list_prepend(printers, p);
+    }
+
+    for (l = printers; l != NULL; l = l->next)
+    {
+        p = l->data;
+        p = cpdbRemovePrinter(f, p->id, p->backend_name);
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    }
+    g_list_free(printers);
+}
+
+/* Remove the catalog printers of the backends not in a name set */
+static void cpdbRemoveUninstalledPrinters(cpdb_frontend_obj_t *f,
+                                          GHashTable *installed)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *printers = NULL, *l;
+    cpdb_printer_obj_t *p;
+
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        p = value;
+        if (p->stale && !g_hash_table_contains(installed, p->backend_name))
+            printers = g_list_prepend(printers, p);
+    }
+
+    for (l = printers; l != NULL; l = l->next)
+    {
+        p = l->data;
+        p = cpdbRemovePrinter(f, p->id, p->backend_name);
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_REMOVED);
+    }
+    g_list_free(printers);
+}
+
+static void cpdbRemoveBackend(cpdb_frontend_obj_t *f,
+                              const char *backend_name)
+{
+    PrintBackend *proxy;
+
+    cpdbLockRegistry(f);
+    cpdbRemoveMatchingPrinters(f, backend_name);
+
+    if ((proxy = g_hash_table_lookup(f->backend, backend_name)) != NULL)
+        cpdbStopBackendProbe(proxy);
+    if (g_hash_table_remove(f->backend, backend_name))
+        f->num_backends--;
+    cpdbUnlockRegistry(f);
+}
+
+/* Add the backends of a name list which we do not know yet and list
+ * their printers through the printer callback */
+static void cpdbAddNewBackends(cpdb_frontend_obj_t *f,
+                               const char *method)
+{
+    GVariantIter iter;
+    GVariant *service_names;
+    const char *service_name;
+    cpdb_activation_t *a;
+
+    if ((service_names = cpdbListBusNames(f->connection, method)) == NULL)
+        return;
+
+    a = cpdbNewBackgroundActivation(f);
+    g_variant_iter_init(&iter, service_names);
+    while (g_variant_iter_next(&iter, "&s", &service_name))
+    {
+        if (!g_str_has_prefix(service_name, CPDB_BACKEND_PREFIX) ||
+            !cpdbNeedsActivation(f, service_name + strlen(CPDB_BACKEND_PREFIX)))
+            continue;
+
+        loginfo("Found backend %s (%s)\n",
+                service_name + strlen(CPDB_BACKEND_PREFIX),
+                strcmp(method, "ListNames") ? "Installed" : "Already running");
+        cpdbActivateBackend(a, service_name);
+    }
+    cpdbFinishActivation(a);
+
+    g_variant_unref(service_names);
+}
+
+/* Scan the bus for backends, start activating the ones we do not know
+ * yet and drop the ones which are gone */
+static cpdb_activation_t *cpdbStartActivation(cpdb_frontend_obj_t *f,
+                                              gboolean notify,
+                                              gboolean waiting)
+{
+    int i;
+    const char *service_name;
+    GVariantIter iter;
+    GVariant *service_names;
+    cpdb_activation_t *a;
+    GHashTable *existing_backends;
+    GHashTableIter hash_iter;
+    gpointer key, value;
+    const char * const name_lists[] = {
+        "ListNames",
+        "ListActivatableNames",
+        NULL
+    };
+
+    // Create a hash table to track existing backends
+    existing_backends = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&hash_iter, f->backend);
+    while (g_hash_table_iter_next(&hash_iter, &key, &value))
+        g_hash_table_add(existing_backends, g_strdup(key));
+    cpdbUnlockRegistry(f);
+
+    logdebug("Activating backends\n");
+    a = cpdbNewActivation(f, notify);
+    a->initial = TRUE;
+    a->waiting = waiting;
+    a->installed = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+    for (i = 0; name_lists[i]; i++) {
+        if ((service_names = cpdbListBusNames(f->connection, name_lists[i])) == NULL)
+            continue;
+
+        g_variant_iter_init(&iter, service_names);
+        while (g_variant_iter_next(&iter, "&s", &service_name)) {
+            if (g_str_has_prefix(service_name, CPDB_BACKEND_PREFIX)) {
+                const char *backend_suffix = service_name + strlen(CPDB_BACKEND_PREFIX);
+                g_hash_table_add(a->installed, g_strdup(backend_suffix));
+                if (cpdbNeedsActivation(f, backend_suffix)) {
+                    loginfo("Found backend %s (%s)\n", backend_suffix,
+                            i ? "Starting now" : "Already running");
+                    cpdbActivateBackend(a, service_name);
+                }
+                g_hash_table_remove(existing_backends, backend_suffix);
+            }
+        }
+
+        g_variant_unref(service_names);
+    }
+
+    // Remove backends that are no longer present
+    g_hash_table_iter_init(&hash_iter, existing_backends);
+    while (g_hash_table_iter_next(&hash_iter, &key, &value)) {
+        loginfo("Removing backend %s\n", (char *)key);
+        cpdbRemoveBackend(f, key);
+    }
+    g_hash_table_destroy(existing_backends);
+
+    cpdbFinishActivation(a);
+    return a;
+}
+
+void cpdbActivateBackends(cpdb_frontend_obj_t *f) {
+    GMainContext *context;
+    cpdb_activation_t *a;
+
+    /* Activate all backends at once and wait for the last of them in
+     * a private main context, so the time taken is the one of the
+     * slowest backend and not the sum of all of them */
+    context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+
+    /* The frontend knows about the catalog printers already, so
+     * it has to learn what changed since */
+    a = cpdbStartActivation(f, f->catalog_shown, TRUE);
+    while (a->pending > 0)
+        g_main_context_iteration(context, TRUE);
+    cpdbDeleteActivation(a);
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+}
+
+static void cpdbOnNameOwnerChanged(GDBusConnection *connection,
+                                   const gchar *sender_name,
+                                   const gchar *object_path,
+                                   const gchar *interface_name,
+                                   const gchar *signal_name,
+                                   GVariant *parameters,
+                                   gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
+    const char *name, *old_owner, *new_owner, *backend_name;
+    cpdb_activation_t *a;
+    PrintBackend *proxy;
+
+    g_variant_get(parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (!g_str_has_prefix(name, CPDB_BACKEND_PREFIX))
+        return;
+    backend_name = name + strlen(CPDB_BACKEND_PREFIX);
+
+    /* A restarted backend counts its printer list generations from the
+     * start again, so the last one seen from the old instance is moot */
+    if ((proxy = cpdbRefBackend(f, backend_name)) != NULL)
+    {
+        cpdbLockRegistry(f);
+        g_object_set_data(G_OBJECT(proxy), CPDB_GENERATION_KEY, NULL);
+        cpdbUnlockRegistry(f);
+        g_object_unref(proxy);
+    }
+
+    if (new_owner[0] != '\0')
+    {
+        if ((proxy = cpdbRefBackend(f, backend_name)) != NULL)
+        {
+            g_object_unref(proxy);
+            return;
+        }
+        loginfo("Found backend %s (Started)\n", backend_name);
+        a = cpdbNewBackgroundActivation(f);
+        cpdbActivateBackend(a, name);
+        cpdbFinishActivation(a);
+    }
+    else if ((proxy = cpdbRefBackend(f, backend_name)) != NULL)
+    {
+        g_object_unref(proxy);
+        /* Activatable backends exit when idle, they get started
+         * again on the next call, so only drop uninstalled ones */
+        if (cpdbIsActivatableName(connection, name))
+            return;
+        loginfo("Removing backend %s\n", backend_name);
+        cpdbRemoveBackend(f, backend_name);
+    }
+}
+
+static void cpdbOnActivatableServicesChanged(GDBusConnection *connection,
+                                             const gchar *sender_name,
+                                             const gchar *object_path,
+                                             const gchar *interface_name,
+                                             const gchar *signal_name,
+                                             GVariant *parameters,
+                                             gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
+
+    logdebug("Activatable services changed\n");
+    cpdbAddNewBackends(f, "ListActivatableNames");
+}
+
+/* Runs in the background thread, so that the signal callbacks get
+ * dispatched there */
+static gboolean cpdbWatchBackends(gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
+
+    if (f->connection == NULL || f->name_owner_changed_id)
+        return G_SOURCE_REMOVE;
+
+    logdebug("Watching for backends coming and going\n");
+    f->name_owner_changed_id =
+        g_dbus_connection_signal_subscribe(f->connection,
+                                           "org.freedesktop.DBus",          //Sender name
+                                           "org.freedesktop.DBus",          //Sender interface
+                                           "NameOwnerChanged",              //Signal name
+                                           "/org/freedesktop/DBus",         //Object path
+                                           "org.openprinting.Backend",      //arg0 namespace
+                                           G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE,
+                                           cpdbOnNameOwnerChanged,          //callback
+                                           f,                               //user_data
+                                           NULL);
+    f->activatable_changed_id =
+        g_dbus_connection_signal_subscribe(f->connection,
+                                           "org.freedesktop.DBus",          //Sender name
+                                           "org.freedesktop.DBus",          //Sender interface
+                                           "ActivatableServicesChanged",    //Signal name
+                                           "/org/freedesktop/DBus",         //Object path
+                                           NULL,                            /**match on all arguments**/
+                                           G_DBUS_SIGNAL_FLAGS_NONE,
+                                           cpdbOnActivatableServicesChanged,//callback
+                                           f,                               //user_data
+                                           NULL);
+
+    /* Catch up with backends started between the initial scan
+     * and the subscription */
+    cpdbAddNewBackends(f, "ListNames");
+    return G_SOURCE_REMOVE;
+}
+
+static void cpdbScheduleBackendWatch(cpdb_frontend_obj_t *f)
+{
+    GSource *source = g_idle_source_new();
+
+    g_source_set_callback(source, cpdbWatchBackends, f, NULL);
+    g_source_attach(source, f->background_context);
+    g_source_unref(source);
+}
+
+gpointer background_thread(gpointer user_data) {
+    cpdb_frontend_obj_t *f = (cpdb_frontend_obj_t *)user_data;
+
+    g_main_context_push_thread_default(f->background_context);
+    while (!g_atomic_int_get(&f->stop_flag))
+        g_main_context_iteration(f->background_context, TRUE);
+    g_main_context_pop_thread_default(f->background_context);
+    return NULL;
+}
+
+// Start the background thread
+void cpdbStartBackendListRefreshing(cpdb_frontend_obj_t *f) {
+    f->stop_flag = FALSE;
+    if (f->callback_context)
+        g_main_context_unref(f->callback_context);
+    f->callback_context = g_main_context_ref_thread_default();
+    f->background_cancellable = g_cancellable_new();
+    f->background_context = g_main_context_new();
+    f->background_thread = g_thread_new("background_thread", background_thread, f);
+    if (f->connection)
+        cpdbScheduleBackendWatch(f);
+}
+
+// Stop the background thread
+void cpdbStopBackendListRefreshing(cpdb_frontend_obj_t *f) {
+    if (f->background_thread == NULL)
+        return;
+
+    g_atomic_int_set(&f->stop_flag, TRUE);
+    g_main_context_wakeup(f->background_context);
+    g_thread_join(f->background_thread);
+    f->background_thread = NULL;
+
+    if (f->connection && f->name_owner_changed_id)
+        g_dbus_connection_signal_unsubscribe(f->connection, f->name_owner_changed_id);
+    if (f->connection && f->activatable_changed_id)
+        g_dbus_connection_signal_unsubscribe(f->connection, f->activatable_changed_id);
+    f->name_owner_changed_id = 0;
+    f->activatable_changed_id = 0;
+
+    /* Let the activations still in flight see they got cancelled, so
+     * that they clean up after themselves */
+    g_cancellable_cancel(f->background_cancellable);
+    while (g_atomic_int_get(&f->background_activations) > 0)
+        g_main_context_iteration(f->background_context, TRUE);
+    cpdbLockRegistry(f);
+    g_object_unref(f->background_cancellable);
+    f->background_cancellable = NULL;
+    cpdbUnlockRegistry(f);
+
+    g_main_context_unref(f->background_context);
+    f->background_context = NULL;
+}
+
+cpdb_frontend_obj_t *cpdbStartListingPrinters(cpdb_printer_callback printer_cb){
+    cpdbInit();
+    cpdb_frontend_obj_t *f = cpdbGetNewFrontendObj(printer_cb);
+    cpdbConnectToDBus(f);
+    cpdbStartBackendListRefreshing(f); // Start bg task to check for backends coming/going
+    return f;
+}
+
+cpdb_frontend_obj_t *cpdbStartListingPrintersStreaming(cpdb_printer_callback printer_cb,
+                                                      cpdb_enumeration_callback enumeration_cb){
+    cpdbInit();
+    cpdb_frontend_obj_t *f = cpdbGetNewFrontendObj(printer_cb);
+    f->enumeration_cb = enumeration_cb;
+    cpdbConnectToDBusAsync(f); // Printers get reported as their backends answer
+    cpdbStartBackendListRefreshing(f); // Start bg task to check for backends coming/going
+    return f;
+}
+
+void cpdbStopListingPrinters(cpdb_frontend_obj_t *f){
+    cpdbStopBackendListRefreshing(f); // Stop bg task
+    cpdbDeleteFrontendObj(f);
+}
+
+PrintBackend *cpdbCreateBackend(GDBusConnection *connection,
+                                const char *service_name)
+{
+    FILE *file = NULL;
+    PrintBackend *proxy;
+    GError *error = NULL;
+    char *path, *backend_name;
+    const char *info_dir_name;
+    char obj_path[CPDB_BSIZE];
+    
+    backend_name = g_strdup(service_name);
+    proxy = print_backend_proxy_new_sync(connection,
+                                         G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                         G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                         backend_name,
+                                         CPDB_BACKEND_OBJ_PATH,
+                                         NULL,
+                                         &error);
+    if (error)
+    {
+        logerror("Error creating backend proxy for %s : %s\n",
+                    backend_name, error->message);
+        return NULL;
+    }
+    return proxy;
+}
+
+void cpdbSetCallTimeout(cpdb_frontend_obj_t *f,
+                        cpdb_call_t call,
+                        int timeout_msec)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (f == NULL || call < 0 || call >= CPDB_CALL_COUNT)
+    {
+        logwarn("Invalid params: cpdbSetCallTimeout()\n");
+        return;
+    }
+
+    logdebug("Setting timeout of backend calls %d to %d ms\n", call, timeout_msec);
+    cpdbLockRegistry(f);
+    f->timeouts[call] = timeout_msec;
+
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        cpdbSetPrinterCallTimeout(value, call, timeout_msec);
+
+    /* Listing and the other calls not related to a printer
+     * go through the backend proxy */
+    if (call == CPDB_CALL_LISTING)
+    {
+        g_hash_table_iter_init(&iter, f->backend);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(value), timeout_msec);
+    }
+    cpdbUnlockRegistry(f);
+}
+
+void cpdbCancelAllPrinterCalls(cpdb_frontend_obj_t *f)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (f == NULL)
+    {
+        logwarn("Invalid params: cpdbCancelAllPrinterCalls()\n");
+        return;
+    }
+
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        cpdbCancelPrinterCalls(value);
+    cpdbUnlockRegistry(f);
+}
+
+gboolean cpdbGetBackendHealth(cpdb_frontend_obj_t *f,
+                              const char *backend_name,
+                              cpdb_backend_health_t *health)
+{
+    PrintBackend *proxy;
+    cpdb_health_t *h;
+
+    if (f == NULL || backend_name == NULL || health == NULL)
+    {
+        logwarn("Invalid params: cpdbGetBackendHealth()\n");
+        return FALSE;
+    }
+
+    if ((proxy = cpdbRefBackend(f, backend_name)) == NULL)
+        return FALSE;
+
+    h = cpdbGetHealth(proxy);
+    g_mutex_lock(&h->lock);
+    *health = h->health;
+    g_mutex_unlock(&h->lock);
+    g_object_unref(proxy);
+    return TRUE;
+}
+
+void cpdbIgnoreLastSavedSettings(cpdb_frontend_obj_t *f)
+{
+    loginfo("Ignoring previous settings\n");
+    cpdbUnrefSettings(f->last_saved_settings);
+    f->last_saved_settings = cpdbGetNewSettings();
+}
+
+gboolean cpdbAddPrinter(cpdb_frontend_obj_t *f, 
+                        cpdb_printer_obj_t *p)
+{
+    PrintBackend *proxy;
+
+    cpdbLockRegistry(f);
+    proxy = g_hash_table_lookup(f->backend, p->backend_name);
+    if (proxy == NULL)
+    {
+        cpdbUnlockRegistry(f);
+        logerror("Couldn't add printer %s : Backend doesn't exist %s\n",
+                    p->id, p->backend_name);
+        return FALSE;
+    }
+    g_object_ref(proxy);
+    if (p->backend_proxy)
+        g_object_unref(p->backend_proxy);
+    p->backend_proxy = proxy;
+
+    loginfo("Adding printer %s %s\n", p->id, p->backend_name);
+    cpdbDebugPrinter(p);
+    cpdbInsertPrinter(f, p);
+    cpdbPrefetchIfDefault(f, p);
+    cpdbUnlockRegistry(f);
+
+    return TRUE;
+}
+
+static void cpdbInsertPrinter(cpdb_frontend_obj_t *f,
+                              cpdb_printer_obj_t *p)
+{
+    cpdb_printer_obj_t *old;
+
+    memcpy(p->timeouts, f->timeouts, sizeof(p->timeouts));
+    cpdbInitPrinterKey(&p->key, p->id, p->backend_name);
+    if ((old = g_hash_table_lookup(f->printer, &p->key)) == p)
+        return;
+    if (old)
+        cpdbUntrackPrinter(f, old);
+    cpdbTrackPrinter(f, p);
+    g_hash_table_replace(f->printer, &p->key, p);
+    f->registry_dirty = TRUE;
+
+    /* A printer of the same id and backend is replaced, its reference
+     * belonged to the registry */
+    if (old)
+        cpdbUnrefPrinterObj(old);
+    else
+        f->num_printers++;
+}
+
+void cpdbInitPrinterKey(cpdb_printer_key_t *key,
+                        const char *printer_id,
+                        const char *backend_name)
+{
+    key->id = printer_id;
+    key->backend_name = backend_name;
+    key->hash = g_str_hash(printer_id) * 31 + g_str_hash(backend_name);
+}
+
+guint cpdbPrinterKeyHash(gconstpointer key)
+{
+    return ((const cpdb_printer_key_t *) key)->hash;
+}
+
+gboolean cpdbPrinterKeyEqual(gconstpointer a,
+                             gconstpointer b)
+{
+    const cpdb_printer_key_t *k1 = a, *k2 = b;
+
+    return k1->hash == k2->hash &&
+           strcmp(k1->id, k2->id) == 0 &&
+           (k1->backend_name == k2->backend_name ||
+            strcmp(k1->backend_name, k2->backend_name) == 0);
+}
+
+/* Replace a string field of a printer if it changed. Other threads
+ * may be reading the old string, so it's kept until the printer goes. */
+static gboolean cpdbUpdateString(cpdb_printer_obj_t *p,
+                                 char **dest,
+                                 const char *src)
+{
+    char *old = *dest;
+
+    if (g_strcmp0(old, src) == 0)
+        return FALSE;
+    g_atomic_pointer_set(dest, g_strdup(src));
+    if (old)
+    {
+        G_LOCK(printer_retired);
+        p->retired_strings = g_slist_prepend(p->retired_strings, old);
+        G_UNLOCK(printer_retired);
+    }
+    return TRUE;
+}
+
+/* Same for the state, which is interned, so a pointer comparison */
+static gboolean cpdbUpdateInternedString(char **dest,
+                                         const char *src)
+{
+    src = cpdbInternString(src);
+    if (*dest == src)
+        return FALSE;
+    *dest = (char *) src;
+    return TRUE;
+}
+
+/* The strings are only copied once, straight out of the listing,
+ * which isn't kept */
+static void cpdbFillPrinterFromRecord(cpdb_printer_obj_t *p,
+                                      const cpdb_printer_record_t *r)
+{
+    cpdbFreePrinterStrings(p);
+    p->id = g_strdup(r->id);
+    p->name = g_strdup(r->name);
+    p->info = g_strdup(r->info);
+    p->location = g_strdup(r->location);
+    p->make_and_model = g_strdup(r->make_and_model);
+    p->accepting_jobs = r->accepting_jobs;
+    p->state = (char *) cpdbInternString(r->state);
+    p->backend_name = (char *) cpdbInternString(r->backend_name);
+}
+
+static cpdb_printer_obj_t *cpdbNewPrinterFromRecord(cpdb_frontend_obj_t *f,
+                                                    const cpdb_printer_record_t *r)
+{
+    cpdb_printer_obj_t *p = cpdbGetNewPrinterObj();
+
+    cpdbFillPrinterFromRecord(p, r);
+
+    cpdbUseSavedSettings(f, p);
+    return p;
+}
+
+/* If some previously saved settings were retrieved, share them with
+ * a new printer until its settings get changed */
+static void cpdbUseSavedSettings(cpdb_frontend_obj_t *f,
+                                 cpdb_printer_obj_t *p)
+{
+    if (f->last_saved_settings == NULL)
+        return;
+
+    cpdbUnrefSettings(p->settings);
+    p->settings = cpdbRefSettings(f->last_saved_settings);
+}
+
+/* Give the printer settings of its own before changing them */
+static cpdb_settings_t *cpdbGetOwnSettings(cpdb_printer_obj_t *p)
+{
+    cpdb_settings_t *s;
+
+    if (g_atomic_int_get(&p->settings->ref_count) > 1)
+    {
+        s = cpdbGetNewSettings();
+        cpdbCopySettings(p->settings, s);
+        cpdbUnrefSettings(p->settings);
+        p->settings = s;
+    }
+    return p->settings;
+}
+
+/* Add a printer reported by its backend, or update the one we already
+ * have under its id, e.g. from the catalog, and report what changed.
+ * Returns the printer in the frontend instance, NULL on failure. */
+static cpdb_printer_obj_t *cpdbMergePrinter(cpdb_frontend_obj_t *f,
+                                            const cpdb_printer_record_t *r,
+                                            gboolean notify)
+{
+    PrintBackend *proxy;
+    cpdb_printer_obj_t *p;
+    gboolean changed = FALSE, renamed = FALSE;
+
+    p = cpdbLookupPrinter(f, r->id, r->backend_name);
+    if (p == NULL)
+    {
+        p = cpdbNewPrinterFromRecord(f, r);
+        if (!cpdbAddPrinter(f, p))
+        {
+            cpdbDeletePrinterObj(p);
+            return NULL;
+        }
+        if (notify)
+            cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_ADDED);
+        return p;
+    }
+
+    if ((proxy = g_hash_table_lookup(f->backend, r->backend_name)) == NULL)
+    {
+        logerror("Couldn't update printer %s : Backend doesn't exist %s\n",
+                    r->id, r->backend_name);
+        return NULL;
+    }
+    if (p->backend_proxy == NULL)
+    {
+        p->backend_proxy = g_object_ref(proxy);
+        cpdbPrefetchIfDefault(f, p);
+    }
+
+    renamed |= cpdbUpdateString(p, &p->name, r->name);
+    renamed |= cpdbUpdateString(p, &p->info, r->info);
+    renamed |= cpdbUpdateString(p, &p->location, r->location);
+    renamed |= cpdbUpdateString(p, &p->make_and_model, r->make_and_model);
+    if (renamed)
+    {
+        cpdbUntrackPrinter(f, p);
+        cpdbTrackPrinter(f, p);
+    }
+    changed |= renamed;
+    changed |= cpdbUpdateInternedString(&p->state, r->state);
+    if (p->accepting_jobs != r->accepting_jobs)
+    {
+        p->accepting_jobs = r->accepting_jobs;
+        changed = TRUE;
+    }
+
+    if (p->stale)
+        logdebug("Confirmed printer %s %s from catalog\n", p->id, p->backend_name);
+    p->stale = FALSE;
+    if (changed)
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_STATE_CHANGED);
+    return p;
+}
+
+cpdb_printer_obj_t *cpdbRemovePrinter(cpdb_frontend_obj_t *f,
+                                      const char *printer_id,
+                                      const char *backend_name)
+{
+    cpdb_printer_obj_t *p;
+
+    loginfo("Removing printer %s %s\n", printer_id, backend_name);
+    cpdbLockRegistry(f);
+    p = cpdbLookupPrinter(f, printer_id, backend_name);
+    if (p != NULL)
+    {
+        g_hash_table_remove(f->printer, &p->key);
+        cpdbUntrackPrinter(f, p);
+        f->num_printers--;
+        f->registry_dirty = TRUE;
+    }
+    else
+    {
+        logwarn("Printer %s %s not found\n", printer_id, backend_name);
+    }
+    cpdbUnlockRegistry(f);
+    
+    return p;
+}
+
+void cpdbPrintBasicOptions(const cpdb_printer_obj_t *p)
+{
+    printf("-------------------------\n");
+    printf("Printer %s\n", p->id);
+    printf("name: %s\n", p->name);
+    printf("location: %s\n", p->location);
+    printf("info: %s\n", p->info);
+    printf("make and model: %s\n", p->make_and_model);
+    printf("accepting jobs? %s\n", (p->accepting_jobs ? "yes" : "no"));
+    printf("state: %s\n", p->state);
+    printf("backend: %s\n", p->backend_name);
+    printf("-------------------------\n\n");
+}
+
+void getAllPrintersLookup(gpointer key, gpointer value, gpointer user_data){
+    PrintBackend *proxy = value;
+    GError *error = NULL; 
+    
+    int num_printers;
+    GVariantIter iter;
+    GVariant *printers, *printer;
+    cpdb_printer_obj_t *p;
+
+    print_backend_call_get_filtered_printer_list_sync (proxy, &num_printers,
+                                                &printers, NULL, &error);
+    if (error)
+    {
+        logerror("Error getting printer list : %s\n", error->message);
+        return;
+    }
+    g_variant_iter_init(&iter, printers);
+    while (g_variant_iter_loop(&iter, "(v)", &printer))
+    {
+        p = cpdbGetNewPrinterObj();
+        cpdbFillBasicOptions(p, printer);
+        cpdbPrintBasicOptions(p);
+    }
+}
+
+void cpdbGetAllPrinters(cpdb_frontend_obj_t *f)
+{
+    loginfo("Fetching all printers\n");
+    cpdbForeachBackend(f, getAllPrintersLookup, NULL);    
+}
+
+void hideRemoteLookup(gpointer key, gpointer value, gpointer user_data){
+    PrintBackend *proxy = value;
+    GError *error = NULL; 
+    print_backend_call_show_remote_printers_sync(proxy, false, NULL,
+                                       &error);
+}
+
+void cpdbHideRemotePrinters(cpdb_frontend_obj_t *f)
+{
+    loginfo("Hiding remote printers\n");
+    cpdbForeachBackend(f, hideRemoteLookup, NULL);
+    
+}
+
+void showRemoteLookup(gpointer key, gpointer value, gpointer user_data){
+    PrintBackend *proxy = value;
     GError *error = NULL; 
     print_backend_call_show_remote_printers_sync(proxy, true, NULL,
                                        &error);
 }
 
-void cpdbUnhideRemotePrinters(cpdb_frontend_obj_t *f)
+void cpdbUnhideRemotePrinters(cpdb_frontend_obj_t *f)
+{
+    loginfo("Unhiding remote printers\n");
+    cpdbForeachBackend(f, showRemoteLookup, NULL);
+    
+}
+
+void hideTemporaryLookup(gpointer key, gpointer value, gpointer user_data){
+    PrintBackend *proxy = value;
+    GError *error = NULL; 
+    print_backend_call_show_temporary_printers_sync(proxy, false, NULL,
+                                       &error);
+}
+
+void cpdbHideTemporaryPrinters(cpdb_frontend_obj_t *f)
+{
+    loginfo("Hiding temporary printers\n");
+    cpdbForeachBackend(f, hideTemporaryLookup, NULL);
+    
+}
+
+void showTemporaryLookup(gpointer key, gpointer value, gpointer user_data){
+    PrintBackend *proxy = value;
+    GError *error = NULL; 
+    print_backend_call_show_temporary_printers_sync(proxy, true, NULL,
+                                       &error);
+}
+
+void cpdbUnhideTemporaryPrinters(cpdb_frontend_obj_t *f)
+{
+    loginfo("Unhiding temporary printers\n");
+    cpdbForeachBackend(f, showTemporaryLookup, NULL);
+    
+}
+
+cpdb_printer_obj_t *cpdbFindPrinterObj(cpdb_frontend_obj_t *f,
+                                       const char *printer_id,
+                                       const char *backend_name)
+{
+    cpdb_printer_obj_t *p;
+
+    if (printer_id == NULL || backend_name == NULL)
+    {
+        logwarn("Invalid parameters: cpdbFindPrinterObj()\n");
+        return NULL;
+    }
+
+    cpdbLockRegistry(f);
+    if ((p = cpdbLookupPrinter(f, printer_id, backend_name)) != NULL)
+        cpdbRefPrinterObj(p);
+    cpdbUnlockRegistry(f);
+    if (p == NULL)
+    {
+        logwarn("Couldn't find printer %s %s : Doesn't exist\n",
+                printer_id, backend_name);
+    }
+
+    return p;
+}
+
+/* The registry lock has to be held */
+static cpdb_printer_obj_t *cpdbLookupPrinter(cpdb_frontend_obj_t *f,
+                                             const char *printer_id,
+                                             const char *backend_name)
+{
+    cpdb_printer_key_t key;
+
+    cpdbInitPrinterKey(&key, printer_id, backend_name);
+    return g_hash_table_lookup(f->printer, &key);
+}
+
+cpdb_printer_obj_t *cpdbGetDefaultPrinterForBackend(cpdb_frontend_obj_t *f,
+                                                    const char *backend_name)
+{
+    char *def, *service_name;
+    GError *error = NULL;
+    GVariant *reply;
+    PrintBackend *proxy;
+    cpdb_printer_obj_t *p = NULL;
+    
+    proxy = cpdbRefBackend(f, backend_name);
+    if (proxy == NULL)
+    {
+        logwarn("Couldn't find backend proxy for %s\n", backend_name);
+        service_name = cpdbConcat(CPDB_BACKEND_PREFIX, backend_name);
+        proxy = cpdbCreateBackend(f->connection, service_name);
+        free(service_name);
+        if (proxy == NULL)
+        {
+            logerror("Error getting default printer for backend : Couldn't get backend proxy\n");
+            return NULL;
+        }
+    }
+    else if (!cpdbIsBackendAvailable(proxy))
+    {
+        logwarn("Skipping default printer of %s : Backend isn't answering\n", backend_name);
+        g_object_unref(proxy);
+        return NULL;
+    }
+
+    reply = cpdbCallBackendSync(proxy,
+                                "getDefaultPrinter",
+                                NULL,
+                                G_VARIANT_TYPE("(s)"),
+                                f->timeouts[CPDB_CALL_CONTROL],
+                                NULL,
+                                &error);
+    g_object_unref(proxy);
+    if (error)
+    {
+        logerror("Error getting default printer for backend : %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    g_variant_get(reply, "(&s)", &def);
+    
+    p = cpdbFindPrinterObj(f, def, backend_name);
+    g_variant_unref(reply);
+    if (p)
+        logdebug("Obtained default printer %s for backend %s\n", p->id, backend_name);
+    return p;
+}
+
+static void cpdbFreeDefaultPrefetch(cpdb_default_prefetch_t *d)
+{
+    g_free(d->locale);
+    g_ptr_array_free(d->candidates, TRUE);
+    g_ptr_array_free(d->pending, TRUE);
+    g_main_context_unref(d->context);
+    g_free(d);
+}
+
+void cpdbSetDefaultPrinterPrefetch(cpdb_frontend_obj_t *f,
+                                   const char *locale)
+{
+    cpdb_default_prefetch_t *d;
+    char *conf_dirs[2], *path;
+    GList *printers = NULL, *l;
+    GHashTableIter iter;
+    gpointer key, value;
+    int i;
+
+    if (f == NULL)
+    {
+        logwarn("Invalid params: cpdbSetDefaultPrinterPrefetch()\n");
+        return;
+    }
+
+    cpdbLockRegistry(f);
+    if (f->default_prefetch)
+        cpdbFreeDefaultPrefetch(f->default_prefetch);
+    f->default_prefetch = NULL;
+    if (locale == NULL)
+    {
+        cpdbUnlockRegistry(f);
+        return;
+    }
+
+    /* Same order as cpdbGetDefaultPrinter() */
+    conf_dirs[0] = cpdbGetUserConfDir();
+    conf_dirs[1] = cpdbGetSysConfDir();
+    for (i = 0; i < 2; i++)
+    {
+        if (conf_dirs[i] == NULL)
+            continue;
+        path = cpdbConcatPath(conf_dirs[i], CPDB_DEFAULT_PRINTERS_FILE);
+        printers = g_list_concat(printers, cpdbLoadDefaultPrinters(path));
+        free(path);
+        free(conf_dirs[i]);
+    }
+
+    d = g_new0(cpdb_default_prefetch_t, 1);
+    d->locale = g_strdup(locale);
+    d->candidates = g_ptr_array_new_with_free_func(free);
+    for (l = printers; l != NULL; l = l->next)
+        g_ptr_array_add(d->candidates, l->data);
+    g_list_free(printers);
+    d->best = d->candidates->len;
+    d->pending = g_ptr_array_new_with_free_func((GDestroyNotify) cpdbUnrefPrinterObj);
+    d->context = g_main_context_ref_thread_default();
+    f->default_prefetch = d;
+    loginfo("Prefetching the default printer among %u candidates\n", d->candidates->len);
+
+    /* Printers from the catalog may be known already */
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        cpdbPrefetchIfDefault(f, value);
+    cpdbUnlockRegistry(f);
+}
+
+static void cpdbOnDefaultTranslations(cpdb_printer_obj_t *p,
+                                      int status,
+                                      void *user_data)
+{
+    logdebug("Prefetched translations of %s %s : %s\n",
+             p->id, p->backend_name, status ? "done" : "failed");
+}
+
+static void cpdbOnDefaultDetails(cpdb_printer_obj_t *p,
+                                 int status,
+                                 void *user_data)
+{
+    logdebug("Prefetched details of %s %s : %s\n",
+             p->id, p->backend_name, status ? "done" : "failed");
+}
+
+/* Fetch the details of a printer if it is a better candidate for the
+ * default printer than those fetched already, the registry lock has to
+ * be held. The fetch reads the options cache, so it only starts once
+ * the lock is let go of. */
+static void cpdbPrefetchIfDefault(cpdb_frontend_obj_t *f,
+                                  cpdb_printer_obj_t *p)
+{
+    cpdb_default_prefetch_t *d = f->default_prefetch;
+    char *key;
+    guint i;
+
+    if (d == NULL || p->backend_proxy == NULL)
+        return;
+
+    key = cpdbConcatSep(p->id, p->backend_name);
+    for (i = 0; i < d->best; i++)
+    {
+        if (strcmp(g_ptr_array_index(d->candidates, i), key) == 0)
+            break;
+    }
+    free(key);
+    if (i >= d->best)
+        return;
+
+    d->best = i;
+    g_ptr_array_add(d->pending, cpdbRefPrinterObj(p));
+}
+
+static void cpdbStartDefaultPrefetch(GPtrArray *printers,
+                                     const char *locale)
+{
+    cpdb_printer_obj_t *p;
+    guint i;
+
+    for (i = 0; i < printers->len; i++)
+    {
+        p = g_ptr_array_index(printers, i);
+        loginfo("Prefetching probable default printer %s %s\n", p->id, p->backend_name);
+        cpdbFetchDetails(p, cpdbOnDefaultDetails, NULL, NULL, FALSE);
+        cpdbAcquireTranslations(p, locale, cpdbOnDefaultTranslations, NULL);
+    }
+}
+
+static void cpdbOnDefaultPrinterReply(GVariant *reply,
+                                      const GError *error,
+                                      gpointer user_data)
+{
+    cpdb_frontend_obj_t *f = user_data;
+    cpdb_default_prefetch_t *d;
+    cpdb_printer_obj_t *p;
+    const char *printer_id;
+
+    if (error)
+    {
+        /* The frontend may be gone if cancelled */
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            logwarn("Couldn't get default CUPS printer to prefetch : %s\n", error->message);
+        return;
+    }
+
+    g_variant_get(reply, "(&s)", &printer_id);
+    cpdbLockRegistry(f);
+    if ((d = f->default_prefetch) != NULL && printer_id[0] != '\0')
+    {
+        /* Worse than any configured default */
+        g_ptr_array_add(d->candidates, cpdbConcatSep(printer_id, "CUPS"));
+        if (d->best == d->candidates->len - 1)
+            d->best++;
+        if ((p = cpdbLookupPrinter(f, printer_id, "CUPS")) != NULL)
+            cpdbPrefetchIfDefault(f, p);
+    }
+    cpdbUnlockRegistry(f);
+}
+
+/* New prefetch work for the main context of the prefetch, the registry
+ * lock has to be held */
+static cpdb_prefetch_work_t *cpdbNewPrefetchWork(cpdb_frontend_obj_t *f)
+{
+    cpdb_prefetch_work_t *work = g_new0(cpdb_prefetch_work_t, 1);
+
+    work->f = f;
+    work->context = g_main_context_ref(f->default_prefetch->context);
+    work->cancellable = g_object_ref(f->cancellable);
+    work->timeout = f->timeouts[CPDB_CALL_CONTROL];
+    return work;
+}
+
+static void cpdbFreePrefetchWork(gpointer user_data)
+{
+    cpdb_prefetch_work_t *work = user_data;
+
+    if (work->printers)
+        g_ptr_array_free(work->printers, TRUE);
+    if (work->proxy)
+        g_object_unref(work->proxy);
+    g_free(work->locale);
+    g_object_unref(work->cancellable);
+    g_main_context_unref(work->context);
+    g_free(work);
+}
+
+static gboolean cpdbRunPrefetchWork(gpointer user_data)
+{
+    cpdb_prefetch_work_t *work = user_data;
+
+    /* The frontend instance may be gone if cancelled */
+    if (g_cancellable_is_cancelled(work->cancellable))
+        return G_SOURCE_REMOVE;
+
+    /* Bind the calls to this context, whichever one was the thread
+     * default where the work got invoked */
+    g_main_context_push_thread_default(work->context);
+    if (work->printers)
+        cpdbStartDefaultPrefetch(work->printers, work->locale);
+    if (work->proxy)
+        cpdbCallBackend(work->proxy,
+                        "getDefaultPrinter",
+                        NULL,
+                        G_VARIANT_TYPE("(s)"),
+                        work->timeout,
+                        work->cancellable,
+                        cpdbOnDefaultPrinterReply,
+                        work->f);
+    g_main_context_pop_thread_default(work->context);
+    return G_SOURCE_REMOVE;
+}
+
+/* Run the work right away if the main context of the prefetch is owned
+ * by this thread, later from that context otherwise */
+static void cpdbQueuePrefetchWork(cpdb_prefetch_work_t *work)
+{
+    g_main_context_invoke_full(work->context,
+                               G_PRIORITY_DEFAULT,
+                               cpdbRunPrefetchWork,
+                               work,
+                               cpdbFreePrefetchWork);
+}
+
+GList *cpdbLoadDefaultPrinters(const char *path)
+{
+    FILE *fp;
+    char buf[CPDB_BSIZE];
+    GList *printers = NULL;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        logwarn("Error loading default printers : Couldn't open %s for reading\n",
+                path);
+        return NULL;
+    }
+
+    while (fgets(buf, sizeof(buf), fp) != NULL)
+    {
+        buf[strcspn(buf, "\r\n")] = 0;
+        printers = g_list_prepend(printers, g_strdup(buf));
+    }
+    printers = g_list_reverse(printers);
+    logdebug("Loaded default printers from %s\n", path);
+
+    fclose(fp);
+    return printers;
+}
+
+cpdb_printer_obj_t *cpdbGetDefaultPrinter(cpdb_frontend_obj_t *f)
+{   
+    gpointer key, value;
+    GHashTableIter iter;
+    char *conf_dir, *path, *printer_id, *backend_name;
+    cpdb_printer_obj_t *default_printer = NULL;
+    GList *printer, *user_printers, *system_printers, *printers = NULL;
+
+    if (f->num_printers == 0 || f->num_backends == 0)
+    {
+        logwarn("Couldn't get default printer : No printers found\n");
+        return NULL;
+    }
+    
+    /** Find a default printer from user config first,
+     *  before trying system wide config **/
+    conf_dir = cpdbGetUserConfDir();
+    if (conf_dir)
+    {
+        path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
+        printers = g_list_concat(printers, cpdbLoadDefaultPrinters(path));
+        free(path);
+        free(conf_dir);
+    }
+    conf_dir = cpdbGetSysConfDir();
+    if (conf_dir)
+    {
+        path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
+        printers = g_list_concat(printers, cpdbLoadDefaultPrinters(path));
+        free(path);
+        free(conf_dir);
+    }
+    
+    for (printer = printers; printer != NULL; printer = printer->next)
+    {
+        printer_id = strtok(printer->data, "#"); 
+        backend_name = strtok(NULL, "\n");
+
+        default_printer = cpdbFindPrinterObj(f, printer_id, backend_name);
+        if (default_printer)
+        {
+            g_list_free_full(printers, free);
+            goto found;
+        }
+    }
+    if (printers)
+        g_list_free_full(printers, free);
+
+    logdebug("Couldn't find a valid default printer from config files\n");
+
+    /**  Fallback to default CUPS printer if CUPS backend exists **/
+    default_printer = cpdbGetDefaultPrinterForBackend(f, "CUPS");
+    if (default_printer)
+        goto found;
+    logdebug("Couldn't find a valid default CUPS printer\n");
+    
+    /** Fallback to default FILE printer if FILE backend exists **/
+    default_printer = cpdbGetDefaultPrinterForBackend(f, "FILE");
+    if (default_printer)
+        goto found;
+    logdebug("Couldn't find a valid default FILE printer\n");
+    
+    /** Fallback to the default printer of first backend found **/
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->backend);
+    backend_name = g_hash_table_iter_next(&iter, &key, &value) ? g_strdup(key) : NULL;
+    cpdbUnlockRegistry(f);
+
+    if (backend_name)
+    {
+        default_printer = cpdbGetDefaultPrinterForBackend(f, backend_name);
+        if (!default_printer)
+            logdebug("Couldn't find a valid default %s printer\n", backend_name);
+        g_free(backend_name);
+        if (default_printer)
+            goto found;
+    }
+    
+    /** Fallback to first printer found **/
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->printer);
+    default_printer = g_hash_table_iter_next(&iter, &key, &value) ?
+                      cpdbRefPrinterObj(value) : NULL;
+    cpdbUnlockRegistry(f);
+    if (!default_printer)
+    {
+        logerror("Couldn't find a valid printer\n");
+        return NULL;
+    }
+
+found:
+    logdebug("Found default printer %s %s\n",
+                default_printer->id, default_printer->backend_name);
+    return default_printer;
+}
+
+int cpdbSetDefaultPrinter(const char *path,
+                          cpdb_printer_obj_t *p)
+{
+    FILE *fp;
+    char *printer_data;
+    GList *printer, *next, *printers;
+    
+    printers = cpdbLoadDefaultPrinters(path);
+    printer_data = cpdbConcatSep(p->id, p->backend_name);
+    
+    if ((fp = fopen(path, "w")) == NULL)
+    {
+        logerror("Error setting default printer : Couldn't open %s for writing\n",
+                    path);
+        return 0;
+    }
+
+    /* Delete duplicate entries */
+    printer = printers;
+    while (printer != NULL)
+    {
+        next = printer->next;
+        if (strcmp(printer->data, printer_data) == 0)
+        {
+            free(printer->data);
+            printers = g_list_delete_link(printers, printer);
+        }
+
+        printer = next;
+    }
+
+    printers = g_list_prepend(printers, printer_data);
+    for (printer = printers; printer != NULL; printer = printer->next)
+    {
+        fprintf(fp, "%s\n", (char *)printer->data);
+    }
+    g_list_free_full(printers, free);
+    loginfo("Saved default printers to %s", path);
+
+    fclose(fp);
+    return 1;
+}
+
+int cpdbSetUserDefaultPrinter(cpdb_printer_obj_t *p)
+{
+    int ret;
+    char *conf_dir, *path;
+
+    if ((conf_dir = cpdbGetUserConfDir()) == NULL)
+    {
+        logerror("Error setting default printer : Couldn't get system config dir\n");
+        return 0;
+    }
+    path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
+    ret = cpdbSetDefaultPrinter(path, p);
+
+    free(path);
+    free(conf_dir);
+    return ret;
+}
+
+int cpdbSetSystemDefaultPrinter(cpdb_printer_obj_t *p)
+{
+    int ret;
+    char *conf_dir, *path;
+
+    if ((conf_dir = cpdbGetSysConfDir()) == NULL)
+    {
+        logerror("Error setting default printer : Couldn't get system config dir\n");
+        return 0;
+    }
+    path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
+    ret = cpdbSetDefaultPrinter(path, p);
+
+    free(path);
+    free(conf_dir);
+    return ret;
+}
+
+static void cpdbLoadPrinterCatalog(cpdb_frontend_obj_t *f)
+{
+    gsize length;
+    guint32 version;
+    char *conf_dir, *path, *contents;
+    GVariant *catalog, *backends, *printers, *printer;
+    GVariantIter iter;
+    GError *error = NULL;
+    cpdb_printer_obj_t *p;
+
+    if ((conf_dir = cpdbGetUserConfDir()) == NULL)
+    {
+        logwarn("No printer catalog found : Couldn't obtain user config dir\n");
+        return;
+    }
+    path = cpdbConcatPath(conf_dir, CPDB_PRINTER_CATALOG_FILE);
+    free(conf_dir);
+
+    if (!g_file_get_contents(path, &contents, &length, &error))
+    {
+        loginfo("No printer catalog found : %s\n", error->message);
+        g_error_free(error);
+        free(path);
+        return;
+    }
+
+    /* Not trusted, so that a corrupted file reads as empty values */
+    catalog = g_variant_new_from_data(G_VARIANT_TYPE(CPDB_CATALOG_ARGS),
+                                      contents, length, FALSE,
+                                      g_free, contents);
+    g_variant_ref_sink(catalog);
+    g_variant_get(catalog, "(u@as@" CPDB_PRINTER_ARRAY_ARGS ")",
+                  &version, &backends, &printers);
+    if (version != CPDB_CATALOG_VERSION)
+    {
+        logwarn("Ignoring printer catalog %s : Unknown version %u\n", path, version);
+        goto out;
+    }
+
+    g_variant_iter_init(&iter, printers);
+    while ((printer = g_variant_iter_next_value(&iter)) != NULL)
+    {
+        p = cpdbGetNewPrinterObj();
+        cpdbFillBasicOptions(p, printer);
+        g_variant_unref(printer);
+        if (*p->id == '\0' || *p->backend_name == '\0' ||
+            cpdbLookupPrinter(f, p->id, p->backend_name) != NULL)
+        {
+            cpdbDeletePrinterObj(p);
+            continue;
+        }
+
+        p->stale = TRUE;
+        cpdbUseSavedSettings(f, p);
+        cpdbInsertPrinter(f, p);
+        cpdbNotifyPrinterChange(f, p, CPDB_CHANGE_PRINTER_ADDED);
+    }
+    loginfo("Loaded %d printers of %d backends from catalog %s\n",
+            f->num_printers, (int) g_variant_n_children(backends), path);
+
+out:
+    g_variant_unref(backends);
+    g_variant_unref(printers);
+    g_variant_unref(catalog);
+    free(path);
+}
+
+static void cpdbSavePrinterCatalog(cpdb_frontend_obj_t *f)
+{
+    char *conf_dir, *path;
+    GVariantBuilder backends, printers;
+    GVariant *catalog;
+    GHashTableIter iter;
+    gpointer key, value;
+    GError *error = NULL;
+    cpdb_printer_obj_t *p;
+
+    if ((conf_dir = cpdbGetUserConfDir()) == NULL)
+    {
+        logerror("Error saving printer catalog : Couldn't obtain user config dir\n");
+        return;
+    }
+    path = cpdbConcatPath(conf_dir, CPDB_PRINTER_CATALOG_FILE);
+    free(conf_dir);
+
+    cpdbLockRegistry(f);
+    g_variant_builder_init(&backends, G_VARIANT_TYPE("as"));
+    g_hash_table_iter_init(&iter, f->backend);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_variant_builder_add(&backends, "s", (char *) key);
+
+    g_variant_builder_init(&printers, G_VARIANT_TYPE(CPDB_PRINTER_ARRAY_ARGS));
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        p = value;
+        g_variant_builder_add(&printers, CPDB_PRINTER_ARGS,
+                              p->id,
+                              p->name ? p->name : "",
+                              p->info ? p->info : "",
+                              p->location ? p->location : "",
+                              p->make_and_model ? p->make_and_model : "",
+                              p->accepting_jobs,
+                              p->state ? p->state : "",
+                              p->backend_name);
+    }
+
+    catalog = g_variant_ref_sink(g_variant_new(CPDB_CATALOG_ARGS,
+                                               CPDB_CATALOG_VERSION,
+                                               &backends,
+                                               &printers));
+    cpdbUnlockRegistry(f);
+    if (!g_file_set_contents(path,
+                             g_variant_get_data(catalog),
+                             g_variant_get_size(catalog),
+                             &error))
+    {
+        logerror("Error saving printer catalog to %s : %s\n", path, error->message);
+        g_error_free(error);
+    }
+    else
+    {
+        loginfo("Saved %d printers to catalog %s\n", f->num_printers, path);
+    }
+
+    g_variant_unref(catalog);
+    free(path);
+}
+
+/* Case fold a string for matching, NULL gives "" */
+static char *cpdbFoldString(const char *str)
+{
+    char *normalized, *folded;
+
+    if (str == NULL)
+        return g_strdup("");
+    if ((normalized = g_utf8_normalize(str, -1, G_NORMALIZE_ALL)) == NULL)
+        return g_ascii_strdown(str, -1);
+    folded = g_utf8_casefold(normalized, -1);
+    g_free(normalized);
+    return folded;
+}
+
+static gboolean cpdbIsWordChar(char c)
+{
+    return (guchar) c >= 0x80 || g_ascii_isalnum(c);
+}
+
+/* Split a folded string into its words */
+static GPtrArray *cpdbSplitWords(const char *folded)
+{
+    GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+    const char *start;
+
+    while (*folded)
+    {
+        if (!cpdbIsWordChar(*folded))
+        {
+            folded++;
+            continue;
+        }
+        for (start = folded; *folded && cpdbIsWordChar(*folded); folded++)
+            ;
+        g_ptr_array_add(words, g_strndup(start, folded - start));
+    }
+    return words;
+}
+
+static int cpdbCompareTokens(gconstpointer a,
+                             gconstpointer b,
+                             gpointer user_data)
+{
+    const cpdb_search_token_t *t1 = a, *t2 = b;
+    int cmp = strcmp(t1->word, t2->word);
+
+    if (cmp != 0)
+        return cmp;
+    return (t1->entry > t2->entry) - (t1->entry < t2->entry);
+}
+
+static void cpdbFreeSearchToken(gpointer data)
+{
+    cpdb_search_token_t *token = data;
+
+    g_free(token->word);
+    g_free(token);
+}
+
+#define CPDB_TRIGRAM(s) GUINT_TO_POINTER(((guint) (guchar) (s)[0] << 16) | \
+                                         ((guint) (guchar) (s)[1] << 8) | \
+                                         (guint) (guchar) (s)[2])
+
+/* Add an entry to or remove it from the sets of the trigrams of its fields */
+static void cpdbIndexTrigrams(cpdb_search_index_t *index,
+                              cpdb_search_entry_t *entry,
+                              gboolean add)
+{
+    GHashTable *set;
+    const char *s;
+    guint i;
+
+    for (i = 0; i < CPDB_SEARCH_FIELDS; i++)
+    {
+        for (s = entry->folded[i]; s[0] && s[1] && s[2]; s++)
+        {
+            set = g_hash_table_lookup(index->trigrams, CPDB_TRIGRAM(s));
+            if (add)
+            {
+                if (set == NULL)
+                {
+                    set = g_hash_table_new(NULL, NULL);
+                    g_hash_table_insert(index->trigrams, CPDB_TRIGRAM(s), set);
+                }
+                g_hash_table_add(set, entry);
+            }
+            else if (set)
+            {
+                g_hash_table_remove(set, entry);
+                if (g_hash_table_size(set) == 0)
+                    g_hash_table_remove(index->trigrams, CPDB_TRIGRAM(s));
+            }
+        }
+    }
+}
+
+/* Find the entries containing the rarest trigram of the query words,
+ * which is NULL if no entry contains it. Returns FALSE if all the words
+ * are too short to have a trigram. */
+static gboolean cpdbFindRarestTrigram(cpdb_search_index_t *index,
+                                      GPtrArray *words,
+                                      GHashTable **entries)
+{
+    GHashTable *set;
+    const char *s;
+    gboolean found = FALSE;
+    guint i;
+
+    *entries = NULL;
+    for (i = 0; i < words->len; i++)
+    {
+        for (s = g_ptr_array_index(words, i); s[0] && s[1] && s[2]; s++)
+        {
+            if ((set = g_hash_table_lookup(index->trigrams, CPDB_TRIGRAM(s))) == NULL)
+            {
+                *entries = NULL;
+                return TRUE;
+            }
+            if (!found || g_hash_table_size(set) < g_hash_table_size(*entries))
+                *entries = set;
+            found = TRUE;
+        }
+    }
+    return found;
+}
+
+static void cpdbIndexPrinter(cpdb_search_index_t *index,
+                             cpdb_printer_obj_t *p)
+{
+    cpdb_search_entry_t *entry;
+    cpdb_search_token_t *token;
+    GPtrArray *words;
+    guint i, j;
+
+    entry = g_new0(cpdb_search_entry_t, 1);
+    entry->printer = p;
+    entry->folded[CPDB_SEARCH_NAME] = cpdbFoldString(p->name);
+    entry->folded[CPDB_SEARCH_INFO] = cpdbFoldString(p->info);
+    entry->folded[CPDB_SEARCH_LOCATION] = cpdbFoldString(p->location);
+    entry->folded[CPDB_SEARCH_MAKE_AND_MODEL] = cpdbFoldString(p->make_and_model);
+    entry->tokens = g_ptr_array_new();
+
+    for (i = 0; i < CPDB_SEARCH_FIELDS; i++)
+    {
+        words = cpdbSplitWords(entry->folded[i]);
+        for (j = 0; j < words->len; j++)
+        {
+            token = g_new(cpdb_search_token_t, 1);
+            token->word = g_ptr_array_index(words, j);
+            token->entry = entry;
+            g_ptr_array_add(entry->tokens,
+                            g_sequence_insert_sorted(index->tokens, token,
+                                                     cpdbCompareTokens, NULL));
+        }
+        /* The words are owned by the tokens now */
+        g_ptr_array_set_free_func(words, NULL);
+        g_ptr_array_free(words, TRUE);
+    }
+    cpdbIndexTrigrams(index, entry, TRUE);
+    g_hash_table_insert(index->entries, p, entry);
+}
+
+static void cpdbUnindexPrinter(cpdb_search_index_t *index,
+                               cpdb_printer_obj_t *p)
+{
+    cpdb_search_entry_t *entry;
+    guint i;
+
+    if ((entry = g_hash_table_lookup(index->entries, p)) == NULL)
+        return;
+    g_hash_table_remove(index->entries, p);
+    cpdbIndexTrigrams(index, entry, FALSE);
+
+    for (i = 0; i < entry->tokens->len; i++)
+        g_sequence_remove(g_ptr_array_index(entry->tokens, i));
+    g_ptr_array_free(entry->tokens, TRUE);
+    for (i = 0; i < CPDB_SEARCH_FIELDS; i++)
+        g_free(entry->folded[i]);
+    g_free(entry);
+}
+
+static void cpdbFreeSearchIndex(cpdb_search_index_t *index)
+{
+    GList *printers, *l;
+
+    printers = g_hash_table_get_keys(index->entries);
+    for (l = printers; l != NULL; l = l->next)
+        cpdbUnindexPrinter(index, l->data);
+    g_list_free(printers);
+
+    g_hash_table_destroy(index->entries);
+    g_sequence_free(index->tokens);
+    g_hash_table_destroy(index->trigrams);
+    g_free(index);
+}
+
+/* The index is only built once a search is made, and kept up to date
+ * with the printers from then on */
+static cpdb_search_index_t *cpdbGetSearchIndex(cpdb_frontend_obj_t *f)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (f->search == NULL)
+    {
+        f->search = g_new0(cpdb_search_index_t, 1);
+        f->search->entries = g_hash_table_new(NULL, NULL);
+        f->search->tokens = g_sequence_new(cpdbFreeSearchToken);
+        f->search->trigrams = g_hash_table_new_full(NULL, NULL, NULL,
+                                                    (GDestroyNotify) g_hash_table_destroy);
+
+        g_hash_table_iter_init(&iter, f->printer);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            cpdbIndexPrinter(f->search, value);
+        logdebug("Indexed %d printers for searching\n", f->num_printers);
+    }
+    return f->search;
+}
+
+/* How well a folded field matches a query word:
+ * 0 at its start, 1 at the start of one of its words,
+ * 2 inside a word, -1 not at all */
+static int cpdbMatchWord(const char *folded,
+                         const char *word)
+{
+    const char *match;
+    int best = -1;
+
+    for (match = strstr(folded, word); match != NULL; match = strstr(match + 1, word))
+    {
+        if (match == folded)
+            return 0;
+        if (!cpdbIsWordChar(match[-1]))
+            best = 1;
+        else if (best < 0)
+            best = 2;
+    }
+    return best;
+}
+
+/* Rank of a printer for the query words, lower is better,
+ * -1 if some word doesn't match */
+static int cpdbRankPrinter(const cpdb_search_entry_t *entry,
+                           GPtrArray *words,
+                           cpdb_search_mode_t mode)
+{
+    int field, match, rank, word_rank, total = 0;
+    guint i;
+
+    for (i = 0; i < words->len; i++)
+    {
+        word_rank = -1;
+        for (field = 0; field < CPDB_SEARCH_FIELDS; field++)
+        {
+            match = cpdbMatchWord(entry->folded[field], g_ptr_array_index(words, i));
+            if (match < 0 || (match == 2 && mode == CPDB_SEARCH_PREFIX))
+                continue;
+
+            /* Name first, then words of the other fields, then substrings */
+            if (match == 2)
+                rank = 3;
+            else if (field == CPDB_SEARCH_NAME)
+                rank = match;
+            else
+                rank = 2;
+            if (word_rank < 0 || rank < word_rank)
+                word_rank = rank;
+        }
+        if (word_rank < 0)
+            return -1;
+        total += word_rank;
+    }
+    return total;
+}
+
+typedef struct cpdb_search_result_s
+{
+    int rank;
+    const cpdb_search_entry_t *entry;
+} cpdb_search_result_t;
+
+static int cpdbCompareSearchResults(gconstpointer a,
+                                    gconstpointer b)
+{
+    const cpdb_search_result_t *r1 = a, *r2 = b;
+    int cmp;
+
+    if (r1->rank != r2->rank)
+        return r1->rank - r2->rank;
+    cmp = strcmp(r1->entry->folded[CPDB_SEARCH_NAME], r2->entry->folded[CPDB_SEARCH_NAME]);
+    if (cmp != 0)
+        return cmp;
+    return strcmp(r1->entry->printer->backend_name, r2->entry->printer->backend_name);
+}
+
+static void cpdbAddSearchResult(GArray *results,
+                                GHashTable *seen,
+                                const cpdb_search_entry_t *entry,
+                                GPtrArray *words,
+                                cpdb_search_mode_t mode)
+{
+    cpdb_search_result_t result;
+
+    if (seen && !g_hash_table_add(seen, (gpointer) entry))
+        return;
+    if ((result.rank = cpdbRankPrinter(entry, words, mode)) < 0)
+        return;
+    result.entry = entry;
+    g_array_append_val(results, result);
+}
+
+cpdb_printer_obj_t **cpdbSearchPrinters(cpdb_frontend_obj_t *f,
+                                        const char *query,
+                                        cpdb_search_mode_t mode,
+                                        int limit,
+                                        int *num_results)
+{
+    cpdb_search_index_t *index;
+    cpdb_search_token_t probe = { NULL, NULL }, *token;
+    cpdb_search_result_t *result;
+    cpdb_printer_obj_t **printers;
+    GSequenceIter *seq_iter;
+    GHashTableIter iter;
+    gpointer key, value;
+    GHashTable *seen, *candidates;
+    GPtrArray *words;
+    GArray *results;
+    char *folded;
+    guint i, n;
+
+    if (num_results)
+        *num_results = 0;
+    if (f == NULL || query == NULL)
+    {
+        logwarn("Invalid params: cpdbSearchPrinters()\n");
+        return NULL;
+    }
+
+    cpdbLockRegistry(f);
+    index = cpdbGetSearchIndex(f);
+    folded = cpdbFoldString(query);
+    words = cpdbSplitWords(folded);
+    g_free(folded);
+    results = g_array_new(FALSE, FALSE, sizeof(cpdb_search_result_t));
+
+    if (words->len == 0)
+    {
+        /* Nothing to match */
+    }
+    else if (mode == CPDB_SEARCH_PREFIX)
+    {
+        /* Candidates are the printers with a word starting with the
+         * longest query word, which is likely the rarest */
+        for (i = 0; i < words->len; i++)
+            if (probe.word == NULL || strlen(g_ptr_array_index(words, i)) > strlen(probe.word))
+                probe.word = g_ptr_array_index(words, i);
+
+        seen = g_hash_table_new(NULL, NULL);
+        seq_iter = g_sequence_search(index->tokens, &probe, cpdbCompareTokens, NULL);
+        for (; !g_sequence_iter_is_end(seq_iter); seq_iter = g_sequence_iter_next(seq_iter))
+        {
+            token = g_sequence_get(seq_iter);
+            if (!g_str_has_prefix(token->word, probe.word))
+                break;
+            cpdbAddSearchResult(results, seen, token->entry, words, mode);
+        }
+        g_hash_table_destroy(seen);
+    }
+    else if (cpdbFindRarestTrigram(index, words, &candidates))
+    {
+        /* Candidates are the printers containing the rarest trigram
+         * of the query words */
+        if (candidates)
+        {
+            g_hash_table_iter_init(&iter, candidates);
+            while (g_hash_table_iter_next(&iter, &key, &value))
+                cpdbAddSearchResult(results, NULL, key, words, mode);
+        }
+    }
+    else
+    {
+        /* Only words of one or two bytes, nothing to narrow down by */
+        g_hash_table_iter_init(&iter, index->entries);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            cpdbAddSearchResult(results, NULL, value, words, mode);
+    }
+
+    g_array_sort(results, cpdbCompareSearchResults);
+    n = results->len;
+    if (limit > 0 && n > (guint) limit)
+        n = limit;
+    printers = g_new(cpdb_printer_obj_t *, n + 1);
+    for (i = 0; i < n; i++)
+    {
+        result = &g_array_index(results, cpdb_search_result_t, i);
+        printers[i] = cpdbRefPrinterObj(result->entry->printer);
+    }
+    printers[n] = NULL;
+    cpdbUnlockRegistry(f);
+
+    logdebug("Search for \"%s\" matched %u printers\n", query, results->len);
+    if (num_results)
+        *num_results = n;
+    g_array_free(results, TRUE);
+    g_ptr_array_free(words, TRUE);
+    return printers;
+}
+
+static int cpdbComparePrinters(gconstpointer a,
+                               gconstpointer b,
+                               gpointer user_data)
+{
+    const cpdb_sort_item_t *i1 = a, *i2 = b;
+    const cpdb_printer_obj_t *p1 = i1->printer, *p2 = i2->printer;
+    const cpdb_sorted_view_t *view = user_data;
+    int cmp = 0;
+
+    switch (view->order)
+    {
+    case CPDB_SORT_BY_COLLATION:
+        cmp = strcmp(i1->collate_key, i2->collate_key);
+        break;
+    case CPDB_SORT_BY_BACKEND:
+        cmp = strcmp(p1->backend_name, p2->backend_name);
+        break;
+    default:
+        break;
+    }
+    if (cmp == 0)
+        cmp = g_strcmp0(p1->name, p2->name);
+    if (cmp == 0)
+        cmp = strcmp(p1->backend_name, p2->backend_name);
+    if (cmp == 0)
+        cmp = strcmp(p1->id, p2->id);
+    return cmp;
+}
+
+static void cpdbFreeSortItem(gpointer data)
+{
+    cpdb_sort_item_t *item = data;
+
+    g_free(item->collate_key);
+    g_free(item);
+}
+
+static cpdb_sort_item_t *cpdbNewSortItem(cpdb_sorted_view_t *view,
+                                         cpdb_printer_obj_t *p)
+{
+    cpdb_sort_item_t *item = g_new0(cpdb_sort_item_t, 1);
+
+    item->printer = p;
+    if (view->order == CPDB_SORT_BY_COLLATION)
+        item->collate_key = g_utf8_collate_key(p->name ? p->name : "", -1);
+    return item;
+}
+
+static void cpdbSortPrinter(cpdb_sorted_view_t *view,
+                            cpdb_printer_obj_t *p)
+{
+    GSequenceIter *iter;
+
+    iter = g_sequence_insert_sorted(view->items, cpdbNewSortItem(view, p),
+                                    cpdbComparePrinters, view);
+    g_hash_table_insert(view->iters, p, iter);
+}
+
+static void cpdbUnsortPrinter(cpdb_sorted_view_t *view,
+                              cpdb_printer_obj_t *p)
+{
+    GSequenceIter *iter;
+
+    if ((iter = g_hash_table_lookup(view->iters, p)) == NULL)
+        return;
+    g_hash_table_remove(view->iters, p);
+    g_sequence_remove(iter);
+}
+
+static void cpdbFreeSortedView(cpdb_sorted_view_t *view)
+{
+    g_sequence_free(view->items);
+    g_hash_table_destroy(view->iters);
+    g_free(view);
+}
+
+/* A sorted view is only built once asked for, and kept up to date
+ * with the printers from then on */
+static cpdb_sorted_view_t *cpdbGetSortedView(cpdb_frontend_obj_t *f,
+                                             cpdb_sort_order_t order)
+{
+    cpdb_sorted_view_t *view;
+    GSequenceIter *iter;
+    GHashTableIter hash_iter;
+    gpointer key, value;
+
+    if ((view = f->sorted[order]) != NULL)
+        return view;
+
+    view = g_new0(cpdb_sorted_view_t, 1);
+    view->order = order;
+    view->items = g_sequence_new(cpdbFreeSortItem);
+    view->iters = g_hash_table_new(NULL, NULL);
+
+    /* Sorting once is cheaper than inserting one by one */
+    g_hash_table_iter_init(&hash_iter, f->printer);
+    while (g_hash_table_iter_next(&hash_iter, &key, &value))
+        g_sequence_append(view->items, cpdbNewSortItem(view, value));
+    g_sequence_sort(view->items, cpdbComparePrinters, view);
+    for (iter = g_sequence_get_begin_iter(view->items);
+         !g_sequence_iter_is_end(iter);
+         iter = g_sequence_iter_next(iter))
+    {
+        cpdb_sort_item_t *item = g_sequence_get(iter);
+        g_hash_table_insert(view->iters, item->printer, iter);
+    }
+
+    logdebug("Sorted %d printers in order %d\n", f->num_printers, order);
+    f->sorted[order] = view;
+    return view;
+}
+
+/* Keep the search index and the sorted views up to date with a printer
+ * being added, or renamed after cpdbUntrackPrinter() */
+static void cpdbTrackPrinter(cpdb_frontend_obj_t *f,
+                             cpdb_printer_obj_t *p)
+{
+    int i;
+
+    if (f->search)
+        cpdbIndexPrinter(f->search, p);
+    for (i = 0; i < CPDB_SORT_COUNT; i++)
+    {
+        if (f->sorted[i])
+            cpdbSortPrinter(f->sorted[i], p);
+    }
+}
+
+static void cpdbUntrackPrinter(cpdb_frontend_obj_t *f,
+                               cpdb_printer_obj_t *p)
+{
+    int i;
+
+    if (f->search)
+        cpdbUnindexPrinter(f->search, p);
+    for (i = 0; i < CPDB_SORT_COUNT; i++)
+    {
+        if (f->sorted[i])
+            cpdbUnsortPrinter(f->sorted[i], p);
+    }
+}
+
+cpdb_printer_obj_t **cpdbGetSortedPrinters(cpdb_frontend_obj_t *f,
+                                           cpdb_sort_order_t order,
+                                           int offset,
+                                           int limit,
+                                           int *num_printers)
+{
+    cpdb_sorted_view_t *view;
+    cpdb_printer_obj_t **printers;
+    cpdb_sort_item_t *item;
+    GSequenceIter *iter;
+    int length, n, i;
+
+    if (num_printers)
+        *num_printers = 0;
+    if (f == NULL || order < 0 || order >= CPDB_SORT_COUNT || offset < 0)
+    {
+        logwarn("Invalid params: cpdbGetSortedPrinters()\n");
+        return NULL;
+    }
+
+    cpdbLockRegistry(f);
+    view = cpdbGetSortedView(f, order);
+    length = g_sequence_get_length(view->items);
+    n = offset < length ? length - offset : 0;
+    if (limit > 0 && n > limit)
+        n = limit;
+
+    printers = g_new(cpdb_printer_obj_t *, n + 1);
+    iter = g_sequence_get_iter_at_pos(view->items, offset);
+    for (i = 0; i < n; i++)
+    {
+        item = g_sequence_get(iter);
+        printers[i] = cpdbRefPrinterObj(item->printer);
+        iter = g_sequence_iter_next(iter);
+    }
+    printers[n] = NULL;
+    cpdbUnlockRegistry(f);
+
+    if (num_printers)
+        *num_printers = n;
+    return printers;
+}
+
+int cpdbGetSortedPosition(cpdb_frontend_obj_t *f,
+                          cpdb_sort_order_t order,
+                          cpdb_printer_obj_t *p)
+{
+    GSequenceIter *iter;
+    int position;
+
+    if (f == NULL || p == NULL || order < 0 || order >= CPDB_SORT_COUNT)
+    {
+        logwarn("Invalid params: cpdbGetSortedPosition()\n");
+        return -1;
+    }
+
+    cpdbLockRegistry(f);
+    iter = g_hash_table_lookup(cpdbGetSortedView(f, order)->iters, p);
+    position = iter ? g_sequence_iter_get_position(iter) : -1;
+    cpdbUnlockRegistry(f);
+    return position;
+}
+
+/* Whether a printer prints in color, -1 until its options are known */
+static int cpdbGetPrinterColor(cpdb_printer_obj_t *p)
+{
+    cpdb_options_t *options;
+    cpdb_option_t *opt;
+    int i;
+
+    if ((options = cpdbGetPrinterOptions(p)) == NULL)
+        return -1;
+    if ((opt = g_hash_table_lookup(options->table, CPDB_OPTION_COLOR_MODE)) == NULL)
+        return 0;
+    for (i = 0; i < opt->num_supported; i++)
+    {
+        if (strcmp(opt->supported_values[i], "color") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Ask the backend for its printers matching the filter,
+ * FALSE if it doesn't know how to */
+static gboolean cpdbGetBackendMatches(cpdb_frontend_obj_t *f,
+                                      const char *backend_name,
+                                      PrintBackend *proxy,
+                                      GVariant *filter,
+                                      GHashTable *matches)
+{
+    GVariant *reply, *printers, *printer;
+    GVariantIter iter;
+    GError *error = NULL;
+    cpdb_printer_record_t record;
+    cpdb_printer_obj_t *p;
+
+    if (g_object_get_data(G_OBJECT(proxy), CPDB_NO_FILTER_KEY) != NULL)
+        return FALSE;
+
+    reply = cpdbCallBackendSync(proxy,
+                                "GetMatchingPrinters",
+                                g_variant_new("(@" CPDB_FILTER_ARGS ")", filter),
+                                G_VARIANT_TYPE("(ia(v))"),
+                                f->timeouts[CPDB_CALL_LISTING],
+                                NULL,
+                                &error);
+    if (error)
+    {
+        if (g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        {
+            loginfo("Backend %s can't filter printers, filtering them here\n",
+                    backend_name);
+            g_object_set_data(G_OBJECT(proxy), CPDB_NO_FILTER_KEY, GINT_TO_POINTER(TRUE));
+            g_error_free(error);
+            return FALSE;
+        }
+        logerror("Error getting matching printers of %s : %s\n",
+                 backend_name, error->message);
+        g_error_free(error);
+        return TRUE;
+    }
+
+    printers = g_variant_get_child_value(reply, 1);
+    logdebug("Fetched %d matching printers from backend %s\n",
+             (int) g_variant_n_children(printers), backend_name);
+
+    cpdbLockRegistry(f);
+    g_variant_iter_init(&iter, printers);
+    while (g_variant_iter_loop(&iter, "(v)", &printer))
+    {
+        cpdbGetPrinterRecord(printer, &record);
+        if ((p = cpdbMergePrinter(f, &record, TRUE)) != NULL)
+            g_hash_table_add(matches, cpdbRefPrinterObj(p));
+    }
+    cpdbUnlockRegistry(f);
+
+    g_variant_unref(printers);
+    g_variant_unref(reply);
+    return TRUE;
+}
+
+typedef struct {
+    cpdb_frontend_obj_t *f;
+    GVariant *filter;
+    GHashTable *matches;            /** Set of referenced cpdb_printer_obj_t */
+} cpdb_filter_lookup_t;
+
+/* Filter the printers already known from a backend */
+static void cpdbFilterBackendPrinters(cpdb_frontend_obj_t *f,
+                                      const char *backend_name,
+                                      GVariant *filter,
+                                      GHashTable *matches)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    cpdb_printer_obj_t *p;
+
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        p = value;
+        if (strcmp(p->backend_name, backend_name) == 0 &&
+            cpdbMatchPrinterFilter(filter, p->location, p->make_and_model,
+                                   p->state, p->accepting_jobs,
+                                   cpdbGetPrinterColor(p)))
+            g_hash_table_add(matches, cpdbRefPrinterObj(p));
+    }
+    cpdbUnlockRegistry(f);
+}
+
+static void getMatchingLookup(gpointer key, gpointer value, gpointer user_data)
+{
+    cpdb_filter_lookup_t *lookup = user_data;
+    const char *backend_name = key;
+    PrintBackend *proxy = value;
+
+    if (!cpdbIsBackendAvailable(proxy))
+    {
+        logwarn("Not filtering printers of %s : Backend isn't answering\n", backend_name);
+        return;
+    }
+    if (!cpdbGetBackendMatches(lookup->f, backend_name, proxy,
+                               lookup->filter, lookup->matches))
+        cpdbFilterBackendPrinters(lookup->f, backend_name,
+                                  lookup->filter, lookup->matches);
+}
+
+cpdb_printer_obj_t **cpdbGetMatchingPrinters(cpdb_frontend_obj_t *f,
+                                             GVariant *filter,
+                                             int *num_printers)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GHashTable *matches;
+    cpdb_filter_lookup_t lookup;
+    cpdb_printer_obj_t **printers;
+    guint n = 0;
+
+    if (num_printers)
+        *num_printers = 0;
+    if (f == NULL || filter == NULL)
+    {
+        logwarn("Invalid params: cpdbGetMatchingPrinters()\n");
+        return NULL;
+    }
+    g_variant_ref_sink(filter);
+    if (!cpdbIsValidPrinterFilter(filter))
+    {
+        logwarn("Invalid params: cpdbGetMatchingPrinters()\n");
+        g_variant_unref(filter);
+        return NULL;
+    }
+
+    matches = g_hash_table_new_full(NULL, NULL,
+                                    (GDestroyNotify) cpdbUnrefPrinterObj, NULL);
+    lookup.f = f;
+    lookup.filter = filter;
+    lookup.matches = matches;
+    cpdbForeachBackend(f, getMatchingLookup, &lookup);
+
+    /* Printers merged above may be gone again by now */
+    cpdbLockRegistry(f);
+    printers = g_new(cpdb_printer_obj_t *, g_hash_table_size(matches) + 1);
+    g_hash_table_iter_init(&iter, matches);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if (g_hash_table_lookup(f->printer, &((cpdb_printer_obj_t *) key)->key) == key)
+            printers[n++] = cpdbRefPrinterObj(key);
+    }
+    printers[n] = NULL;
+    cpdbUnlockRegistry(f);
+
+    loginfo("Found %u printers matching filter\n", n);
+    if (num_printers)
+        *num_printers = n;
+    g_hash_table_destroy(matches);
+    g_variant_unref(filter);
+    return printers;
+}
+
+/* The registry lock is recursive, so callbacks run while it's held can
+ * use the API again. Whatever changed gets published to the readers
+ * once the outermost caller lets go of it. */
+static void cpdbLockRegistry(cpdb_frontend_obj_t *f)
+{
+    g_rec_mutex_lock(&f->registry_lock);
+    f->registry_depth++;
+}
+
+static void cpdbUnlockRegistry(cpdb_frontend_obj_t *f)
+{
+    cpdb_default_prefetch_t *d = f->default_prefetch;
+    GArray *changes = NULL;
+    cpdb_prefetch_work_t *prefetch = NULL;
+
+    if (--f->registry_depth == 0)
+    {
+        if (f->registry_dirty)
+            cpdbPublishPrinters(f);
+        if (f->pending_changes->len > 0 && f->background_context &&
+            g_main_context_get_thread_default() == f->background_context)
+        {
+            cpdbDeferPrinterChanges(f);
+        }
+        else if (f->pending_changes->len > 0)
+        {
+            changes = f->pending_changes;
+            f->pending_changes = g_array_new(FALSE, FALSE, sizeof(cpdb_printer_change_t));
+        }
+        if (d && d->pending->len > 0)
+        {
+            prefetch = cpdbNewPrefetchWork(f);
+            prefetch->printers = d->pending;
+            prefetch->locale = g_strdup(d->locale);
+            d->pending = g_ptr_array_new_with_free_func((GDestroyNotify) cpdbUnrefPrinterObj);
+        }
+    }
+    g_rec_mutex_unlock(&f->registry_lock);
+
+    if (prefetch)
+        cpdbQueuePrefetchWork(prefetch);
+    if (changes)
+        cpdbDeliverPrinterChanges(f, changes);
+}
+
+/* Lookup a backend proxy, the reference returned outlives the backend
+ * being removed from the registry */
+static PrintBackend *cpdbRefBackend(cpdb_frontend_obj_t *f,
+                                    const char *backend_name)
+{
+    PrintBackend *proxy;
+
+    cpdbLockRegistry(f);
+    proxy = g_hash_table_lookup(f->backend, backend_name);
+    if (proxy)
+        g_object_ref(proxy);
+    cpdbUnlockRegistry(f);
+    return proxy;
+}
+
+/* Call func on every backend without holding the registry lock, so
+ * that blocking D-Bus calls don't stall the other threads */
+static void cpdbForeachBackend(cpdb_frontend_obj_t *f,
+                               GHFunc func,
+                               gpointer user_data)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *names, *proxies;
+    guint i;
+
+    names = g_ptr_array_new_with_free_func(g_free);
+    proxies = g_ptr_array_new_with_free_func(g_object_unref);
+
+    cpdbLockRegistry(f);
+    g_hash_table_iter_init(&iter, f->backend);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        g_ptr_array_add(names, g_strdup(key));
+        g_ptr_array_add(proxies, g_object_ref(value));
+    }
+    cpdbUnlockRegistry(f);
+
+    for (i = 0; i < names->len; i++)
+        func(g_ptr_array_index(names, i), g_ptr_array_index(proxies, i), user_data);
+
+    g_ptr_array_free(names, TRUE);
+    g_ptr_array_free(proxies, TRUE);
+}
+
+/* Replace the snapshot handed out to readers by a copy of the current
+ * printer table, the registry lock has to be held */
+static void cpdbPublishPrinters(cpdb_frontend_obj_t *f)
+{
+    cpdb_printer_snapshot_t *snapshot, *old;
+    cpdb_printer_view_t *views;
+    cpdb_printer_obj_t *p;
+    GHashTableIter iter;
+    gpointer key, value;
+    int n = 0;
+
+    snapshot = g_new0(cpdb_printer_snapshot_t, 1);
+    snapshot->ref_count = 1;
+    snapshot->arena = cpdbNewArena(0);
+    views = cpdbArenaAlloc(snapshot->arena,
+                           f->num_printers * sizeof(cpdb_printer_view_t));
+    g_hash_table_iter_init(&iter, f->printer);
+    while (g_hash_table_iter_next(&iter, &key, &value) && n < f->num_printers)
+    {
+        p = value;
+        views[n].id = cpdbArenaStrdup(snapshot->arena, p->id);
+        views[n].name = cpdbArenaStrdup(snapshot->arena, p->name);
+        views[n].info = cpdbArenaStrdup(snapshot->arena, p->info);
+        views[n].location = cpdbArenaStrdup(snapshot->arena, p->location);
+        views[n].make_and_model = cpdbArenaStrdup(snapshot->arena, p->make_and_model);
+        views[n].state = cpdbArenaStrdup(snapshot->arena, p->state);
+        views[n].backend_name = cpdbArenaStrdup(snapshot->arena, p->backend_name);
+        views[n].accepting_jobs = p->accepting_jobs;
+        n++;
+    }
+    snapshot->printers = views;
+    snapshot->num_printers = n;
+
+    g_mutex_lock(&f->snapshot_lock);
+    old = f->snapshot;
+    f->snapshot = snapshot;
+    g_mutex_unlock(&f->snapshot_lock);
+    f->registry_dirty = FALSE;
+
+    logdebug("Published snapshot of %d printers\n", n);
+    if (old)
+        cpdbUnrefPrinterSnapshot(old);
+}
+
+cpdb_printer_snapshot_t *cpdbGetPrinterSnapshot(cpdb_frontend_obj_t *f)
+{
+    cpdb_printer_snapshot_t *snapshot;
+
+    if (f == NULL)
+    {
+        logwarn("Invalid params: cpdbGetPrinterSnapshot()\n");
+        return NULL;
+    }
+
+    /* Only guards the pointer against being swapped, never waits on
+     * the registry lock */
+    g_mutex_lock(&f->snapshot_lock);
+    snapshot = f->snapshot;
+    g_atomic_int_inc(&snapshot->ref_count);
+    g_mutex_unlock(&f->snapshot_lock);
+    return snapshot;
+}
+
+void cpdbUnrefPrinterSnapshot(cpdb_printer_snapshot_t *snapshot)
 {
-    loginfo("Unhiding remote printers\n");
-    g_hash_table_foreach(f->backend, showRemoteLookup, NULL);
-    
+    if (snapshot == NULL)
+        return;
+    if (!g_atomic_int_dec_and_test(&snapshot->ref_count))
+        return;
+
+    cpdbFreeArena(snapshot->arena);
+    g_free(snapshot);
 }
 
-void hideTemporaryLookup(gpointer key, gpointer value, gpointer user_data){
-    PrintBackend *proxy = value;
-    GError *error = NULL; 
-    print_backend_call_show_temporary_printers_sync(proxy, false, NULL,
-                                       &error);
+/**
+________________________________________________ cpdb_printer_obj_t __________________________________________
+**/
+
+cpdb_printer_obj_t *cpdbGetNewPrinterObj()
+{
+    cpdb_printer_obj_t *p = g_new0 (cpdb_printer_obj_t, 1);
+    p->options = NULL;
+    p->settings = cpdbGetNewSettings();
+    memcpy(p->timeouts, cpdb_default_timeouts, sizeof(p->timeouts));
+    p->cancellable = g_cancellable_new();
+    p->ref_count = 1;
+    return p;
 }
 
-void cpdbHideTemporaryPrinters(cpdb_frontend_obj_t *f)
+static void cpdbDeleteTranslations(cpdb_printer_obj_t *p)
 {
-    loginfo("Hiding temporary printers\n");
-    g_hash_table_foreach(f->backend, hideTemporaryLookup, NULL);
-    
+    g_free(p->locale);
+    if (p->translations)
+        g_hash_table_destroy(p->translations);
+    cpdbFreeArena(p->translations_arena);
+
+    p->locale = NULL;
+    p->translations = NULL;
+    p->translations_arena = NULL;
 }
 
-void showTemporaryLookup(gpointer key, gpointer value, gpointer user_data){
-    PrintBackend *proxy = value;
-    GError *error = NULL; 
-    print_backend_call_show_temporary_printers_sync(proxy, true, NULL,
-                                       &error);
+cpdb_printer_obj_t *cpdbRefPrinterObj(cpdb_printer_obj_t *p)
+{
+    if (p == NULL)
+    {
+        logwarn("Invalid params: cpdbRefPrinterObj()\n");
+        return NULL;
+    }
+
+    g_atomic_int_inc(&p->ref_count);
+    return p;
 }
 
-void cpdbUnhideTemporaryPrinters(cpdb_frontend_obj_t *f)
+void cpdbDeletePrinterObj(cpdb_printer_obj_t *p)
 {
-    loginfo("Unhiding temporary printers\n");
-    g_hash_table_foreach(f->backend, showTemporaryLookup, NULL);
+    cpdbUnrefPrinterObj(p);
+}
+
+void cpdbUnrefPrinterObj(cpdb_printer_obj_t *p)
+{
+    if (p == NULL)
+        return;
+    if (!g_atomic_int_dec_and_test(&p->ref_count))
+        return;
+    
+    logdebug("Deleting printer object %s\n", p->id);
+    cpdbFreePrinterStrings(p);
+    if (p->backend_proxy)
+        g_object_unref(p->backend_proxy);
+    if (p->options)
+        cpdbUnrefOptions(p->options);
+    if (p->prefetched_options)
+        cpdbUnrefOptions(p->prefetched_options);
+    g_slist_free_full(p->retired_options, (GDestroyNotify) cpdbUnrefOptions);
+    g_slist_free_full(p->retired_strings, g_free);
+    if (p->settings)
+        cpdbUnrefSettings(p->settings);
+    if (p->cancellable)
+        g_object_unref(p->cancellable);
+    cpdbDeleteTranslations(p);
     
+    free(p);
 }
 
-cpdb_printer_obj_t *cpdbFindPrinterObj(cpdb_frontend_obj_t *f,
-                                       const char *printer_id,
-                                       const char *backend_name)
+void cpdbUnrefPrinterArray(cpdb_printer_obj_t **printers)
 {
-    char *hashtable_key;
-    cpdb_printer_obj_t *p;
+    int i;
 
-    if (printer_id == NULL || backend_name == NULL)
+    if (printers == NULL)
+        return;
+    for (i = 0; printers[i]; i++)
+        cpdbUnrefPrinterObj(printers[i]);
+    g_free(printers);
+}
+
+/* Free the string fields which aren't interned */
+static void cpdbFreePrinterStrings(cpdb_printer_obj_t *p)
+{
+    free(p->id);
+    free(p->name);
+    free(p->info);
+    free(p->location);
+    free(p->make_and_model);
+    p->id = p->name = p->info = NULL;
+    p->location = p->make_and_model = NULL;
+}
+
+void cpdbFillBasicOptions(cpdb_printer_obj_t *p,
+                          GVariant *gv)
+{
+    cpdb_printer_record_t record;
+
+    cpdbGetPrinterRecord(gv, &record);
+    cpdbFillPrinterFromRecord(p, &record);
+}
+
+void cpdbDebugPrinter(const cpdb_printer_obj_t *p)
+{
+    logdebug("-------------------------\n");
+    logdebug("Printer %s\n", p->id);
+    logdebug("name: %s\n", p->name);
+    logdebug("location: %s\n", p->location);
+    logdebug("info: %s\n", p->info);
+    logdebug("make and model: %s\n", p->make_and_model);
+    logdebug("accepting jobs? %s\n", (p->accepting_jobs ? "yes" : "no"));
+    logdebug("state: %s\n", p->state);
+    logdebug("backend: %s\n", p->backend_name);
+    logdebug("-------------------------\n\n");
+}
+
+/* Printers loaded from the catalog can't be queried before
+ * their backend has confirmed them */
+static gboolean cpdbIsPrinterConnected(cpdb_printer_obj_t *p)
+{
+    if (p->backend_proxy == NULL)
     {
-        logwarn("Invalid parameters: cpdbFindPrinterObj()\n");
-        return NULL;
+        logwarn("Printer %s %s isn't connected to its backend yet\n",
+                p->id, p->backend_name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void cpdbSetPrinterCallTimeout(cpdb_printer_obj_t *p,
+                               cpdb_call_t call,
+                               int timeout_msec)
+{
+    if (p == NULL || call < 0 || call >= CPDB_CALL_COUNT)
+    {
+        logwarn("Invalid params: cpdbSetPrinterCallTimeout()\n");
+        return;
     }
+    p->timeouts[call] = timeout_msec;
+}
+
+static GCancellable *cpdbRefPrinterCancellable(cpdb_printer_obj_t *p)
+{
+    GCancellable *cancellable;
+
+    G_LOCK(printer_cancellable);
+    cancellable = g_object_ref(p->cancellable);
+    G_UNLOCK(printer_cancellable);
+    return cancellable;
+}
+
+void cpdbCancelPrinterCalls(cpdb_printer_obj_t *p)
+{
+    GCancellable *cancellable;
 
-    hashtable_key = cpdbConcatSep(printer_id, backend_name);
-    p = g_hash_table_lookup(f->printer, hashtable_key);
     if (p == NULL)
     {
-        logwarn("Couldn't find printer %s %s : Doesn't exist\n",
-                printer_id, backend_name);
+        logwarn("Invalid params: cpdbCancelPrinterCalls()\n");
+        return;
     }
 
-    free(hashtable_key);
-    return p;
+    /* Calls in progress hold a reference on the old cancellable */
+    G_LOCK(printer_cancellable);
+    cancellable = p->cancellable;
+    p->cancellable = g_cancellable_new();
+    G_UNLOCK(printer_cancellable);
+
+    logdebug("Cancelling backend calls for %s %s\n", p->id, p->backend_name);
+    g_cancellable_cancel(cancellable);
+    g_object_unref(cancellable);
 }
 
-cpdb_printer_obj_t *cpdbGetDefaultPrinterForBackend(cpdb_frontend_obj_t *f,
-                                                    const char *backend_name)
+/**
+ * Backend health. Every call to a backend is recorded on its proxy, a
+ * backend which stops answering trips the breaker: calls fail right away
+ * while a thread probes the backend until it answers again.
+ */
+
+static void cpdbFreeHealth(gpointer data)
 {
-    char *def, *service_name;
+    cpdb_health_t *h = data;
+
+    g_mutex_clear(&h->lock);
+    g_cond_clear(&h->cond);
+    free(h);
+}
+
+static cpdb_health_t *cpdbGetHealth(PrintBackend *proxy)
+{
+    cpdb_health_t *h;
+
+    G_LOCK(backend_health);
+    h = g_object_get_data(G_OBJECT(proxy), CPDB_HEALTH_KEY);
+    if (h == NULL)
+    {
+        h = g_new0(cpdb_health_t, 1);
+        g_mutex_init(&h->lock);
+        g_cond_init(&h->cond);
+        h->health.state = CPDB_BACKEND_HEALTHY;
+        g_object_set_data_full(G_OBJECT(proxy), CPDB_HEALTH_KEY, h, cpdbFreeHealth);
+    }
+    G_UNLOCK(backend_health);
+    return h;
+}
+
+static const char *cpdbGetProxyBackendName(PrintBackend *proxy)
+{
+    const char *name = g_dbus_proxy_get_name(G_DBUS_PROXY(proxy));
+
+    if (g_str_has_prefix(name, CPDB_BACKEND_PREFIX))
+        return name + strlen(CPDB_BACKEND_PREFIX);
+    return name;
+}
+
+static gboolean cpdbIsTimeoutError(const GError *error)
+{
+    return g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_NO_REPLY) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_TIMEOUT) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT);
+}
+
+/* Errors of the backend itself, as opposed to errors
+ * returned by an answering backend */
+static gboolean cpdbIsBackendError(const GError *error)
+{
+    return cpdbIsTimeoutError(error) ||
+           g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CLOSED) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_DISCONNECTED) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_SPAWN_FAILED) ||
+           g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_SPAWN_CHILD_EXITED);
+}
+
+static gboolean cpdbIsBackendAvailable(PrintBackend *proxy)
+{
+    gboolean available;
+    cpdb_health_t *h = cpdbGetHealth(proxy);
+
+    g_mutex_lock(&h->lock);
+    available = (h->health.state != CPDB_BACKEND_UNAVAILABLE);
+    g_mutex_unlock(&h->lock);
+    return available;
+}
+
+static GVariant *cpdbSendBackendCallSync(PrintBackend *proxy,
+                                         const char *method,
+                                         GVariant *parameters,
+                                         const GVariantType *reply_type,
+                                         int timeout_msec,
+                                         GCancellable *cancellable,
+                                         GError **error)
+{
+    GDBusProxy *dbus_proxy = G_DBUS_PROXY(proxy);
+
+    return g_dbus_connection_call_sync(g_dbus_proxy_get_connection(dbus_proxy),
+                                       g_dbus_proxy_get_name(dbus_proxy),
+                                       g_dbus_proxy_get_object_path(dbus_proxy),
+                                       g_dbus_proxy_get_interface_name(dbus_proxy),
+                                       method,
+                                       parameters,
+                                       reply_type,
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       timeout_msec,
+                                       cancellable,
+                                       error);
+}
+
+static gpointer cpdbProbeBackend(gpointer user_data)
+{
+    PrintBackend *proxy = user_data;
+    cpdb_health_t *h = cpdbGetHealth(proxy);
+    const char *backend_name = cpdbGetProxyBackendName(proxy);
+    gint64 interval = CPDB_PROBE_INTERVAL_MS, started, end_time;
+    GVariant *reply;
     GError *error = NULL;
-    PrintBackend *proxy;
-    cpdb_printer_obj_t *p = NULL;
-    
-    proxy = g_hash_table_lookup(f->backend, backend_name);
-    if (proxy == NULL)
+
+    g_mutex_lock(&h->lock);
+    while (!h->stopped)
     {
-        logwarn("Couldn't find backend proxy for %s\n", backend_name);
-        service_name = cpdbConcat(CPDB_BACKEND_PREFIX, backend_name);
-        proxy = cpdbCreateBackend(f->connection, service_name);
-        free(service_name);
-        if (proxy == NULL)
+        end_time = g_get_monotonic_time() + interval * G_TIME_SPAN_MILLISECOND;
+        while (!h->stopped)
+            if (!g_cond_wait_until(&h->cond, &h->lock, end_time))
+                break;
+        if (h->stopped)
+            break;
+        g_mutex_unlock(&h->lock);
+
+        logdebug("Probing backend %s\n", backend_name);
+        started = g_get_monotonic_time();
+        reply = cpdbSendBackendCallSync(proxy, "keepAlive", NULL, NULL,
+                                        CPDB_PROBE_TIMEOUT_MS, NULL, &error);
+
+        g_mutex_lock(&h->lock);
+        if (reply)
         {
-            logerror("Error getting default printer for backend : Couldn't get backend proxy\n");
-            return NULL;
+            g_variant_unref(reply);
+            h->health.state = CPDB_BACKEND_HEALTHY;
+            h->health.latency_ms = (g_get_monotonic_time() - started) / 1000.0;
+            h->health.error_rate = 0;
+            h->health.consecutive_timeouts = 0;
+            loginfo("Backend %s is answering again\n", backend_name);
+            break;
+        }
+        logdebug("Backend %s still isn't answering : %s\n", backend_name, error->message);
+        g_clear_error(&error);
+        interval = MIN(interval * 2, CPDB_PROBE_INTERVAL_MAX_MS);
+    }
+    h->probing = FALSE;
+    g_mutex_unlock(&h->lock);
+
+    g_object_unref(proxy);
+    return NULL;
+}
+
+static void cpdbRecordBackendCall(PrintBackend *proxy,
+                                  gint64 started,
+                                  const GError *error)
+{
+    cpdb_health_t *h;
+    cpdb_backend_health_t *health;
+    gboolean failed, timeout, trip = FALSE;
+    double latency;
+
+    if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+    h = cpdbGetHealth(proxy);
+    health = &h->health;
+    timeout = error && cpdbIsTimeoutError(error);
+    failed = error && cpdbIsBackendError(error);
+    latency = (g_get_monotonic_time() - started) / 1000.0;
+
+    g_mutex_lock(&h->lock);
+    health->calls++;
+    if (failed)
+        health->failures++;
+    if (health->calls == 1)
+        health->latency_ms = latency;
+    else
+        health->latency_ms += CPDB_HEALTH_ALPHA * (latency - health->latency_ms);
+    health->error_rate += CPDB_HEALTH_ALPHA * ((failed ? 1.0 : 0.0) - health->error_rate);
+    health->consecutive_timeouts = timeout ? health->consecutive_timeouts + 1 : 0;
+
+    if (health->state != CPDB_BACKEND_UNAVAILABLE)
+    {
+        if (health->consecutive_timeouts >= CPDB_BREAKER_TIMEOUTS ||
+            (health->calls >= CPDB_BREAKER_MIN_CALLS &&
+             health->error_rate >= CPDB_BREAKER_ERROR_RATE))
+        {
+            health->state = CPDB_BACKEND_UNAVAILABLE;
+            trip = !h->probing && !h->stopped;
+            h->probing = h->probing || trip;
+        }
+        else if (health->latency_ms > CPDB_SLOW_BACKEND_MS)
+        {
+            health->state = CPDB_BACKEND_SLOW;
         }
+        else
+        {
+            health->state = CPDB_BACKEND_HEALTHY;
+        }
+    }
+    g_mutex_unlock(&h->lock);
+
+    if (trip)
+    {
+        logwarn("Backend %s isn't answering, probing it in the background\n",
+                cpdbGetProxyBackendName(proxy));
+        g_thread_unref(g_thread_new("cpdb-backend-probe",
+                                    cpdbProbeBackend,
+                                    g_object_ref(proxy)));
+    }
+}
+
+/* The backend is gone, stop probing it */
+static void cpdbStopBackendProbe(PrintBackend *proxy)
+{
+    cpdb_health_t *h = cpdbGetHealth(proxy);
+
+    g_mutex_lock(&h->lock);
+    h->stopped = TRUE;
+    g_cond_broadcast(&h->cond);
+    g_mutex_unlock(&h->lock);
+}
+
+/* Call a backend method with an explicit timeout, instead of the
+ * default one of the proxy used by the generated functions */
+static GVariant *cpdbCallBackendSync(PrintBackend *proxy,
+                                     const char *method,
+                                     GVariant *parameters,
+                                     const GVariantType *reply_type,
+                                     int timeout_msec,
+                                     GCancellable *cancellable,
+                                     GError **error)
+{
+    gint64 started;
+    GVariant *reply;
+    GError *call_error = NULL;
+
+    if (!cpdbIsBackendAvailable(proxy))
+    {
+        if (parameters)
+            g_variant_unref(g_variant_ref_sink(parameters));
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                    "Backend %s isn't answering", cpdbGetProxyBackendName(proxy));
+        return NULL;
+    }
+
+    started = g_get_monotonic_time();
+    reply = cpdbSendBackendCallSync(proxy, method, parameters, reply_type,
+                                    timeout_msec, cancellable, &call_error);
+    cpdbRecordBackendCall(proxy, started, call_error);
+    if (call_error)
+        g_propagate_error(error, call_error);
+    return reply;
+}
+
+static GVariant *cpdbCallPrinterSync(cpdb_printer_obj_t *p,
+                                     cpdb_call_t call,
+                                     const char *method,
+                                     GVariant *parameters,
+                                     const GVariantType *reply_type,
+                                     GError **error)
+{
+    GVariant *reply;
+    GCancellable *cancellable = cpdbRefPrinterCancellable(p);
+
+    reply = cpdbCallBackendSync(p->backend_proxy,
+                                method,
+                                parameters,
+                                reply_type,
+                                p->timeouts[call],
+                                cancellable,
+                                error);
+    g_object_unref(cancellable);
+    return reply;
+}
+
+typedef struct {
+    PrintBackend *proxy;
+    gint64 started;
+    cpdb_call_callback callback;
+    gpointer user_data;
+} cpdb_async_call_t;
+
+static void cpdbOnBackendCallDone(GObject *source,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
+{
+    cpdb_async_call_t *c = user_data;
+    GVariant *reply;
+    GError *error = NULL;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    cpdbRecordBackendCall(c->proxy, c->started, error);
+    c->callback(reply, error, c->user_data);
+
+    if (reply)
+        g_variant_unref(reply);
+    if (error)
+        g_error_free(error);
+    g_object_unref(c->proxy);
+    free(c);
+}
+
+/* Asynchronous cpdbCallBackendSync(), the callback gets the reply
+ * or the error, both owned by the caller */
+static void cpdbCallBackend(PrintBackend *proxy,
+                            const char *method,
+                            GVariant *parameters,
+                            const GVariantType *reply_type,
+                            int timeout_msec,
+                            GCancellable *cancellable,
+                            cpdb_call_callback callback,
+                            gpointer user_data)
+{
+    GDBusProxy *dbus_proxy = G_DBUS_PROXY(proxy);
+    cpdb_async_call_t *c;
+    GError *error = NULL;
+
+    if (!cpdbIsBackendAvailable(proxy))
+    {
+        if (parameters)
+            g_variant_unref(g_variant_ref_sink(parameters));
+        g_set_error(&error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                    "Backend %s isn't answering", cpdbGetProxyBackendName(proxy));
+        callback(NULL, error, user_data);
+        g_error_free(error);
+        return;
+    }
+
+    c = g_new0(cpdb_async_call_t, 1);
+    c->proxy = g_object_ref(proxy);
+    c->started = g_get_monotonic_time();
+    c->callback = callback;
+    c->user_data = user_data;
+
+    g_dbus_connection_call(g_dbus_proxy_get_connection(dbus_proxy),
+                           g_dbus_proxy_get_name(dbus_proxy),
+                           g_dbus_proxy_get_object_path(dbus_proxy),
+                           g_dbus_proxy_get_interface_name(dbus_proxy),
+                           method,
+                           parameters,
+                           reply_type,
+                           G_DBUS_CALL_FLAGS_NONE,
+                           timeout_msec,
+                           cancellable,
+                           cpdbOnBackendCallDone,
+                           c);
+}
+
+static void cpdbCallPrinter(cpdb_printer_obj_t *p,
+                            cpdb_call_t call,
+                            const char *method,
+                            GVariant *parameters,
+                            const GVariantType *reply_type,
+                            cpdb_call_callback callback,
+                            gpointer user_data)
+{
+    GCancellable *cancellable = cpdbRefPrinterCancellable(p);
+
+    cpdbCallBackend(p->backend_proxy,
+                    method,
+                    parameters,
+                    reply_type,
+                    p->timeouts[call],
+                    cancellable,
+                    callback,
+                    user_data);
+    g_object_unref(cancellable);
+}
+
+gboolean cpdbIsAcceptingJobs(cpdb_printer_obj_t *p)
+{
+    GVariant *reply;
+    GError *error = NULL;
+    
+    /* Serve the last known value while the backend isn't answering */
+    if (!cpdbIsPrinterConnected(p) || !cpdbIsBackendAvailable(p->backend_proxy))
+        return p->accepting_jobs;
+
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_STATE,
+                                "isAcceptingJobs",
+                                g_variant_new("(s)", p->id),
+                                G_VARIANT_TYPE("(b)"),
+                                &error);
+    if (error)
+    {
+        logerror("Error getting accepting_jobs status for %s %s : %s\n",
+                    p->id, p->backend_name, error->message);
+        g_error_free(error);
+        return FALSE;
     }
+    g_variant_get(reply, "(b)", &p->accepting_jobs);
+    g_variant_unref(reply);
 
-    print_backend_call_get_default_printer_sync(proxy, &def, NULL, &error);
+    logdebug("Obtained accepting_jobs=%d; for %s %s\n", 
+                p->accepting_jobs, p->id, p->backend_name);
+    return p->accepting_jobs;
+}
+
+char *cpdbGetState(cpdb_printer_obj_t *p)
+{
+    const char *state;
+    GVariant *reply;
+    GError *error = NULL;
+    
+    if (!cpdbIsPrinterConnected(p) || !cpdbIsBackendAvailable(p->backend_proxy))
+        return p->state;
+
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_STATE,
+                                "getPrinterState",
+                                g_variant_new("(s)", p->id),
+                                G_VARIANT_TYPE("(s)"),
+                                &error);
     if (error)
     {
-        logerror("Error getting default printer for backend : %s\n", error->message);
+        logerror("Error getting printer state for %s %s : %s\n",
+                    p->id, p->backend_name, error->message);
+        g_error_free(error);
         return NULL;
     }
-    
-    p = cpdbFindPrinterObj(f, def, backend_name);
-    if (p)
-        logdebug("Obtained default printer %s for backend %s\n", p->id, backend_name);
-    return p;
+    g_variant_get(reply, "(&s)", &state);
+    p->state = (char *) cpdbInternString(state);
+    g_variant_unref(reply);
+
+    logdebug("Obtained state=%s; for %s %s\n", 
+                p->state, p->id, p->backend_name);
+    return p->state;
 }
 
-GList *cpdbLoadDefaultPrinters(const char *path)
+cpdb_options_t *cpdbGetAllOptions(cpdb_printer_obj_t *p)
 {
-    FILE *fp;
-    char buf[CPDB_BSIZE];
-    GList *printers = NULL;
-
-    if ((fp = fopen(path, "r")) == NULL)
+    if (p == NULL) 
     {
-        logwarn("Error loading default printers : Couldn't open %s for reading\n",
-                path);
+        logwarn("Invalid params: cpdbGetAllOptions()\n");
         return NULL;
     }
 
-    while (fgets(buf, sizeof(buf), fp) != NULL)
-    {
-        buf[strcspn(buf, "\r\n")] = 0;
-        printers = g_list_prepend(printers, g_strdup(buf));
-    }
-    printers = g_list_reverse(printers);
-    logdebug("Loaded default printers from %s\n", path);
-
-    fclose(fp);
-    return printers;
-}
+    /** 
+     * If the options were previously queried, 
+     * return them, instead of querying again.
+    */
+    if (cpdbGetPrinterOptions(p))
+        return p->options;
 
-cpdb_printer_obj_t *cpdbGetDefaultPrinter(cpdb_frontend_obj_t *f)
-{   
-    gpointer key, value;
-    GHashTableIter iter;
-    char *conf_dir, *path, *printer_id, *backend_name;
-    cpdb_printer_obj_t *default_printer = NULL;
-    GList *printer, *user_printers, *system_printers, *printers = NULL;
+    GError *error = NULL;
+    GVariant *reply;
+    guint generation;
 
-    if (f->num_printers == 0 || f->num_backends == 0)
-    {
-        logwarn("Couldn't get default printer : No printers found\n");
-        return NULL;
-    }
-    
-    /** Find a default printer from user config first,
-     *  before trying system wide config **/
-    conf_dir = cpdbGetUserConfDir();
-    if (conf_dir)
+    if (cpdbLoadCachedOptions(p, TRUE, &generation))
     {
-        path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
-        printers = g_list_concat(printers, cpdbLoadDefaultPrinters(path));
-        free(path);
-        free(conf_dir);
+        cpdbValidateCachedOptions(p, generation);
+        return p->options;
     }
-    conf_dir = cpdbGetSysConfDir();
-    if (conf_dir)
+    if (!cpdbIsPrinterConnected(p))
+        return NULL;
+
+    /* Asked first, so that a change meanwhile invalidates the cache */
+    generation = cpdbGetCapabilityGeneration(p);
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_OPTIONS,
+                                "GetAllOptions",
+                                g_variant_new("(s)", p->id),
+                                G_VARIANT_TYPE(CPDB_ALL_OPTIONS_REPLY_ARGS),
+                                &error);
+    if (error)
     {
-        path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
-        printers = g_list_concat(printers, cpdbLoadDefaultPrinters(path));
-        free(path);
-        free(conf_dir);
+        logerror("Error getting printer options for %s %s : %s\n",
+                    p->id, p->backend_name, error->message);
+        g_error_free(error);
+        return NULL;
     }
-    
-    for (printer = printers; printer != NULL; printer = printer->next)
-    {
-        printer_id = strtok(printer->data, "#"); 
-        backend_name = strtok(NULL, "\n");
+    cpdbSetPrinterOptions(p, cpdbOptionsFromReply(reply), TRUE);
+    loginfo("Obtained %d options and %d media for %s %s\n",
+            p->options->count, p->options->media_count, p->id, p->backend_name);
+    if (generation)
+        cpdbSaveCachedOptions(p, generation, reply);
+    g_variant_unref(reply);
+    return p->options;
+}
 
-        default_printer = cpdbFindPrinterObj(f, printer_id, backend_name);
-        if (default_printer)
-        {
-            g_list_free_full(printers, free);
-            goto found;
-        }
-    }
-    if (printers)
-        g_list_free_full(printers, free);
+/* Give a printer options unless another thread was faster, in which
+ * case those are kept. Options only go to p->options once their tables
+ * are unpacked, prefetched ones wait in prefetched_options until asked for. */
+static void cpdbSetPrinterOptions(cpdb_printer_obj_t *p,
+                                  cpdb_options_t *options,
+                                  gboolean unpack)
+{
+    cpdb_options_t **dest = unpack ? &p->options : &p->prefetched_options;
 
-    logdebug("Couldn't find a valid default printer from config files\n");
+    if (unpack)
+        cpdbEnsureOptionTables(options);
+    if (!g_atomic_pointer_compare_and_exchange(dest, NULL, options))
+        cpdbUnrefOptions(options);
+}
 
-    /**  Fallback to default CUPS printer if CUPS backend exists **/
-    default_printer = cpdbGetDefaultPrinterForBackend(f, "CUPS");
-    if (default_printer)
-        goto found;
-    logdebug("Couldn't find a valid default CUPS printer\n");
-    
-    /** Fallback to default FILE printer if FILE backend exists **/
-    default_printer = cpdbGetDefaultPrinterForBackend(f, "FILE");
-    if (default_printer)
-        goto found;
-    logdebug("Couldn't find a valid default FILE printer\n");
-    
-    /** Fallback to the default printer of first backend found **/
-    g_hash_table_iter_init(&iter, f->backend);
-    g_hash_table_iter_next(&iter, &key, &value);
+/* Swap fresh options in for outdated ones. Callers may still use the
+ * options they got, and the option structs in them, so those are kept
+ * until the printer goes. */
+static void cpdbReplacePrinterOptions(cpdb_printer_obj_t *p,
+                                      cpdb_options_t *options)
+{
+    cpdb_options_t *old;
 
-    backend_name = (char *) key;
-    default_printer = cpdbGetDefaultPrinterForBackend(f, backend_name);
-    if (default_printer)
-        goto found;
-    logdebug("Couldn't find a valid default %s printer\n", backend_name);
-    
-    /** Fallback to first printer found **/
-    g_hash_table_iter_init(&iter, f->printer);
-    g_hash_table_iter_next(&iter, &key, &value);
-    default_printer = (cpdb_printer_obj_t *) value;
-    if (!default_printer)
+    /* Prefetched options were never handed out */
+    old = g_atomic_pointer_get(&p->prefetched_options);
+    if (old &&
+        g_atomic_pointer_compare_and_exchange(&p->prefetched_options, old, options))
     {
-        logerror("Couldn't find a valid printer\n");
-        return NULL;
+        cpdbUnrefOptions(old);
+        return;
     }
 
-found:
-    logdebug("Found default printer %s %s\n",
-                default_printer->id, default_printer->backend_name);
-    return default_printer;
+    cpdbEnsureOptionTables(options);
+    do
+        old = g_atomic_pointer_get(&p->options);
+    while (!g_atomic_pointer_compare_and_exchange(&p->options, old, options));
+    if (old == NULL)
+        return;
+
+    G_LOCK(printer_retired);
+    p->retired_options = g_slist_prepend(p->retired_options, old);
+    G_UNLOCK(printer_retired);
 }
 
-int cpdbSetDefaultPrinter(const char *path,
-                          cpdb_printer_obj_t *p)
+/* The options of a printer, unpacking prefetched ones, NULL if none */
+static cpdb_options_t *cpdbGetPrinterOptions(cpdb_printer_obj_t *p)
 {
-    FILE *fp;
-    char *printer_data;
-    GList *printer, *next, *printers;
-    
-    printers = cpdbLoadDefaultPrinters(path);
-    printer_data = cpdbConcatSep(p->id, p->backend_name);
-    
-    if ((fp = fopen(path, "w")) == NULL)
-    {
-        logerror("Error setting default printer : Couldn't open %s for writing\n",
-                    path);
-        return 0;
-    }
+    cpdb_options_t *options;
 
-    /* Delete duplicate entries */
-    printer = printers;
-    while (printer != NULL)
-    {
-        next = printer->next;
-        if (strcmp(printer->data, printer_data) == 0)
-        {
-            free(printer->data);
-            printers = g_list_delete_link(printers, printer);
-        }
+    if ((options = g_atomic_pointer_get(&p->options)) != NULL)
+        return options;
 
-        printer = next;
-    }
+    options = g_atomic_pointer_get(&p->prefetched_options);
+    if (options &&
+        g_atomic_pointer_compare_and_exchange(&p->prefetched_options, options, NULL))
+        cpdbSetPrinterOptions(p, options, TRUE);
+    return g_atomic_pointer_get(&p->options);
+}
 
-    printers = g_list_prepend(printers, printer_data);
-    for (printer = printers; printer != NULL; printer = printer->next)
+/* The options keep the reply, their tables are only unpacked
+ * from it when needed */
+static cpdb_options_t *cpdbOptionsFromReply(GVariant *reply)
+{
+    int num_options, num_media;
+    cpdb_options_t *options;
+
+    /* The views point into its data */
+    g_variant_get_data(reply);
+    options = cpdbGetNewOptions();
+    g_variant_get(reply, "(i@a(sssia(s))i@a(siiia(iiii)))",
+                  &num_options, &options->option_variants,
+                  &num_media, &options->media_variants);
+    options->count = g_variant_n_children(options->option_variants);
+    options->media_count = g_variant_n_children(options->media_variants);
+    return options;
+}
+
+static void cpdbEnsureOptionTables(cpdb_options_t *o)
+{
+    if (o->option_variants == NULL || g_atomic_int_get(&o->unpacked))
+        return;
+
+    G_LOCK(option_tables);
+    if (!o->unpacked)
     {
-        fprintf(fp, "%s\n", (char *)printer->data);
+        /* Everything unpacked lives in the arena */
+        o->arena = cpdbNewArena(CPDB_OPTIONS_ARENA_SIZE);
+        cpdbUnpackOptions(o->count, o->option_variants,
+                          o->media_count, o->media_variants, o);
+        g_atomic_int_set(&o->unpacked, TRUE);
     }
-    g_list_free_full(printers, free);
-    loginfo("Saved default printers to %s", path);
-
-    fclose(fp);
-    return 1;
+    G_UNLOCK(option_tables);
 }
 
-int cpdbSetUserDefaultPrinter(cpdb_printer_obj_t *p)
+gboolean cpdbGetOptionView(const cpdb_options_t *o,
+                           int index,
+                           cpdb_option_view_t *view)
 {
-    int ret;
-    char *conf_dir, *path;
+    GVariant *option, *values;
+    int num;
 
-    if ((conf_dir = cpdbGetUserConfDir()) == NULL)
+    if (o == NULL || view == NULL || o->option_variants == NULL ||
+        index < 0 || index >= o->count)
     {
-        logerror("Error setting default printer : Couldn't get system config dir\n");
-        return 0;
+        logwarn("Invalid params: cpdbGetOptionView()\n");
+        return FALSE;
     }
-    path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
-    ret = cpdbSetDefaultPrinter(path, p);
 
-    free(path);
-    free(conf_dir);
-    return ret;
+    option = g_variant_get_child_value(o->option_variants, index);
+    g_variant_get(option, "(&s&s&si@a(s))",
+                  &view->option_name, &view->group_name,
+                  &view->default_value, &num, &values);
+    view->num_supported = g_variant_n_children(values);
+    g_variant_unref(values);
+    g_variant_unref(option);
+    return TRUE;
 }
 
-int cpdbSetSystemDefaultPrinter(cpdb_printer_obj_t *p)
+const char *cpdbGetOptionViewChoice(const cpdb_options_t *o,
+                                    int index,
+                                    int choice)
 {
-    int ret;
-    char *conf_dir, *path;
+    GVariant *option, *values;
+    const char *value = NULL;
 
-    if ((conf_dir = cpdbGetSysConfDir()) == NULL)
+    if (o == NULL || o->option_variants == NULL || index < 0 || index >= o->count)
     {
-        logerror("Error setting default printer : Couldn't get system config dir\n");
-        return 0;
+        logwarn("Invalid params: cpdbGetOptionViewChoice()\n");
+        return NULL;
     }
-    path = cpdbConcatPath(conf_dir, CPDB_DEFAULT_PRINTERS_FILE);
-    ret = cpdbSetDefaultPrinter(path, p);
 
-    free(path);
-    free(conf_dir);
-    return ret;
+    option = g_variant_get_child_value(o->option_variants, index);
+    values = g_variant_get_child_value(option, 4);
+    if (choice >= 0 && choice < (int) g_variant_n_children(values))
+        g_variant_get_child(values, choice, "(&s)", &value);
+    g_variant_unref(values);
+    g_variant_unref(option);
+    return value;
 }
-/**
-________________________________________________ cpdb_printer_obj_t __________________________________________
-**/
 
-cpdb_printer_obj_t *cpdbGetNewPrinterObj()
+gboolean cpdbGetMediaView(const cpdb_options_t *o,
+                          int index,
+                          cpdb_media_view_t *view)
 {
-    cpdb_printer_obj_t *p = g_new0 (cpdb_printer_obj_t, 1);
-    p->options = NULL;
-    p->settings = cpdbGetNewSettings();
-    return p;
-}
+    GVariant *media, *margins;
+    int num;
 
-static void cpdbDeleteTranslations(cpdb_printer_obj_t *p)
-{
-    g_free(p->locale);
-    if (p->translations)
-        g_hash_table_destroy(p->translations);
+    if (o == NULL || view == NULL || o->media_variants == NULL ||
+        index < 0 || index >= o->media_count)
+    {
+        logwarn("Invalid params: cpdbGetMediaView()\n");
+        return FALSE;
+    }
 
-    p->locale = NULL;
-    p->translations = NULL;
+    media = g_variant_get_child_value(o->media_variants, index);
+    g_variant_get(media, "(&siii@a(iiii))",
+                  &view->name, &view->width, &view->length, &num, &margins);
+    view->num_margins = g_variant_n_children(margins);
+    g_variant_unref(margins);
+    g_variant_unref(media);
+    return TRUE;
 }
 
-void cpdbDeletePrinterObj(cpdb_printer_obj_t *p)
+gboolean cpdbGetMediaViewMargin(const cpdb_options_t *o,
+                                int index,
+                                int margin,
+                                cpdb_margin_t *out)
 {
-    if (p == NULL)
-        return;
-    
-    logdebug("Deleting printer object %s\n", p->id);
-    if (p->backend_name)
-        free(p->backend_name);
-    if (p->backend_proxy)
-        g_object_unref(p->backend_proxy);
-    if (p->options)
-        cpdbDeleteOptions(p->options);
-    if (p->settings)
-        cpdbDeleteSettings(p->settings);
-    cpdbDeleteTranslations(p);
-    
-    free(p);
+    GVariant *media, *margins;
+    gboolean found = FALSE;
+
+    if (o == NULL || out == NULL || o->media_variants == NULL ||
+        index < 0 || index >= o->media_count)
+    {
+        logwarn("Invalid params: cpdbGetMediaViewMargin()\n");
+        return FALSE;
+    }
+
+    media = g_variant_get_child_value(o->media_variants, index);
+    margins = g_variant_get_child_value(media, 4);
+    if (margin >= 0 && margin < (int) g_variant_n_children(margins))
+    {
+        g_variant_get_child(margins, margin, "(iiii)",
+                            &out->left, &out->right, &out->top, &out->bottom);
+        found = TRUE;
+    }
+    g_variant_unref(margins);
+    g_variant_unref(media);
+    return found;
 }
 
-void cpdbFillBasicOptions(cpdb_printer_obj_t *p,
-                          GVariant *gv)
+const cpdb_option_group_t *cpdbGetOptionGroup(const cpdb_options_t *o,
+                                              const char *group_name)
 {
-    g_variant_get(gv, CPDB_PRINTER_ADDED_ARGS,
-                  &(p->id),
-                  &(p->name),
-                  &(p->info),
-                  &(p->location),
-                  &(p->make_and_model),
-                  &(p->accepting_jobs),
-                  &(p->state),
-                  &(p->backend_name));
+    int i;
+
+    if (o == NULL || group_name == NULL)
+    {
+        logwarn("Invalid params: cpdbGetOptionGroup()\n");
+        return NULL;
+    }
+
+    for (i = 0; i < o->group_count; i++)
+    {
+        if (g_strcmp0(o->groups[i].name, group_name) == 0)
+            return &o->groups[i];
+    }
+    return NULL;
 }
 
-void cpdbDebugPrinter(const cpdb_printer_obj_t *p)
+/* One file per printer, named after a hash of its backend and id */
+static char *cpdbGetOptionsCachePath(const cpdb_printer_obj_t *p)
 {
-    logdebug("-------------------------\n");
-    logdebug("Printer %s\n", p->id);
-    logdebug("name: %s\n", p->name);
-    logdebug("location: %s\n", p->location);
-    logdebug("info: %s\n", p->info);
-    logdebug("make and model: %s\n", p->make_and_model);
-    logdebug("accepting jobs? %s\n", (p->accepting_jobs ? "yes" : "no"));
-    logdebug("state: %s\n", p->state);
-    logdebug("backend: %s\n", p->backend_name);
-    logdebug("-------------------------\n\n");
+    char *conf_dir, *dir, *key, *name, *path;
+
+    if ((conf_dir = cpdbGetUserConfDir()) == NULL)
+        return NULL;
+    dir = cpdbConcatPath(conf_dir, CPDB_OPTIONS_CACHE_DIR);
+    free(conf_dir);
+
+    key = cpdbConcatSep(p->backend_name, p->id);
+    name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    path = cpdbConcatPath(dir, name);
+    free(key);
+    g_free(name);
+    free(dir);
+    return path;
 }
 
-gboolean cpdbIsAcceptingJobs(cpdb_printer_obj_t *p)
+/* Use the cached options of the printer if they are for the same
+ * model, whether they are current is up to the backend */
+static gboolean cpdbLoadCachedOptions(cpdb_printer_obj_t *p,
+                                      gboolean unpack,
+                                      guint *generation)
 {
-    GError *error = NULL;
-    
-    print_backend_call_is_accepting_jobs_sync(p->backend_proxy,
-                                              p->id,
-                                              &p->accepting_jobs,
-                                              NULL,
-                                              &error);
-    if (error)
+    gsize length;
+    guint32 version;
+    const char *backend_name, *id, *make_and_model;
+    char *path, *contents;
+    GVariant *cache, *reply;
+    cpdb_options_t *options;
+    gboolean found = FALSE;
+
+    if ((path = cpdbGetOptionsCachePath(p)) == NULL)
+        return FALSE;
+    if (!g_file_get_contents(path, &contents, &length, NULL))
     {
-        logerror("Error getting accepting_jobs status for %s %s : %s\n",
-                    p->id, p->backend_name, error->message);
+        free(path);
         return FALSE;
     }
 
-    logdebug("Obtained accepting_jobs=%d; for %s %s\n", 
-                p->accepting_jobs, p->id, p->backend_name);
-    return p->accepting_jobs;
+    /* Not trusted, a corrupted file reads as empty values */
+    cache = g_variant_new_from_data(G_VARIANT_TYPE(CPDB_OPTIONS_CACHE_ARGS),
+                                    contents, length, FALSE,
+                                    g_free, contents);
+    g_variant_ref_sink(cache);
+    g_variant_get(cache, "(u&s&s&su@" CPDB_ALL_OPTIONS_REPLY_ARGS ")",
+                  &version, &backend_name, &id, &make_and_model,
+                  generation, &reply);
+    if (version == CPDB_OPTIONS_CACHE_VERSION && *generation != 0 &&
+        g_strcmp0(backend_name, p->backend_name) == 0 &&
+        g_strcmp0(id, p->id) == 0 &&
+        g_strcmp0(make_and_model, p->make_and_model ? p->make_and_model : "") == 0)
+    {
+        options = cpdbOptionsFromReply(reply);
+        loginfo("Loaded %d options and %d media for %s %s from cache\n",
+                options->count, options->media_count, p->id, p->backend_name);
+        cpdbSetPrinterOptions(p, options, unpack);
+        found = TRUE;
+    }
+    else
+    {
+        logdebug("Ignoring outdated options cache %s\n", path);
+    }
+
+    g_variant_unref(reply);
+    g_variant_unref(cache);
+    free(path);
+    return found;
 }
 
-char *cpdbGetState(cpdb_printer_obj_t *p)
+static void cpdbSaveCachedOptions(const cpdb_printer_obj_t *p,
+                                  guint generation,
+                                  GVariant *reply)
 {
+    char *path, *dir;
+    GVariant *cache;
     GError *error = NULL;
-    
-    print_backend_call_get_printer_state_sync(p->backend_proxy,
-                                              p->id,
-                                              &p->state,
-                                              NULL,
-                                              &error);
-    if (error)
+
+    if ((path = cpdbGetOptionsCachePath(p)) == NULL)
+        return;
+    dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, CPDB_USRCONFDIR_PERM) != 0)
     {
-        logerror("Error getting printer state for %s %s : %s\n",
-                    p->id, p->backend_name, error->message);
-        return NULL;
+        logwarn("Couldn't create options cache dir %s\n", dir);
+        g_free(dir);
+        free(path);
+        return;
+    }
+    g_free(dir);
+
+    cache = g_variant_ref_sink(g_variant_new("(usssu@" CPDB_ALL_OPTIONS_REPLY_ARGS ")",
+                                             CPDB_OPTIONS_CACHE_VERSION,
+                                             p->backend_name,
+                                             p->id,
+                                             p->make_and_model ? p->make_and_model : "",
+                                             generation,
+                                             reply));
+    if (!g_file_set_contents(path,
+                             g_variant_get_data(cache),
+                             g_variant_get_size(cache),
+                             &error))
+    {
+        logerror("Error saving options cache to %s : %s\n", path, error->message);
+        g_error_free(error);
+    }
+    else
+    {
+        logdebug("Cached options of %s %s, generation %u\n", p->id, p->backend_name, generation);
     }
 
-    logdebug("Obtained state=%s; for %s %s\n", 
-                p->state, p->id, p->backend_name);
-    return p->state;
+    g_variant_unref(cache);
+    free(path);
 }
 
-cpdb_options_t *cpdbGetAllOptions(cpdb_printer_obj_t *p)
+/* Generation of the options of the printer, 0 if the backend
+ * doesn't tell, in which case they aren't cached */
+static guint cpdbGetCapabilityGeneration(cpdb_printer_obj_t *p)
 {
-    if (p == NULL) 
+    GVariant *reply;
+    GError *error = NULL;
+    guint generation = 0;
+
+    if (g_object_get_data(G_OBJECT(p->backend_proxy), CPDB_NO_GENERATION_KEY) != NULL)
+        return 0;
+
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_CONTROL,
+                                "GetCapabilityGeneration",
+                                g_variant_new("(s)", p->id),
+                                G_VARIANT_TYPE("(u)"),
+                                &error);
+    if (reply)
     {
-        logwarn("Invalid params: cpdbGetAllOptions()\n");
-        return NULL;
+        g_variant_get(reply, "(u)", &generation);
+        g_variant_unref(reply);
     }
+    cpdbCheckCapabilityGeneration(p, generation, error);
+    g_clear_error(&error);
+    return generation;
+}
 
-    /** 
-     * If the options were previously queried, 
-     * return them, instead of querying again.
-    */
-    if (p->options)
-        return p->options;
-
-    GError *error = NULL;
-    int num_options, num_media;
-    GVariant *var, *media_var;
-    print_backend_call_get_all_options_sync(p->backend_proxy,
-                                            p->id,
-                                            &num_options,
-                                            &var,
-                                            &num_media,
-                                            &media_var,
-                                            NULL,
-                                            &error);
-    if (error)
+/* A backend which doesn't know the call, or answers 0 as it doesn't
+ * keep track, isn't asked again for any of its printers */
+static void cpdbCheckCapabilityGeneration(cpdb_printer_obj_t *p,
+                                          guint generation,
+                                          const GError *error)
+{
+    if (error && !g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
     {
-        logerror("Error getting printer options for %s %s : %s\n",
-                    p->id, p->backend_name, error->message);
-        return NULL;
+        logwarn("Error getting capability generation of %s %s : %s\n",
+                p->id, p->backend_name, error->message);
+        return;
     }
+    if (generation != 0)
+        return;
 
-    loginfo("Obtained %d options and %d media for %s %s\n",
-            num_options, num_media, p->id, p->backend_name);
-    p->options = cpdbGetNewOptions();
-    cpdbUnpackOptions(num_options, var, num_media, media_var, p->options);
-    return p->options;
+    logdebug("Backend %s doesn't tell capability generations\n", p->backend_name);
+    g_object_set_data(G_OBJECT(p->backend_proxy), CPDB_NO_GENERATION_KEY,
+                      GINT_TO_POINTER(TRUE));
 }
 
 cpdb_option_t *cpdbGetOption(cpdb_printer_obj_t *p,
@@ -1071,7 +5070,8 @@ cpdb_option_t *cpdbGetOption(cpdb_printer_obj_t *p,
         logwarn("Invalid params: cpdbGetOption()\n");
         return NULL;
     }
-    cpdbGetAllOptions(p);
+    if (cpdbGetAllOptions(p) == NULL)
+        return NULL;
     return (cpdb_option_t *)(g_hash_table_lookup(p->options->table, name));
 }
 
@@ -1210,23 +5210,31 @@ int cpdbPrintFD(cpdb_printer_obj_t *p,
 char *cpdbPrintSocket(cpdb_printer_obj_t *p, char **jobid, const char *title)
 {
     char *socket;
+    GVariant *reply;
     GError *error = NULL;   
+
+    if (!cpdbIsPrinterConnected(p))
+        return NULL;
     cpdbDebugPrintSettings(p->settings);
-    print_backend_call_print_socket_sync(p->backend_proxy,
-                                       p->id,
-                                       p->settings->count,
-                                       cpdbSerializeToGVariant(p->settings),
-                                       title,
-                                       jobid,
-                                       &socket,
-                                       NULL,
-                                       &error);
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_PRINT,
+                                "printSocket",
+                                g_variant_new("(si@a(ss)s)",
+                                              p->id,
+                                              p->settings->count,
+                                              cpdbSerializeToGVariant(p->settings),
+                                              title),
+                                G_VARIANT_TYPE("(ss)"),
+                                &error);
                                        
     if (error) {
         logerror("Error opening socket on %s %s : %s\n", 
                     p->id, p->backend_name, error->message);
+        g_error_free(error);
         return NULL;
     }
+    g_variant_get(reply, "(ss)", jobid, &socket);
+    g_variant_unref(reply);
     
     if (*jobid == NULL || **jobid == '\0') {
         logerror("Error while trying to create a job on %s %s: Couldn't create a job\n", 
@@ -1256,7 +5264,7 @@ void cpdbAddSettingToPrinter(cpdb_printer_obj_t *p,
         return;
     }
 
-    cpdbAddSetting(p->settings, name, val);
+    cpdbAddSetting(cpdbGetOwnSettings(p), name, val);
 }
 
 gboolean cpdbClearSettingFromPrinter(cpdb_printer_obj_t *p,
@@ -1267,7 +5275,9 @@ gboolean cpdbClearSettingFromPrinter(cpdb_printer_obj_t *p,
         logwarn("Invalid params: cpdbClearSettingFromPrinter()\n");
         return FALSE;
     }
-    return cpdbClearSetting(p->settings, name);
+    if (!g_hash_table_contains(p->settings->table, name))
+        return FALSE;
+    return cpdbClearSetting(cpdbGetOwnSettings(p), name);
 }
 
 void cpdbPicklePrinterToFile(cpdb_printer_obj_t *p,
@@ -1279,15 +5289,25 @@ void cpdbPicklePrinterToFile(cpdb_printer_obj_t *p,
     const char *unique_bus_name;
     GHashTableIter iter;
     gpointer key, value;
+    GVariant *reply;
     GError *error = NULL;
 	
-    print_backend_call_keep_alive_sync(p->backend_proxy, NULL, &error);
+    if (!cpdbIsPrinterConnected(p))
+        return;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_CONTROL,
+                                "keepAlive",
+                                NULL,
+                                NULL,
+                                &error);
     if (error)
     {
         logerror("Error keeping backend %s alive : %s\n",
                     p->backend_name, error->message);
+        g_error_free(error);
         return;
     }
+    g_variant_unref(reply);
     loginfo("Keeping backend %s alive\n", p->backend_name);
     
     path = cpdbGetAbsolutePath(filename);
@@ -1340,6 +5360,7 @@ cpdb_printer_obj_t *cpdbResurrectPrinterFromFile(const char *filename)
     GDBusConnection *connection;
     char *name, *value, *path = NULL;
     char *service_name = NULL, *previous_parent_dialog = NULL;
+    GVariant *reply;
     GError *error = NULL;
     cpdb_printer_obj_t *p;
 
@@ -1359,7 +5380,7 @@ cpdb_printer_obj_t *cpdbResurrectPrinterFromFile(const char *filename)
 
     if (fgets(buf, sizeof(buf), fp) == NULL)
         goto parse_error;
-    p->backend_name = g_strdup(strtok(buf, "#"));
+    p->backend_name = (char *) cpdbInternString(strtok(buf, "#"));
     
     service_name = cpdbConcat(CPDB_BACKEND_PREFIX, p->backend_name);
     if ((connection = cpdbGetDbusConnection()) == NULL)
@@ -1369,17 +5390,25 @@ cpdb_printer_obj_t *cpdbResurrectPrinterFromFile(const char *filename)
     }
     p->backend_proxy = cpdbCreateBackend(connection,
                                          service_name);
+    g_object_unref(connection);     /* The proxy keeps its own reference */
     free(service_name);
-    print_backend_call_replace_sync(p->backend_proxy, 
-                                    previous_parent_dialog, 
-                                    NULL, 
-                                    &error);
+    service_name = NULL;
+    if (p->backend_proxy == NULL)
+        goto failed;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_CONTROL,
+                                "replace",
+                                g_variant_new("(s)", previous_parent_dialog),
+                                NULL,
+                                &error);
     if (error)
     {
         logerror("Error replacing resurrected printer : %s\n",
                     error->message); 
+        g_error_free(error);
         goto failed;
     }
+    g_variant_unref(reply);
 
     if (fgets(buf, sizeof(buf), fp) == NULL)
         goto parse_error;
@@ -1403,7 +5432,7 @@ cpdb_printer_obj_t *cpdbResurrectPrinterFromFile(const char *filename)
 
     if (fgets(buf, sizeof(buf), fp) == NULL)
         goto parse_error;
-    p->state = g_strdup(strtok(buf, "#"));
+    p->state = (char *) cpdbInternString(strtok(buf, "#"));
 
     if (fscanf(fp, "%d\n", &p->accepting_jobs) == 0)
         goto parse_error;
@@ -1448,6 +5477,7 @@ char *cpdbGetOptionTranslation(cpdb_printer_obj_t *p,
                                const char *locale)
 {
     char *name_key, *translation;
+    GVariant *reply;
     GError *error = NULL;
 
     if (p == NULL || option_name == NULL || locale == NULL)
@@ -1469,24 +5499,28 @@ char *cpdbGetOptionTranslation(cpdb_printer_obj_t *p,
         }
     }
 
-    print_backend_call_get_option_translation_sync(p->backend_proxy,
-                                                   p->id,
-                                                   option_name,
-                                                   locale,
-                                                   &translation,
-                                                   NULL,
-                                                   &error);
+    if (!cpdbIsPrinterConnected(p))
+        return NULL;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_TRANSLATIONS,
+                                "getOptionTranslation",
+                                g_variant_new("(sss)", p->id, option_name, locale),
+                                G_VARIANT_TYPE("(s)"),
+                                &error);
     if (error)
     {
         logerror("Error getting translation for option=%s;locale=%s;printer=%s#%s; : %s\n",
                     option_name, locale,
                     p->id, p->backend_name, error->message);
+        g_error_free(error);
         return NULL;
     }
+    g_variant_get(reply, "(s)", &translation);
+    g_variant_unref(reply);
     
     logdebug("Obtained translation=%s; for option=%s;locale=%s;printer=%s#%s;\n",
                 translation, option_name, locale, p->id, p->backend_name);
-    return g_strdup(translation);
+    return translation;
 }
 
 char *cpdbGetChoiceTranslation(cpdb_printer_obj_t *p,
@@ -1495,6 +5529,7 @@ char *cpdbGetChoiceTranslation(cpdb_printer_obj_t *p,
                                const char *locale)
 {
     char *name_key, *choice_key, *translation;
+    GVariant *reply;
     GError *error = NULL;
 
     if (p == NULL || option_name == NULL || choice_name == NULL || locale == NULL)
@@ -1519,26 +5554,30 @@ char *cpdbGetChoiceTranslation(cpdb_printer_obj_t *p,
         }
     }
     
-    print_backend_call_get_choice_translation_sync(p->backend_proxy,
-                                                   p->id,
-                                                   option_name,
-                                                   choice_name,
-                                                   locale,
-                                                   &translation,
-                                                   NULL,
-                                                   &error);
+    if (!cpdbIsPrinterConnected(p))
+        return NULL;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_TRANSLATIONS,
+                                "getChoiceTranslation",
+                                g_variant_new("(ssss)", p->id, option_name,
+                                              choice_name, locale),
+                                G_VARIANT_TYPE("(s)"),
+                                &error);
     if (error)
     {
         logerror("Error getting translation for option=%s;choice=%s;locale=%s;printer=%s#%s; : %s\n",
                     option_name, choice_name, locale,
                     p->id, p->backend_name, error->message);
+        g_error_free(error);
         return NULL;
     }
+    g_variant_get(reply, "(s)", &translation);
+    g_variant_unref(reply);
     
     logdebug("Obtained translation=%s; for option=%s;choice=%s;locale=%s;printer=%s#%s;\n",
                 translation, option_name, choice_name, locale, 
                 p->id, p->backend_name);
-    return g_strdup(translation);
+    return translation;
 }
 
 
@@ -1547,6 +5586,7 @@ char *cpdbGetGroupTranslation(cpdb_printer_obj_t *p,
                               const char *locale)
 {
     char *group_key, *translation;
+    GVariant *reply;
     GError *error = NULL;
 
     if (p == NULL || group_name == NULL || locale == NULL)
@@ -1568,31 +5608,35 @@ char *cpdbGetGroupTranslation(cpdb_printer_obj_t *p,
         }
     }
     
-    print_backend_call_get_group_translation_sync(p->backend_proxy,
-                                                  p->id,
-                                                  group_name,
-                                                  locale,
-                                                  &translation,
-                                                  NULL,
-                                                  &error);
+    if (!cpdbIsPrinterConnected(p))
+        return NULL;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_TRANSLATIONS,
+                                "getGroupTranslation",
+                                g_variant_new("(sss)", p->id, group_name, locale),
+                                G_VARIANT_TYPE("(s)"),
+                                &error);
 
     if (error)
     {
         logerror("Error getting translation for group=%s;locale=%s;printer=%s#%s; : %s\n",
                     group_name, locale,
                     p->id, p->backend_name, error->message);
+        g_error_free(error);
         return NULL;
     }
+    g_variant_get(reply, "(s)", &translation);
+    g_variant_unref(reply);
     
     logdebug("Obtained translation=%s; for group=%s;locale=%s;printer=%s#%s;\n",
                 translation, group_name, locale, p->id, p->backend_name);
-    return g_strdup(translation);
+    return translation;
 }
 
 void cpdbGetAllTranslations(cpdb_printer_obj_t *p,
                             const char *locale)
 {
-    GVariant *translations;
+    GVariant *reply, *translations;
     GError *error = NULL;
 
     if (p == NULL || locale == NULL)
@@ -1604,29 +5648,37 @@ void cpdbGetAllTranslations(cpdb_printer_obj_t *p,
     if (p->locale != NULL && strcmp(p->locale, locale) == 0)
         return;
 
-    print_backend_call_get_all_translations_sync(p->backend_proxy,
-                                                 p->id,
-                                                 locale,
-                                                 &translations,
-                                                 NULL,
-                                                 &error);
+    if (!cpdbIsPrinterConnected(p))
+        return;
+    reply = cpdbCallPrinterSync(p,
+                                CPDB_CALL_TRANSLATIONS,
+                                "GetAllTranslations",
+                                g_variant_new("(ss)", p->id, locale),
+                                G_VARIANT_TYPE("(a{ss})"),
+                                &error);
     if (error)
     {
         logerror("Error getting printer translations in %s for %s %s : %s\n",
                     locale, p->id, p->backend_name, error->message);
+        g_error_free(error);
         return;
     }
     logdebug("Fetched translations for printer %s %s\n", p->id, p->backend_name);
 
+    translations = g_variant_get_child_value(reply, 0);
     cpdbDeleteTranslations(p);
     p->locale = g_strdup(locale);
-    p->translations = cpdbUnpackTranslations(translations);
+    p->translations_arena = cpdbNewArena(CPDB_TRANSLATIONS_ARENA_SIZE);
+    p->translations = cpdbUnpackTranslations(translations, p->translations_arena);
+    g_variant_unref(translations);
+    g_variant_unref(reply);
 }
 
 cpdb_media_t *cpdbGetMedia(cpdb_printer_obj_t *p,
                            const char *media)
 {
-    cpdbGetAllOptions(p);
+    if (cpdbGetAllOptions(p) == NULL)
+        return NULL;
     return (cpdb_media_t *) g_hash_table_lookup(p->options->media, media);
 }
 
@@ -1665,11 +5717,18 @@ int cpdbGetMediaMargins(cpdb_printer_obj_t *p,
 typedef struct {
     cpdb_printer_obj_t *p;
     cpdb_async_callback caller_cb;
+    cpdb_async_callback cancelled_cb; /** Instead of caller_cb if cancelled, for cleaning up */
     void *user_data;
+    guint generation;           /** Asked before the options, 0 if unknown */
+    guint cached_generation;    /** Of the cached options being validated */
+    gboolean replace;           /** Only refresh the cached options */
+    gboolean unpack;            /** Unpack the option tables for the caller */
 } cpdb_async_details_obj_t;
 
-void acquire_details_cb(PrintBackend *proxy,
-                        GAsyncResult *res,
+static void cpdbRequestDetails(cpdb_async_details_obj_t *a);
+
+void acquire_details_cb(GVariant *reply,
+                        const GError *error,
                         gpointer user_data)
 {
     cpdb_async_details_obj_t *a = user_data;
@@ -1677,37 +5736,139 @@ void acquire_details_cb(PrintBackend *proxy,
     cpdb_printer_obj_t *p = a->p;
     cpdb_async_callback caller_cb = a->caller_cb;
     
-    p->options = cpdbGetNewOptions();
-    GError *error = NULL;
-    int num_options, num_media;
-    GVariant *var, *media_var;
+    cpdb_options_t *options;
     
-    print_backend_call_get_all_options_finish (proxy,
-                                               &num_options,
-                                               &var,
-                                               &num_media,
-                                               &media_var,
-                                               res,
-                                               &error);
-    if (error)
+    if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        /* Cancelled on purpose, e.g. by deleting the frontend instance,
+         * the caller may be gone along with its user data */
+        logdebug("Cancelled acquiring printer details for %s %s\n",
+                 p->id, p->backend_name);
+        if (a->cancelled_cb)
+            a->cancelled_cb(p, FALSE, a->user_data);
+    }
+    else if (error)
     {
         logerror("Error acquiring printer details for %s %s : %s\n",
                     p->id, p->backend_name, error->message);
         if (caller_cb)
             caller_cb(p, FALSE, a->user_data);
     }
+    else if (a->replace)
+    {
+        loginfo("Cached options of %s %s are outdated, replacing them\n",
+                p->id, p->backend_name);
+        if (a->generation)
+            cpdbSaveCachedOptions(p, a->generation, reply);
+        cpdbReplacePrinterOptions(p, cpdbOptionsFromReply(reply));
+    }
     else
     {
+        options = cpdbOptionsFromReply(reply);
         loginfo("Acquired %d options and %d media for %s %s\n",
-                num_options, num_media, p->id, p->backend_name);
-        cpdbUnpackOptions(num_options, var, num_media, media_var, p->options);
+                options->count, options->media_count, p->id, p->backend_name);
+        if (a->generation)
+            cpdbSaveCachedOptions(p, a->generation, reply);
+        /* Another request may have been faster */
+        cpdbSetPrinterOptions(p, options, a->unpack);
         if (caller_cb)
             caller_cb(p, TRUE, a->user_data);
     }
     
+    cpdbUnrefPrinterObj(p);
     free(a);
 }
 
+static void acquire_generation_cb(GVariant *reply,
+                                  const GError *error,
+                                  gpointer user_data)
+{
+    cpdb_async_details_obj_t *a = user_data;
+    cpdb_printer_obj_t *p = a->p;
+
+    if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        logdebug("Cancelled acquiring printer details for %s %s\n",
+                 p->id, p->backend_name);
+        if (a->cancelled_cb)
+            a->cancelled_cb(p, FALSE, a->user_data);
+        cpdbUnrefPrinterObj(p);
+        free(a);
+        return;
+    }
+    if (reply)
+        g_variant_get(reply, "(u)", &a->generation);
+    /* Neither is set if the backend is known not to tell and wasn't asked */
+    if (reply || error)
+        cpdbCheckCapabilityGeneration(p, a->generation, error);
+
+    /* Validating cached options, which are still current */
+    if (a->replace && a->generation == a->cached_generation)
+    {
+        logdebug("Cached options of %s %s are current\n", p->id, p->backend_name);
+        cpdbUnrefPrinterObj(p);
+        free(a);
+        return;
+    }
+    if (a->replace && a->generation == 0)
+    {
+        /* Can't tell anymore, keep what we have for this session */
+        cpdbUnrefPrinterObj(p);
+        free(a);
+        return;
+    }
+
+    logdebug("Acquiring printer details for %s %s\n", p->id, p->backend_name);
+    cpdbCallPrinter(p,
+                    CPDB_CALL_OPTIONS,
+                    "GetAllOptions",
+                    g_variant_new("(s)", p->id),
+                    G_VARIANT_TYPE(CPDB_ALL_OPTIONS_REPLY_ARGS),
+                    acquire_details_cb,
+                    a);
+}
+
+/* Ask for the capability generation first if the backend tells it,
+ * then for the options */
+static void cpdbRequestDetails(cpdb_async_details_obj_t *a)
+{
+    cpdb_printer_obj_t *p = a->p;
+
+    if (g_object_get_data(G_OBJECT(p->backend_proxy), CPDB_NO_GENERATION_KEY) != NULL)
+    {
+        acquire_generation_cb(NULL, NULL, a);
+        return;
+    }
+    cpdbCallPrinter(p,
+                    CPDB_CALL_CONTROL,
+                    "GetCapabilityGeneration",
+                    g_variant_new("(s)", p->id),
+                    G_VARIANT_TYPE("(u)"),
+                    acquire_generation_cb,
+                    a);
+}
+
+/* Check in the background whether cached options are still current,
+ * the cache gets the new ones if they aren't */
+static void cpdbValidateCachedOptions(cpdb_printer_obj_t *p,
+                                      guint generation)
+{
+    cpdb_async_details_obj_t *a;
+
+    if (p->backend_proxy == NULL)
+    {
+        logdebug("Not validating cached options of %s %s : Not connected yet\n",
+                 p->id, p->backend_name);
+        return;
+    }
+
+    a = g_new0(cpdb_async_details_obj_t, 1);
+    a->p = cpdbRefPrinterObj(p);
+    a->cached_generation = generation;
+    a->replace = TRUE;
+    cpdbRequestDetails(a);
+}
+
 void cpdbAcquireDetails(cpdb_printer_obj_t *p,
                         cpdb_async_callback caller_cb,
                         void *user_data)
@@ -1718,24 +5879,194 @@ void cpdbAcquireDetails(cpdb_printer_obj_t *p,
         return;
     }
 
-    if (p->options)
+    cpdbFetchDetails(p, caller_cb, NULL, user_data, TRUE);
+}
+
+/* Prefetching leaves the option tables packed until someone looks */
+static void cpdbFetchDetails(cpdb_printer_obj_t *p,
+                             cpdb_async_callback caller_cb,
+                             cpdb_async_callback cancelled_cb,
+                             void *user_data,
+                             gboolean unpack)
+{
+    cpdb_async_details_obj_t *a;
+    guint generation;
+
+    if (g_atomic_pointer_get(&p->options) == NULL &&
+        g_atomic_pointer_get(&p->prefetched_options) == NULL &&
+        cpdbLoadCachedOptions(p, unpack, &generation))
+        cpdbValidateCachedOptions(p, generation);
+    if (unpack ? cpdbGetPrinterOptions(p) != NULL :
+                 g_atomic_pointer_get(&p->options) != NULL ||
+                 g_atomic_pointer_get(&p->prefetched_options) != NULL)
     {
         if (caller_cb)
             caller_cb(p, TRUE, user_data);
         return;
     }
     
-    cpdb_async_details_obj_t *a = g_new0(cpdb_async_details_obj_t, 1);
-    a->p = p;
+    if (!cpdbIsPrinterConnected(p))
+    {
+        if (caller_cb)
+            caller_cb(p, FALSE, user_data);
+        return;
+    }
+
+    a = g_new0(cpdb_async_details_obj_t, 1);
+    a->p = cpdbRefPrinterObj(p);
     a->caller_cb = caller_cb;
+    a->cancelled_cb = cancelled_cb;
     a->user_data = user_data;
-    
-    logdebug("Acquiring printer details for %s %s\n", p->id, p->backend_name);
-    print_backend_call_get_all_options(p->backend_proxy,
-                                       p->id, 
-                                       NULL,
-                                       (GAsyncReadyCallback) acquire_details_cb,
-                                       a);
+    a->unpack = unpack;
+    cpdbRequestDetails(a);
+}
+
+/* Printers of one backend waiting for their turn */
+typedef struct {
+    GQueue pending;
+    int in_flight;
+} cpdb_prefetch_backend_t;
+
+typedef struct {
+    GHashTable *backends;           /** [interned backend name] --> cpdb_prefetch_backend_t */
+    int max_per_backend;
+    int num_printers;
+    int failed;
+    gboolean cancelled;             /** The caller may be gone, don't call back anymore */
+    int ref_count;                  /** Held while starting calls, which may finish right away */
+    cpdb_async_callback printer_cb;
+    cpdb_prefetch_callback done_cb;
+    void *user_data;
+} cpdb_prefetch_t;
+
+static void cpdbPumpPrefetch(cpdb_prefetch_t *pf, const char *backend_name);
+
+static void cpdbFreePrefetchBackend(gpointer data)
+{
+    cpdb_prefetch_backend_t *b = data;
+
+    g_queue_clear_full(&b->pending, (GDestroyNotify) cpdbUnrefPrinterObj);
+    g_free(b);
+}
+
+static void cpdbUnrefPrefetch(cpdb_prefetch_t *pf)
+{
+    if (--pf->ref_count > 0)
+        return;
+
+    loginfo("Prefetched details of %d printers, %d failed\n",
+            pf->num_printers, pf->failed);
+    if (pf->done_cb && !pf->cancelled)
+        pf->done_cb(pf->num_printers, pf->failed, pf->user_data);
+    g_hash_table_destroy(pf->backends);
+    g_free(pf);
+}
+
+static void cpdbOnPrefetchDone(cpdb_printer_obj_t *p,
+                               int status,
+                               void *user_data)
+{
+    cpdb_prefetch_t *pf = user_data;
+    cpdb_prefetch_backend_t *b = g_hash_table_lookup(pf->backends, p->backend_name);
+
+    b->in_flight--;
+    if (!status)
+        pf->failed++;
+    if (pf->printer_cb && !pf->cancelled)
+        pf->printer_cb(p, status, pf->user_data);
+
+    cpdbPumpPrefetch(pf, p->backend_name);
+    cpdbUnrefPrinterObj(p);
+    cpdbUnrefPrefetch(pf);
+}
+
+static void cpdbOnPrefetchCancelled(cpdb_printer_obj_t *p,
+                                    int status,
+                                    void *user_data)
+{
+    cpdb_prefetch_t *pf = user_data;
+    cpdb_prefetch_backend_t *b = g_hash_table_lookup(pf->backends, p->backend_name);
+
+    /* The printers still waiting are dropped along with the prefetch */
+    b->in_flight--;
+    pf->failed++;
+    pf->cancelled = TRUE;
+    cpdbUnrefPrinterObj(p);
+    cpdbUnrefPrefetch(pf);
+}
+
+/* Start calls for the waiting printers of a backend, up to the limit */
+static void cpdbPumpPrefetch(cpdb_prefetch_t *pf,
+                             const char *backend_name)
+{
+    cpdb_prefetch_backend_t *b = g_hash_table_lookup(pf->backends, backend_name);
+    cpdb_printer_obj_t *p;
+
+    pf->ref_count++;
+    while (!pf->cancelled && b->in_flight < pf->max_per_backend &&
+           !g_queue_is_empty(&b->pending))
+    {
+        p = g_queue_pop_head(&b->pending);
+        b->in_flight++;
+        pf->ref_count++;
+        cpdbFetchDetails(p, cpdbOnPrefetchDone, cpdbOnPrefetchCancelled,
+                         pf, pf->printer_cb != NULL);
+    }
+    cpdbUnrefPrefetch(pf);
+}
+
+void cpdbPrefetchDetails(cpdb_printer_obj_t **printers,
+                         int num_printers,
+                         int max_per_backend,
+                         cpdb_async_callback printer_cb,
+                         cpdb_prefetch_callback done_cb,
+                         void *user_data)
+{
+    cpdb_prefetch_t *pf;
+    cpdb_prefetch_backend_t *b;
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *backend_names;
+    guint i;
+
+    if ((printers == NULL && num_printers > 0) || num_printers < 0 || max_per_backend < 0)
+    {
+        logwarn("Invalid params: cpdbPrefetchDetails()\n");
+        return;
+    }
+
+    pf = g_new0(cpdb_prefetch_t, 1);
+    pf->backends = g_hash_table_new_full(NULL, NULL, NULL, cpdbFreePrefetchBackend);
+    pf->max_per_backend = max_per_backend ? max_per_backend : CPDB_PREFETCH_CONCURRENCY;
+    pf->num_printers = num_printers;
+    pf->ref_count = 1;
+    pf->printer_cb = printer_cb;
+    pf->done_cb = done_cb;
+    pf->user_data = user_data;
+
+    /* Backend names are interned, so their pointers are keys */
+    for (i = 0; i < (guint) num_printers; i++)
+    {
+        if ((b = g_hash_table_lookup(pf->backends, printers[i]->backend_name)) == NULL)
+        {
+            b = g_new0(cpdb_prefetch_backend_t, 1);
+            g_queue_init(&b->pending);
+            g_hash_table_insert(pf->backends, printers[i]->backend_name, b);
+        }
+        g_queue_push_tail(&b->pending, cpdbRefPrinterObj(printers[i]));
+    }
+    logdebug("Prefetching details of %d printers of %u backends\n",
+             num_printers, g_hash_table_size(pf->backends));
+
+    backend_names = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, pf->backends);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_ptr_array_add(backend_names, key);
+    for (i = 0; i < backend_names->len; i++)
+        cpdbPumpPrefetch(pf, g_ptr_array_index(backend_names, i));
+    g_ptr_array_free(backend_names, TRUE);
+
+    cpdbUnrefPrefetch(pf);
 }
 
 
@@ -1747,19 +6078,23 @@ typedef struct {
 } cpdb_async_translations_obj_t;
 
 
-static void acquire_translations_cb(PrintBackend *proxy,
-                                    GAsyncResult *res,
+static void acquire_translations_cb(GVariant *reply,
+                                    const GError *error,
                                     gpointer user_data)
 {
-    GError *error = NULL;
     GVariant *translations;
 
     cpdb_async_translations_obj_t *a = user_data;
     cpdb_printer_obj_t *p = a->p;
 
-    print_backend_call_get_all_translations_finish(proxy, &translations,
-                                                    res, &error);
-    if (error)
+    if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        /* Cancelled on purpose, e.g. by deleting the frontend instance,
+         * the caller may be gone along with its user data */
+        logdebug("Cancelled getting printer translations for %s %s\n",
+                 p->id, p->backend_name);
+    }
+    else if (error)
     {
         logerror("Error getting printer translations for %s %s : %s\n",
                     p->id, p->backend_name, error->message);
@@ -1767,12 +6102,17 @@ static void acquire_translations_cb(PrintBackend *proxy,
     }
     else
     {
+        translations = g_variant_get_child_value(reply, 0);
         cpdbDeleteTranslations(p);
         p->locale = g_strdup(a->locale);
-        p->translations = cpdbUnpackTranslations(translations);
+        p->translations_arena = cpdbNewArena(CPDB_TRANSLATIONS_ARENA_SIZE);
+        p->translations = cpdbUnpackTranslations(translations,
+                                                 p->translations_arena);
+        g_variant_unref(translations);
         a->caller_cb(p, TRUE, a->user_data);
     }
 
+    cpdbUnrefPrinterObj(p);
     free(a->locale);
     free(a);
 }
@@ -1794,20 +6134,27 @@ void cpdbAcquireTranslations(cpdb_printer_obj_t *p,
         return;
     }
 
+    if (!cpdbIsPrinterConnected(p))
+    {
+        caller_cb(p, FALSE, user_data);
+        return;
+    }
+
     cpdb_async_translations_obj_t *a = g_new0(cpdb_async_translations_obj_t, 1);
-    a->p = p;
+    a->p = cpdbRefPrinterObj(p);
     a->locale = g_strdup(locale);
     a->caller_cb = caller_cb;
     a->user_data = user_data;
 
     logdebug("Acquiring printer translations for %s %s\n",
                 p->id, p->backend_name);
-    print_backend_call_get_all_translations(p->backend_proxy,
-                                            p->id,
-                                            locale,
-                                            NULL,
-                                            (GAsyncReadyCallback) acquire_translations_cb,
-                                            a);
+    cpdbCallPrinter(p,
+                    CPDB_CALL_TRANSLATIONS,
+                    "GetAllTranslations",
+                    g_variant_new("(ss)", p->id, locale),
+                    G_VARIANT_TYPE("(a{ss})"),
+                    acquire_translations_cb,
+                    a);
 }
 
 /**
@@ -1818,6 +6165,19 @@ cpdb_settings_t *cpdbGetNewSettings()
     cpdb_settings_t *s = g_new0(cpdb_settings_t, 1);
     s->count = 0;
     s->table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    s->ref_count = 1;
+    return s;
+}
+
+cpdb_settings_t *cpdbRefSettings(cpdb_settings_t *s)
+{
+    if (s == NULL)
+    {
+        logwarn("Invalid params: cpdbRefSettings()\n");
+        return NULL;
+    }
+
+    g_atomic_int_inc(&s->ref_count);
     return s;
 }
 
@@ -1985,9 +6345,16 @@ cpdb_settings_t *cpdbReadSettingsFromDisk()
 }
 
 void cpdbDeleteSettings(cpdb_settings_t *s)
+{
+    cpdbUnrefSettings(s);
+}
+
+void cpdbUnrefSettings(cpdb_settings_t *s)
 {
     if (s == NULL)
         return;
+    if (!g_atomic_int_dec_and_test(&s->ref_count))
+        return;
     
     if (s->table)
         g_hash_table_destroy(s->table);
@@ -2001,27 +6368,47 @@ cpdb_options_t *cpdbGetNewOptions()
 {
     cpdb_options_t *o = g_new0(cpdb_options_t, 1);
     o->count = 0;
-    o->table = g_hash_table_new_full(g_str_hash,
-                                     g_str_equal,
-                                     g_free,
-                                     (GDestroyNotify) cpdbDeleteOption);
+    /* The entries get unpacked into the arena, the tables never own them */
+    o->table = g_hash_table_new(g_str_hash, g_str_equal);
     o->media_count = 0;
-    o->media = g_hash_table_new_full(g_str_hash,
-                                     g_str_equal,
-                                     g_free,
-                                     (GDestroyNotify) cpdbDeleteMedia);
+    o->media = g_hash_table_new(g_str_hash, g_str_equal);
+    o->ref_count = 1;
     return o;
 }
 
+cpdb_options_t *cpdbRefOptions(cpdb_options_t *opts)
+{
+    if (opts == NULL)
+    {
+        logwarn("Invalid params: cpdbRefOptions()\n");
+        return NULL;
+    }
+
+    g_atomic_int_inc(&opts->ref_count);
+    return opts;
+}
+
 void cpdbDeleteOptions(cpdb_options_t *opts)
+{
+    cpdbUnrefOptions(opts);
+}
+
+void cpdbUnrefOptions(cpdb_options_t *opts)
 {
     if (opts == NULL)
         return;
+    if (!g_atomic_int_dec_and_test(&opts->ref_count))
+        return;
     
     if (opts->table)
         g_hash_table_destroy(opts->table);
     if (opts->media)
         g_hash_table_destroy(opts->media);
+    if (opts->option_variants)
+        g_variant_unref(opts->option_variants);
+    if (opts->media_variants)
+        g_variant_unref(opts->media_variants);
+    cpdbFreeArena(opts->arena);
 
     free(opts);
 }
@@ -2035,8 +6422,6 @@ void cpdbDeleteOption(cpdb_option_t *opt)
     
     if (opt->option_name)
         free(opt->option_name);
-    if (opt->group_name)
-        free(opt->group_name);
     if (opt->supported_values)
         free(opt->supported_values);
     if (opt->default_value)
@@ -2107,20 +6492,90 @@ void cpdbUnpackJobArray(GVariant *var,
  * ________________________________utility functions__________________________
  */
 
+/* Copy a string into the options arena once, however many options use it */
+static char *cpdbShareOptionString(cpdb_options_t *options,
+                                   GHashTable *strings,
+                                   const char *str)
+{
+    char *copy;
+
+    if ((copy = g_hash_table_lookup(strings, str)) == NULL)
+    {
+        copy = cpdbArenaStrdup(options->arena, str);
+        g_hash_table_add(strings, copy);
+    }
+    return copy;
+}
+
+/* Lay the options out in the arena with each group contiguous,
+ * keeping the backend's order otherwise, and index the groups */
+static void cpdbGroupOptions(cpdb_options_t *options,
+                             const cpdb_option_t *unpacked,
+                             int num_options)
+{
+    cpdb_option_group_t *groups;
+    int *group_of, *next;
+    int i, g, num_groups = 0;
+
+    groups = g_new0(cpdb_option_group_t, MAX(num_options, 1));
+    group_of = g_new(int, MAX(num_options, 1));
+    for (i = 0; i < num_options; i++)
+    {
+        /* Group names are shared within the options, and groups are few */
+        for (g = 0; g < num_groups; g++)
+            if (groups[g].name == unpacked[i].group_name)
+                break;
+        if (g == num_groups)
+            groups[num_groups++].name = unpacked[i].group_name;
+        groups[g].count++;
+        group_of[i] = g;
+    }
+
+    next = g_new(int, MAX(num_groups, 1));
+    for (g = 0; g < num_groups; g++)
+    {
+        groups[g].first = g ? groups[g - 1].first + groups[g - 1].count : 0;
+        next[g] = groups[g].first;
+    }
+
+    options->list = cpdbArenaAlloc(options->arena,
+                                   sizeof(cpdb_option_t) * num_options);
+    for (i = 0; i < num_options; i++)
+    {
+        cpdb_option_t *opt = &options->list[next[group_of[i]]++];
+
+        *opt = unpacked[i];
+        g_hash_table_insert(options->table, opt->option_name, opt);
+    }
+
+    options->groups = cpdbArenaAlloc(options->arena,
+                                     sizeof(cpdb_option_group_t) * num_groups);
+    memcpy(options->groups, groups, sizeof(cpdb_option_group_t) * num_groups);
+    options->group_count = num_groups;
+
+    g_free(next);
+    g_free(group_of);
+    g_free(groups);
+}
+
 void cpdbUnpackOptions(int num_options,
                        GVariant *opts_var,
                        int num_media,
                        GVariant *media_var,
                        cpdb_options_t *options)
 {
-    cpdb_option_t *opt;
+    cpdb_option_t *opt, *unpacked;
     cpdb_media_t *media;
     char buf[CPDB_BSIZE];
     int i, j, num, width, length, l, r, t, b;
     GVariantIter *iter, *sub_iter;
+    GHashTable *strings;
     char *str, *name, *def, *group;
     
     options->count = num_options;
+    unpacked = g_new0(cpdb_option_t, num_options);
+    /* Group names and values repeat a lot between options */
+    strings = g_hash_table_new(g_str_hash, g_str_equal);
     g_variant_get(opts_var, "a(sssia(s))", &iter);
     i = 0;
     while (g_variant_iter_loop(iter, "(sssia(s))",
@@ -2136,17 +6591,18 @@ void cpdbUnpackOptions(int num_options,
             break;
         }
 
-        opt = g_new0(cpdb_option_t, 1);
+        opt = &unpacked[i];
         logdebug("name=%s;\n", name);
-        opt->option_name = g_strdup(name);
+        opt->option_name = cpdbArenaStrdup(options->arena, name);
         logdebug("group=%s;\n", group);
-        opt->group_name = g_strdup(group);
+        opt->group_name = cpdbShareOptionString(options, strings, group);
         logdebug("default=%s;\n", def);
-        opt->default_value = g_strdup(def);
+        opt->default_value = cpdbArenaStrdup(options->arena, def);
         logdebug("num_choices=%d;\n", num);
         opt->num_supported = num;
         logdebug("choices:\n");
-        opt->supported_values = cpdbNewCStringArray(num);
+        opt->supported_values = cpdbArenaAlloc(options->arena,
+                                               sizeof(char *) * num);
 
         j = 0;
         while (g_variant_iter_loop(sub_iter, "(s)", &str))
@@ -2159,13 +6615,15 @@ void cpdbUnpackOptions(int num_options,
             }
 
             logdebug("  %s;\n", str);
-            opt->supported_values[j] = g_strdup(str);
+            opt->supported_values[j] = cpdbShareOptionString(options, strings, str);
             j++;
         }
-        g_hash_table_insert(options->table, g_strdup(opt->option_name), opt);
         i++;
     }
     g_variant_iter_free(iter);
+    cpdbGroupOptions(options, unpacked, i);
+    g_free(unpacked);
+    g_hash_table_destroy(strings);
     
     options->media_count = num_media;
     g_variant_get(media_var, "a(siiia(iiii))", &iter);
@@ -2181,16 +6639,17 @@ void cpdbUnpackOptions(int num_options,
             break;
         }
 
-        media = g_new0(cpdb_media_t, 1);
+        media = cpdbArenaAlloc(options->arena, sizeof(cpdb_media_t));
         logdebug("name=%s;\n", name);
-        media->name = g_strdup(name);
+        media->name = cpdbArenaStrdup(options->arena, name);
         logdebug("width=%d;\n", width);
         media->width = width;
         logdebug("length=%d;\n", length);
         media->length = length;
         logdebug("num_margins=%d;\n", num);
         media->num_margins = num;
-        media->margins = g_new0(cpdb_margin_t, num);
+        media->margins = cpdbArenaAlloc(options->arena,
+                                        sizeof(cpdb_margin_t) * num);
 
         j = 0;
         while (g_variant_iter_loop(sub_iter, "(iiii)", &l, &r, &t, &b))
@@ -2208,25 +6667,28 @@ void cpdbUnpackOptions(int num_options,
             media->margins[j].bottom = b;
             j++;
         }
-        g_hash_table_insert(options->media, g_strdup(media->name), media);
+        g_hash_table_insert(options->media, media->name, media);
         i++;
     }
     g_variant_iter_free(iter);
 }
 
-static GHashTable *cpdbUnpackTranslations (GVariant *variant)
+static GHashTable *cpdbUnpackTranslations (GVariant *variant,
+                                           cpdb_arena_t *arena)
 {
     GVariantIter iter;
     gchar *key, *value;
     GHashTable *translations;
 
-    translations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    /* The strings belong to the arena */
+    translations = g_hash_table_new(g_str_hash, g_str_equal);
     g_variant_iter_init(&iter, variant);
     while (g_variant_iter_loop(&iter, CPDB_TL_ARGS, &key, &value))
     {
         logdebug("Fetched translation '%s' : '%s'\n", key, value);
         g_hash_table_insert(translations,
-                            g_strdup(key), g_strdup(value));
+                            cpdbArenaStrdup(arena, key),
+                            cpdbArenaStrdup(arena, value));
     }
 
     return translations;
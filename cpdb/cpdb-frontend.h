@@ -23,6 +23,8 @@ extern "C"
 /* Names of default config files */
 #define CPDB_PRINT_SETTINGS_FILE   "print-settings"
 #define CPDB_DEFAULT_PRINTERS_FILE "default-printers"
+#define CPDB_PRINTER_CATALOG_FILE  "printer-catalog"
+#define CPDB_OPTIONS_CACHE_DIR     "options-cache"
 
 /* Debug macros */
 #define logdebug(...) cpdbFDebugPrintf(CPDB_DEBUG_LEVEL_DEBUG, __VA_ARGS__)
@@ -34,10 +36,12 @@ typedef struct cpdb_frontend_obj_s cpdb_frontend_obj_t;
 typedef struct cpdb_printer_obj_s cpdb_printer_obj_t;
 typedef struct cpdb_settings_s cpdb_settings_t;
 typedef struct cpdb_options_s cpdb_options_t;
+typedef struct cpdb_option_group_s cpdb_option_group_t;
 typedef struct cpdb_option_s cpdb_option_t;
 typedef struct cpdb_margin_s cpdb_margin_t;
 typedef struct cpdb_media_s cpdb_media_t;
 typedef struct cpdb_job_s cpdb_job_t;
+typedef struct cpdb_printer_key_s cpdb_printer_key_t;
 
 typedef enum cpdb_printer_update_e {
     CPDB_CHANGE_PRINTER_ADDED,
@@ -54,6 +58,108 @@ typedef enum cpdb_printer_update_e {
  */
 typedef void (*cpdb_printer_callback)(cpdb_frontend_obj_t *frontend_obj, cpdb_printer_obj_t *printer_obj, cpdb_printer_update_t update);
 
+typedef struct cpdb_printer_change_s {
+    cpdb_printer_obj_t *printer;
+    cpdb_printer_update_t update;
+} cpdb_printer_change_t;
+
+/**
+ * Callback for a batch of printer updates, at most one per printer
+ *
+ * @param frontend_obj      Frontend instance
+ * @param changes           Printers updated, in the order of their first update.
+ *                          The callback takes ownership of the removed printers,
+ *                          the array itself is freed after it returns.
+ * @param num_changes       Number of printers updated
+ */
+typedef void (*cpdb_printer_batch_callback)(cpdb_frontend_obj_t *frontend_obj, const cpdb_printer_change_t *changes, int num_changes);
+
+typedef enum cpdb_search_mode_e {
+    CPDB_SEARCH_PREFIX,         /** Query words match the beginning of words */
+    CPDB_SEARCH_SUBSTRING,      /** Query words match anywhere */
+} cpdb_search_mode_t;
+
+typedef enum cpdb_sort_order_e {
+    CPDB_SORT_BY_NAME,          /** Printer name */
+    CPDB_SORT_BY_BACKEND,       /** Backend name, then printer name */
+    CPDB_SORT_BY_COLLATION,     /** Printer name, collated for the current locale */
+    CPDB_SORT_COUNT
+} cpdb_sort_order_t;
+
+typedef enum cpdb_enumeration_update_e {
+    CPDB_ENUMERATION_BACKEND_DONE,
+    CPDB_ENUMERATION_COMPLETE,
+} cpdb_enumeration_update_t;
+
+/**
+ * Callback for the progress of the initial printer enumeration
+ *
+ * @param frontend_obj      Frontend instance
+ * @param backend_name      Backend which has listed all its printers,
+ *                          NULL for CPDB_ENUMERATION_COMPLETE
+ * @param update            Type of update
+ */
+typedef void (*cpdb_enumeration_callback)(cpdb_frontend_obj_t *frontend_obj, const char *backend_name, cpdb_enumeration_update_t update);
+
+/**
+ * Kinds of backend calls, each with its own timeout
+ */
+typedef enum cpdb_call_e {
+    CPDB_CALL_LISTING,          /** Listing the printers of a backend */
+    CPDB_CALL_STATE,            /** Printer state and whether it accepts jobs */
+    CPDB_CALL_OPTIONS,          /** Printer options and media */
+    CPDB_CALL_TRANSLATIONS,     /** Option, choice and group translations */
+    CPDB_CALL_PRINT,            /** Submitting a job */
+    CPDB_CALL_CONTROL,          /** Default printer, keeping the backend alive, ... */
+    CPDB_CALL_COUNT,
+} cpdb_call_t;
+
+typedef enum cpdb_backend_state_e {
+    CPDB_BACKEND_HEALTHY,       /** Answering in time */
+    CPDB_BACKEND_SLOW,          /** Answering, but slowly */
+    CPDB_BACKEND_UNAVAILABLE,   /** Not answering, calls fail right away until
+                                    a background probe gets an answer again */
+} cpdb_backend_state_t;
+
+/**
+ * Health of a backend, as seen from the calls made to it
+ */
+typedef struct cpdb_backend_health_s {
+    cpdb_backend_state_t state;
+    double latency_ms;          /** Rolling average of the call latency */
+    double error_rate;          /** Rolling ratio of calls which got no answer */
+    int consecutive_timeouts;
+    unsigned long calls;
+    unsigned long failures;
+} cpdb_backend_health_t;
+
+/**
+ * Copy of the basic fields of a printer, the strings belong to
+ * the snapshot holding it
+ */
+typedef struct cpdb_printer_view_s {
+    const char *id;
+    const char *name;
+    const char *info;
+    const char *location;
+    const char *make_and_model;
+    const char *state;
+    const char *backend_name;
+    gboolean accepting_jobs;
+} cpdb_printer_view_t;
+
+/**
+ * Printers of a frontend instance at one point in time, see
+ * cpdbGetPrinterSnapshot()
+ */
+typedef struct cpdb_printer_snapshot_s {
+    int num_printers;
+    const cpdb_printer_view_t *printers; /** In no particular order */
+    /*< private >*/
+    gint ref_count;
+    struct cpdb_arena_s *arena;
+} cpdb_printer_snapshot_t;
+
 /**
  * Callback for async functions
  *
@@ -63,6 +169,18 @@ typedef void (*cpdb_printer_callback)(cpdb_frontend_obj_t *frontend_obj, cpdb_pr
  */
 typedef void (*cpdb_async_callback)(cpdb_printer_obj_t *printer_obj, int status, void *user_data);
 
+/**
+ * Callback for cpdbPrefetchDetails(), once every printer is done
+ *
+ * @param num_printers      Number of printers prefetched
+ * @param num_failed        Number of them whose details couldn't be got
+ * @param user_data 	    User data
+ */
+typedef void (*cpdb_prefetch_callback)(int num_printers, int num_failed, void *user_data);
+
+/* Default number of concurrent details calls to a backend for cpdbPrefetchDetails() */
+#define CPDB_PREFETCH_CONCURRENCY 4
+
 /*********************definitions ***************************/
 
 /**
@@ -75,20 +193,54 @@ struct cpdb_frontend_obj_s
     GDBusConnection *connection;
 
     cpdb_printer_callback printer_cb;
+    cpdb_enumeration_callback enumeration_cb;
+    cpdb_printer_batch_callback printer_batch_cb;
+    struct cpdb_batch_s *batch;         /** Printer updates waiting for printer_batch_cb */
+    struct cpdb_search_index_s *search; /** Index for cpdbSearchPrinters(), built on first use */
+    struct cpdb_sorted_view_s *sorted[CPDB_SORT_COUNT]; /** Printers in each order, built on first use */
+    struct cpdb_default_prefetch_s *default_prefetch; /** Set by cpdbSetDefaultPrinterPrefetch() */
 
     int num_backends;
     GHashTable *backend; /**[backend name(like "CUPS" or "GCP")] ---> [BackendObj]**/
+    GHashTable *activating_backends; /** Names of the backends being activated **/
 
     int num_printers;
-    GHashTable *printer; /**[printer name] --> [cpdb_printer_obj_t] **/
+    GHashTable *printer; /**[cpdb_printer_key_t] --> [cpdb_printer_obj_t] **/
+
+    GRecMutex registry_lock;            /** Guards backend, activating_backends and printer */
+    int registry_depth;
+    gboolean registry_dirty;            /** printer changed since the last snapshot */
+    GArray *pending_changes;            /** cpdb_printer_change_t for printer_cb, delivered
+                                            once the registry is unlocked */
+    GMutex snapshot_lock;               /** Guards swapping snapshot only */
+    cpdb_printer_snapshot_t *snapshot;  /** Last published state of printer */
 
     gboolean hide_remote;
     gboolean hide_temporary;
     gboolean stop_flag;
 
     cpdb_settings_t *last_saved_settings; /** The last saved settings to disk */
+    gboolean catalog_synced;            /** The printer catalog matches the live backends */
+    gboolean catalog_shown;             /** The catalog printers got reported to the frontend */
+
+    GCancellable *cancellable;          /** Cancelled on disconnecting from DBus */
+    guint printer_added_id;             /** Subscriptions for the printer signals */
+    guint printer_removed_id;
+    guint printer_state_changed_id;
+    guint printers_changed_id;
+    int timeouts[CPDB_CALL_COUNT];      /** Timeouts in ms for the backend calls of the printers */
 
     GThread *background_thread;
+    GMainContext *background_context;   /** Context the backend watch is dispatched in */
+    GMainContext *callback_context;     /** Where the changes found by the background
+                                            thread get reported */
+    GArray *deferred_changes;           /** cpdb_printer_change_t of the background thread,
+                                            delivered from callback_context */
+    GSource *deferred_source;
+    GCancellable *background_cancellable; /** Cancelled when the background thread stops */
+    gint background_activations;        /** Activations of the background thread in flight */
+    guint name_owner_changed_id;        /** Subscription for backends coming/going */
+    guint activatable_changed_id;       /** Subscription for newly installed backends */
 };
 
 /**
@@ -102,6 +254,20 @@ struct cpdb_frontend_obj_s
  */
 cpdb_frontend_obj_t *cpdbGetNewFrontendObj(cpdb_printer_callback printer_cb);
 
+/**
+ * Show the printers known from the last session right away.
+ *
+ * They are loaded from the printer catalog on disk, marked as stale
+ * and reported through the printer callback before returning. Once
+ * connected to DBus, they are reconciled against the live backends:
+ * only printers which are new, gone or changed get reported again.
+ * The ones of a backend which fails to answer are kept until it does.
+ * Must be called before connecting to DBus.
+ * 
+ * @param frontend_obj      Frontend instance
+ */
+void cpdbShowCachedPrinters(cpdb_frontend_obj_t *frontend_obj);
+
 /**
  * Free up a frontend instance.
  * 
@@ -111,13 +277,56 @@ void cpdbDeleteFrontendObj(cpdb_frontend_obj_t *frontend_obj);
 
 /**
  * Connect to DBus, activate the CPDB backends and fetch printers.
+ *
+ * The printers fetched aren't reported through the printer callback,
+ * unless cpdbShowCachedPrinters() was called: then the ones which are
+ * new or changed against the catalog are, like with the async variant.
  * 
  * @param frontend_obj      Frontend instance to connect to DBus
  */
 void cpdbConnectToDBus(cpdb_frontend_obj_t *frontend_obj);
 
+/**
+ * Connect to DBus and start activating the CPDB backends without waiting
+ * for them.
+ *
+ * Each printer is reported through the printer callback as soon as its
+ * backend answers, and the enumeration callback is called when a backend
+ * has listed all its printers and when all backends have done so.
+ * The callbacks get dispatched in the thread-default main context of the
+ * caller, which needs to be running.
+ *
+ * @param frontend_obj      Frontend instance to connect to DBus
+ */
+void cpdbConnectToDBusAsync(cpdb_frontend_obj_t *frontend_obj);
+
+/**
+ * Get the connection to the session bus.
+ *
+ * The connection is shared by the resurrected printers of the process,
+ * it is set up once and kept open, so that resurrecting a printer again
+ * doesn't pay for a new connection. Frontend instances each get their
+ * own connection, as backends keep per bus name whether they list
+ * printers and which ones they hide.
+ *
+ * @return                  New reference to the shared connection, to be
+ *                          released with g_object_unref() and never closed,
+ *                          NULL on failure
+ */
 GDBusConnection *cpdbGetDbusConnection();
 
+/**
+ * Set whether the shared bus connection gets set up again when it was
+ * closed, e.g. because the bus went away. It is re-established on the
+ * next cpdbGetDbusConnection() call, not as soon as it is closed.
+ *
+ * Enabled by default. When disabled, cpdbGetDbusConnection() fails once
+ * the shared connection is closed.
+ *
+ * @param enabled           Whether to reconnect
+ */
+void cpdbSetDbusLazyReconnect(gboolean enabled);
+
 /**
  * Disconnect from the DBus.
  * 
@@ -140,7 +349,93 @@ void cpdbDisconnectFromDBus(cpdb_frontend_obj_t *frontend_obj);
 void cpdbIgnoreLastSavedSettings(cpdb_frontend_obj_t *frontend_obj);
 
 /**
- * Add the printer to the frontend instance
+ * Set the timeout of a kind of backend calls, for all printers of the
+ * frontend instance. This overrides the timeouts set for a single
+ * printer with cpdbSetPrinterCallTimeout().
+ *
+ * A call which times out fails like any other failed call.
+ *
+ * @param frontend_obj      Frontend instance
+ * @param call              Kind of backend calls
+ * @param timeout_msec      Timeout in milliseconds, -1 for the DBus default
+ *                          or G_MAXINT for no timeout
+ */
+void cpdbSetCallTimeout(cpdb_frontend_obj_t *frontend_obj, cpdb_call_t call, int timeout_msec);
+
+/**
+ * Fetch the options and translations of the probable default printer
+ * while the printers are still being listed, so that they're ready by
+ * the time the dialog shows it. The candidates are the printers of the
+ * default-printers config files, then the default printer of the CUPS
+ * backend, like with cpdbGetDefaultPrinter(). A candidate is prefetched
+ * as soon as it turns up and no better one was prefetched already.
+ *
+ * Call it before cpdbConnectToDBus(). The prefetch calls are made from
+ * the thread-default main context of the caller, so it has to be
+ * iterated for them to complete, even if the printers get listed in
+ * another thread or by a blocking cpdbConnectToDBus().
+ *
+ * @param frontend_obj      Frontend instance
+ * @param locale            Locale of the translations to fetch,
+ *                          NULL to turn prefetching off again
+ */
+void cpdbSetDefaultPrinterPrefetch(cpdb_frontend_obj_t *frontend_obj, const char *locale);
+
+/**
+ * Get printer updates in batches instead of one by one. Updates are
+ * collected for window_msec after the first one, then delivered in a
+ * single call of batch_cb instead of calling the printer callback.
+ * Batches are delivered in the thread-default main context of the
+ * caller of this function, whichever thread the updates came from.
+ * Updates of a printer within a batch collapse into one: a printer
+ * added and changed is reported as added, a printer added and removed
+ * isn't reported at all.
+ *
+ * @param frontend_obj      Frontend instance
+ * @param batch_cb          Callback for the batches, NULL to go back to
+ *                          the printer callback, flushing pending updates
+ * @param window_msec       Time to collect updates for, e.g. 16, or 0
+ *                          to deliver them as soon as the main loop is idle
+ */
+void cpdbSetPrinterBatchCallback(cpdb_frontend_obj_t *frontend_obj,
+                                 cpdb_printer_batch_callback batch_cb,
+                                 int window_msec);
+
+/**
+ * Deliver the pending printer updates to the batch callback now.
+ *
+ * @param frontend_obj      Frontend instance
+ */
+void cpdbFlushPrinterChanges(cpdb_frontend_obj_t *frontend_obj);
+
+/**
+ * Cancel the backend calls in progress for all printers of the
+ * frontend instance, see cpdbCancelPrinterCalls().
+ *
+ * @param frontend_obj      Frontend instance
+ */
+void cpdbCancelAllPrinterCalls(cpdb_frontend_obj_t *frontend_obj);
+
+/**
+ * Get the health of a backend.
+ *
+ * A backend which stops answering (several timeouts in a row, or most
+ * of its recent calls failing) is marked unavailable: calls to it fail
+ * right away, cached values are served where there are some, and it is
+ * probed in the background until it answers again.
+ *
+ * @param frontend_obj      Frontend instance
+ * @param backend_name      Backend name
+ * @param health            Filled with the health of the backend
+ *
+ * @return                  TRUE if the backend was found, FALSE otherwise
+ */
+gboolean cpdbGetBackendHealth(cpdb_frontend_obj_t *frontend_obj, const char *backend_name, cpdb_backend_health_t *health);
+
+/**
+ * Add the printer to the frontend instance, which takes over the
+ * reference. A printer added before under the same id and backend
+ * is replaced and unreferenced.
  * 
  * @param frontend_obj      Frontend instance
  * @param printer_obj       Printer object
@@ -235,6 +530,9 @@ void cpdbPrintBasicOptions(const cpdb_printer_obj_t *p);
 
 /**
  * Activate backends associated with the frontend object.
+ *
+ * All backends get activated and their printers fetched concurrently,
+ * the function returns once the slowest backend has answered.
  * 
  * @param f                Frontend instance
  */
@@ -242,13 +540,22 @@ void cpdbActivateBackends(cpdb_frontend_obj_t *f);
 
 /**
  * Start the background thread for refreshing the backend list.
+ *
+ * The thread does not poll, it watches the NameOwnerChanged signal of
+ * the session bus for CPDB backends coming and going and updates the
+ * backend and printer lists when one of them does. The printers it
+ * adds or removes are reported through the printer callbacks from the
+ * thread-default main context of the caller, which needs to be running.
  * 
  * @param f                Frontend instance
  */
 void cpdbStartBackendListRefreshing(cpdb_frontend_obj_t *f);
 
 /**
- * Stop the background thread for refreshing the backend list
+ * Stop the background thread for refreshing the backend list.
+ *
+ * The backend activations it started which are still in flight get
+ * cancelled, it returns once they are cleaned up.
  * 
  * @param f                Frontend instance
  */
@@ -263,6 +570,19 @@ void cpdbStopBackendListRefreshing(cpdb_frontend_obj_t *f);
  */
 cpdb_frontend_obj_t *cpdbStartListingPrinters(cpdb_printer_callback printer_cb);
 
+/**
+ * Start listing printers of the backends without waiting for them,
+ * see cpdbConnectToDBusAsync().
+ *
+ * @param printer_cb       Callback function to be called when printers are listed
+ * @param enumeration_cb   Callback function to be called when backends
+ *                         have listed all their printers, can be NULL
+ *
+ * @return                 Frontend instance for the printer listing
+ */
+cpdb_frontend_obj_t *cpdbStartListingPrintersStreaming(cpdb_printer_callback printer_cb,
+                                                      cpdb_enumeration_callback enumeration_cb);
+
 /**
  * Stop listing printers associated with the frontend object.
  * 
@@ -314,6 +634,8 @@ PrintBackend *cpdbCreateBackend(GDBusConnection *, const char *);
  * @param backend_name      Backend name
  * 
  * @return                  Printer object if found, NULL otherwise.
+ *                          The caller owns a reference to it, to be dropped
+ *                          with cpdbUnrefPrinterObj().
  */
 cpdb_printer_obj_t *cpdbFindPrinterObj(cpdb_frontend_obj_t *frontend_obj, const char *printer_id, const char *backend_name);
 
@@ -323,7 +645,9 @@ cpdb_printer_obj_t *cpdbFindPrinterObj(cpdb_frontend_obj_t *frontend_obj, const
  * @param frontend_obj      Frontend instance
  * @param backend_name      Backend name
  * 
- * @return                  Default printer for backend if found, NULL otherwise
+ * @return                  Default printer for backend if found, NULL otherwise.
+ *                          The caller owns a reference to it, to be dropped
+ *                          with cpdbUnrefPrinterObj().
  */
 cpdb_printer_obj_t *cpdbGetDefaultPrinterForBackend(cpdb_frontend_obj_t *frontend_obj, const char *backend_name);
 
@@ -333,7 +657,9 @@ cpdb_printer_obj_t *cpdbGetDefaultPrinterForBackend(cpdb_frontend_obj_t *fronten
  *
  * @param frontend_obj      Frontend instance
  * 
- * @return                  Default printer if any exists, NULL otherwise
+ * @return                  Default printer if any exists, NULL otherwise.
+ *                          The caller owns a reference to it, to be dropped
+ *                          with cpdbUnrefPrinterObj().
  */
 cpdb_printer_obj_t *cpdbGetDefaultPrinter(cpdb_frontend_obj_t *frontend_obj);
 
@@ -357,6 +683,39 @@ gboolean cpdbSetSystemDefaultPrinter(cpdb_printer_obj_t *p);
 
 /*******************************************************************************************/
 
+/**
+______________________________________ cpdb_printer_key_t __________________________________________
+
+**/
+/** Key of a printer in the printer table of a frontend instance.
+ * The strings are borrowed, the hash is computed once by cpdbInitPrinterKey(),
+ * so a lookup with a key on the stack doesn't allocate **/
+struct cpdb_printer_key_s
+{
+    const char *id;
+    const char *backend_name;
+    guint hash;
+};
+
+/**
+ * Set up a printer key.
+ *
+ * @param key               Key to set up
+ * @param printer_id        ID of the printer, must outlive the key
+ * @param backend_name      Name of the backend, must outlive the key
+ */
+void cpdbInitPrinterKey(cpdb_printer_key_t *key, const char *printer_id, const char *backend_name);
+
+/**
+ * GHashFunc for cpdb_printer_key_t
+ */
+guint cpdbPrinterKeyHash(gconstpointer key);
+
+/**
+ * GEqualFunc for cpdb_printer_key_t
+ */
+gboolean cpdbPrinterKeyEqual(gconstpointer a, gconstpointer b);
+
 /**
 ______________________________________ cpdb_printer_obj_t __________________________________________
 
@@ -366,7 +725,12 @@ struct cpdb_printer_obj_s
     PrintBackend *backend_proxy; /** The proxy object of the backend the printer is associated with **/
     char *backend_name;          /** Backend name ,("CUPS"/ "GCP") also used as suffix */
 
-    /**The basic attributes first**/
+    /**The basic attributes first,
+     * backend_name and state are interned with cpdbInternString()
+     * and must not be freed. They are updated in place when the backend
+     * reports a change, from whichever thread got it. A string read from
+     * them stays valid for as long as the printer object lives, use
+     * cpdbGetPrinterSnapshot() for a consistent set of them**/
 
     char *id;
     char *name;
@@ -376,31 +740,103 @@ struct cpdb_printer_obj_s
     char *state;
     gboolean accepting_jobs;
 
-    /** The more advanced options we get from the backend **/
+    /** Key of the printer in the printer table, pointing to id and backend_name **/
+    cpdb_printer_key_t key;
+
+    /** Loaded from the printer catalog and not yet confirmed by its backend,
+     * the printer has no backend proxy until then **/
+    gboolean stale;
+
+    /** The more advanced options we get from the backend,
+     * with their table and media filled in **/
     cpdb_options_t *options;
 
-    /**The settings the user selects, and which will be used for printing the job**/
+    /**The settings the user selects, and which will be used for printing the job.
+     * Shared with other printers until changed through cpdbAddSettingToPrinter()
+     * or cpdbClearSettingFromPrinter(), don't change it directly **/
     cpdb_settings_t *settings;
 
     /** Translations **/
     char *locale;
-    GHashTable *translations;
+    GHashTable *translations;       /** Keys and values live in translations_arena **/
+    cpdb_arena_t *translations_arena;
+
+    /** Backend calls **/
+    int timeouts[CPDB_CALL_COUNT]; /** Timeouts in ms, by kind of call **/
+    GCancellable *cancellable;     /** Cancels the calls in progress **/
+
+    gint ref_count;
+
+    /*< private >*/
+    cpdb_options_t *prefetched_options; /** Fetched ahead, moved to options once needed **/
+    GSList *retired_options;            /** Replaced by fresh ones, kept for their readers **/
+    GSList *retired_strings;            /** Replaced name, info, location and make_and_model **/
 };
 
 /**
- * Get a new empty printer object.
+ * Get a new empty printer object, with a reference count of 1.
  * 
  * @return                  Printer object
  */
 cpdb_printer_obj_t *cpdbGetNewPrinterObj();
 
 /**
- * Free up a printer object.
+ * Take a reference to a printer object, e.g. to keep a printer
+ * around after its removal has been reported.
+ * 
+ * @param printer_obj       Printer object
+ *
+ * @return                  The printer object
+ */
+cpdb_printer_obj_t *cpdbRefPrinterObj(cpdb_printer_obj_t *printer_obj);
+
+/**
+ * Drop a reference to a printer object, freeing it with the last one.
+ * 
+ * @param printer_obj       Printer object
+ */
+void cpdbUnrefPrinterObj(cpdb_printer_obj_t *printer_obj);
+
+/**
+ * Drop the reference to each printer of a NULL terminated array, as
+ * returned by cpdbSearchPrinters() and the like, and free the array.
+ * 
+ * @param printers          Printer objects
+ */
+void cpdbUnrefPrinterArray(cpdb_printer_obj_t **printers);
+
+/**
+ * Drop a reference to a printer object, same as cpdbUnrefPrinterObj().
+ * The printer callback owns the reference of the frontend instance to
+ * a removed printer, and drops it this way.
  * 
  * @param printer_obj       Printer object
  */
 void cpdbDeletePrinterObj(cpdb_printer_obj_t *printer_obj);
 
+/**
+ * Set the timeout of a kind of backend calls for a printer.
+ *
+ * @param printer_obj       Printer object
+ * @param call              Kind of backend calls
+ * @param timeout_msec      Timeout in milliseconds, -1 for the DBus default
+ *                          or G_MAXINT for no timeout
+ */
+void cpdbSetPrinterCallTimeout(cpdb_printer_obj_t *printer_obj, cpdb_call_t call, int timeout_msec);
+
+/**
+ * Cancel the backend calls in progress for a printer, e.g. when the
+ * user switches to another printer. Synchronous calls blocking another
+ * thread return with an error, asynchronous calls are dropped without
+ * calling their callback, so it doesn't run after the caller went away,
+ * e.g. with cpdbDeleteFrontendObj().
+ *
+ * Calls made afterwards are not affected.
+ *
+ * @param printer_obj       Printer object
+ */
+void cpdbCancelPrinterCalls(cpdb_printer_obj_t *printer_obj);
+
 /**
  * Print basic printer info to debug logs.
  * 
@@ -428,6 +864,15 @@ char *cpdbGetState(cpdb_printer_obj_t *printer_obj);
 
 /**
  * Get all the different options and values supported by a printer.
+ *
+ * Options are cached on disk in CPDB_OPTIONS_CACHE_DIR for backends
+ * telling the capability generation of their printers. A backend
+ * answering 0 isn't asked again while its proxy lives. Cached options
+ * are returned right away and checked against the backend in the
+ * background. Outdated ones are replaced, on disk and in the printer,
+ * so a later call returns the fresh options. The options returned
+ * before stay valid for as long as the printer lives, there is no
+ * callback for the replacement.
  * 
  * @param printer_obj       Printer object
  * 
@@ -523,6 +968,11 @@ char *cpdbPrintSocket(cpdb_printer_obj_t *p, char **jobid, const char *title);
 
 /**
  * Refresh the printer list for a specific backend.
+ * Printers already known are updated in place, and the printer
+ * callback is only invoked for printers that were added, removed
+ * or changed since the last listing.
+ * Backends implementing GetPrinterChanges only send what changed since
+ * the previous refresh, others send their whole printer list.
  * 
  * @param f                Frontend instance
  * @param backend          Backend name
@@ -531,6 +981,122 @@ char *cpdbPrintSocket(cpdb_printer_obj_t *p, char **jobid, const char *title);
  */
 bool cpdbRefreshPrinterList(cpdb_frontend_obj_t *f, const char *backend);
 
+/**
+ * Search the printers by name, info, location and make and model.
+ * Matching ignores case, each word of the query has to match.
+ * Printers whose name starts with the query come first, then those
+ * matching words of their name, then of their other fields, then
+ * matching inside words.
+ *
+ * The index behind the search is built on the first call and updated
+ * as printers come and go. Matching anywhere only checks the printers
+ * containing the rarest three-byte sequence of the query words, so it
+ * only scans all printers if every query word is shorter than that.
+ *
+ * @param f                Frontend instance
+ * @param query            Words to search for
+ * @param mode             Whether words match at the start of words only,
+ *                         or anywhere
+ * @param limit            Maximum number of results, 0 for no limit
+ * @param num_results      Set to the number of results if not NULL
+ *
+ * @return                 NULL terminated array of the matching printers,
+ *                         best match first. The caller owns a reference
+ *                         to each printer, release them and the array with
+ *                         cpdbUnrefPrinterArray().
+ */
+cpdb_printer_obj_t **cpdbSearchPrinters(cpdb_frontend_obj_t *f, const char *query,
+                                        cpdb_search_mode_t mode, int limit,
+                                        int *num_results);
+
+/**
+ * Get a page of the printers in a stable sort order, e.g. the rows of
+ * a list view which are visible. Ties are broken by backend name and
+ * printer id, so the order doesn't change between calls.
+ *
+ * The order is built on the first call for it and updated as printers
+ * come and go, getting a page then takes O(log n + limit).
+ *
+ * @param f                Frontend instance
+ * @param order            Sort order
+ * @param offset           Position of the first printer to get
+ * @param limit            Maximum number of printers to get, 0 for no limit
+ * @param num_printers     Set to the number of printers got if not NULL
+ *
+ * @return                 NULL terminated array of the printers. The caller
+ *                         owns a reference to each printer, release them and
+ *                         the array with cpdbUnrefPrinterArray().
+ */
+cpdb_printer_obj_t **cpdbGetSortedPrinters(cpdb_frontend_obj_t *f, cpdb_sort_order_t order,
+                                           int offset, int limit, int *num_printers);
+
+/**
+ * Get the position of a printer in a sort order,
+ * e.g. to scroll a list view to it.
+ *
+ * @param f                Frontend instance
+ * @param order            Sort order
+ * @param p                Printer object
+ *
+ * @return                 Position of the printer, -1 if it isn't listed
+ */
+int cpdbGetSortedPosition(cpdb_frontend_obj_t *f, cpdb_sort_order_t order,
+                          cpdb_printer_obj_t *p);
+
+/**
+ * Get the printers matching a filter, e.g. only those accepting jobs.
+ * The backends evaluate the filter before sending their printers,
+ * for backends which can't it is evaluated on the printers already
+ * known from them. The printers got are added to the frontend instance
+ * like those listed through cpdbRefreshPrinterList(). Printers whose
+ * options aren't known yet don't match a color filter there.
+ *
+ * Blocks until every backend has answered.
+ *
+ * @param f                Frontend instance
+ * @param filter           Dictionary of CPDB_FILTER_* keys of type
+ *                         CPDB_FILTER_ARGS, e.g. built with GVariantDict,
+ *                         consumed if floating
+ * @param num_printers     Set to the number of printers got if not NULL
+ *
+ * @return                 NULL terminated array of the matching printers.
+ *                         The caller owns a reference to each printer,
+ *                         release them and the array with
+ *                         cpdbUnrefPrinterArray(). NULL if the filter isn't
+ *                         valid, see cpdbIsValidPrinterFilter().
+ */
+cpdb_printer_obj_t **cpdbGetMatchingPrinters(cpdb_frontend_obj_t *f, GVariant *filter,
+                                             int *num_printers);
+
+/**
+ * Get the printers of the frontend instance without waiting for
+ * the threads updating them, e.g. to fill a list view.
+ *
+ * The snapshot is published each time the printers are done changing
+ * and doesn't change afterwards. It holds copies of the printer fields
+ * rather than the printers, which keep changing, so it can be read
+ * from any thread while it's held. Use cpdbFindPrinterObj() with the
+ * id and backend name of a view to get a reference to its printer.
+ *
+ * The printer callbacks run after the printer registry is unlocked,
+ * on the thread which made the change, or for the changes made by the
+ * backend list refreshing, see cpdbStartBackendListRefreshing(), from
+ * the main context which started it.
+ *
+ * @param f                Frontend instance
+ *
+ * @return                 Snapshot of the printers,
+ *                         to be released with cpdbUnrefPrinterSnapshot()
+ */
+cpdb_printer_snapshot_t *cpdbGetPrinterSnapshot(cpdb_frontend_obj_t *f);
+
+/**
+ * Release a snapshot got from cpdbGetPrinterSnapshot().
+ *
+ * @param snapshot         Printer snapshot
+ */
+void cpdbUnrefPrinterSnapshot(cpdb_printer_snapshot_t *snapshot);
+
 /**
  * Callback function for printer events.
  * 
@@ -588,6 +1154,24 @@ void cpdbOnPrinterStateChanged(GDBusConnection *connection, const gchar *sender_
                                const gchar *signal_name, GVariant *parameters,
                                gpointer user_data);
 
+/**
+ * Callback function for a batch of printer changes from a backend.
+ * Applies all the added, removed and changed printers of the batch,
+ * replacing the per-printer signals for backends sending it.
+ * 
+ * @param connection       DBus connection
+ * @param sender_name      Sender name
+ * @param object_path      Object path
+ * @param interface_name   Interface name
+ * @param signal_name      Signal name
+ * @param parameters       Signal parameters
+ * @param user_data        User data
+ */
+void cpdbOnPrintersChanged(GDBusConnection *connection, const gchar *sender_name,
+                           const gchar *object_path, const gchar *interface_name,
+                           const gchar *signal_name, GVariant *parameters,
+                           gpointer user_data);
+
 /**
  * Fill basic options for a printer from a GVariant.
  * 
@@ -717,6 +1301,7 @@ int cpdbGetMediaMargins(cpdb_printer_obj_t *printer_obj, const char *media_name,
 
 /**
  * Asynchronously fetch printer details and options.
+ * Cached options are used as with cpdbGetAllOptions().
  *
  * @param printer_obj       Printer object
  * @param caller_cb         Callback function
@@ -725,6 +1310,26 @@ int cpdbGetMediaMargins(cpdb_printer_obj_t *printer_obj, const char *media_name,
  */
 void cpdbAcquireDetails(cpdb_printer_obj_t *printer_obj, cpdb_async_callback caller_cb, void *user_data);
 
+/**
+ * Asynchronously fetch the details and options of several printers,
+ * e.g. those visible when the dialog opens, as with cpdbAcquireDetails().
+ * At most max_per_backend calls to each backend are in flight at once,
+ * the others wait their turn. Once a call gets cancelled, e.g. with
+ * cpdbCancelPrinterCalls(), the remaining printers are dropped and
+ * neither callback gets called anymore.
+ *
+ * @param printers          Printer objects, referenced until done
+ * @param num_printers      Number of printers
+ * @param max_per_backend   Concurrent calls per backend,
+ *                          0 for CPDB_PREFETCH_CONCURRENCY
+ * @param printer_cb        Called as each printer is done, may be NULL
+ * @param done_cb           Called once all printers are done, may be NULL
+ * @param user_data         User data to pass to the callbacks
+ */
+void cpdbPrefetchDetails(cpdb_printer_obj_t **printers, int num_printers, int max_per_backend,
+                         cpdb_async_callback printer_cb, cpdb_prefetch_callback done_cb,
+                         void *user_data);
+
 /**
  * Asynchronously fetch all printer strings translations,
  * which can then be obtained using cpdbGet[...]Translation() functions.
@@ -751,17 +1356,34 @@ struct cpdb_settings_s
 {
     int count;
     GHashTable *table; /** [name] --> [value] **/
+    gint ref_count;
     // planned functions:
     //  serialize settings into a GVariant of type a(ss)
 };
 
 /**
- * Get a new empty settings object.
+ * Get a new empty settings object, with a reference count of 1.
  * 
  * @return                  Settings object
  */
 cpdb_settings_t *cpdbGetNewSettings();
 
+/**
+ * Take a reference to a settings object.
+ * 
+ * @param settings_obj      Settings object
+ *
+ * @return                  The settings object
+ */
+cpdb_settings_t *cpdbRefSettings(cpdb_settings_t *settings_obj);
+
+/**
+ * Drop a reference to a settings object, freeing it with the last one.
+ * 
+ * @param settings_obj      Settings object
+ */
+void cpdbUnrefSettings(cpdb_settings_t *settings_obj);
+
 /**
  * Copy settings from source to destination.
  * The previous values in dest will be overwritten.
@@ -813,7 +1435,7 @@ void cpdbSaveSettingsToDisk(cpdb_settings_t *settings_obj);
 cpdb_settings_t *cpdbReadSettingsFromDisk();
 
 /**
- * Free up a settings object.
+ * Drop a reference to a settings object, same as cpdbUnrefSettings().
  * 
  * @param settings_obj      Settings object
  */
@@ -830,17 +1452,145 @@ struct cpdb_options_s
     int media_count;
     GHashTable *table; /**[name] --> cpdb_option_t struct**/
     GHashTable *media; /**[name] --> cpdb_media_t struct**/
+    gint ref_count;
+
+    /** Options as sent by the backend, which the views borrow from,
+     * table and media are unpacked from them before the options
+     * are given to a printer **/
+    GVariant *option_variants;  /** a(sssia(s)), NULL if none **/
+    GVariant *media_variants;   /** a(siiia(iiii)), NULL if none **/
+    gint unpacked;
+
+    /** Backs the unpacked table and media, whose entries
+     * must not be freed on their own **/
+    cpdb_arena_t *arena;
+
+    /** The unpacked options in the order the backend sent them,
+     * with the options of a group moved next to its first one,
+     * the table points into it **/
+    cpdb_option_t *list;            /** count options, NULL until unpacked **/
+    cpdb_option_group_t *groups;    /** Ranges of list, by first appearance **/
+    int group_count;
 };
 
 /**
- * Get an empty cpdb_options_t struct with no 'options' in it
+ * Range of cpdb_options_t.list holding the options of a group
+ */
+struct cpdb_option_group_s {
+    const char *name;
+    int first;                      /** Index of its first option in list **/
+    int count;
+};
+
+/**
+ * Find the options of a group, for cpdbGetAllOptions() options.
+ *
+ * @param options           Options object
+ * @param group_name        Group name
+ *
+ * @return                  Range of options->list, belonging to the options
+ *                          object, NULL if the group has no options
+ */
+const cpdb_option_group_t *cpdbGetOptionGroup(const cpdb_options_t *options, const char *group_name);
+
+/**
+ * Borrowed view of an option, the strings belong to the options object
+ */
+typedef struct cpdb_option_view_s {
+    const char *option_name;
+    const char *group_name;
+    const char *default_value;
+    int num_supported;
+} cpdb_option_view_t;
+
+/**
+ * Borrowed view of a media, the name belongs to the options object
+ */
+typedef struct cpdb_media_view_s {
+    const char *name;
+    int width;
+    int length;
+    int num_margins;
+} cpdb_media_view_t;
+
+/**
+ * Get a view of an option straight from the backend reply, by index,
+ * e.g. to go through them all once.
+ *
+ * @param options           Options object
+ * @param index             Index of the option, from 0 to options->count - 1
+ * @param view              Filled in with the option
+ *
+ * @return                  FALSE if there is no such option, or the options
+ *                          weren't got from a backend
+ */
+gboolean cpdbGetOptionView(const cpdb_options_t *options, int index, cpdb_option_view_t *view);
+
+/**
+ * Get a supported value of an option view.
+ *
+ * @param options           Options object
+ * @param index             Index of the option
+ * @param choice            Index of the value, from 0 to num_supported - 1
+ *
+ * @return                  The value, belonging to the options object,
+ *                          NULL if there is no such value
+ */
+const char *cpdbGetOptionViewChoice(const cpdb_options_t *options, int index, int choice);
+
+/**
+ * Get a view of a media straight from the backend reply, by index.
+ *
+ * @param options           Options object
+ * @param index             Index of the media, from 0 to options->media_count - 1
+ * @param view              Filled in with the media
+ *
+ * @return                  FALSE if there is no such media, or the options
+ *                          weren't got from a backend
+ */
+gboolean cpdbGetMediaView(const cpdb_options_t *options, int index, cpdb_media_view_t *view);
+
+/**
+ * Get a margin of a media view.
+ *
+ * @param options           Options object
+ * @param index             Index of the media
+ * @param margin            Index of the margin, from 0 to num_margins - 1
+ * @param out               Filled in with the margin
+ *
+ * @return                  FALSE if there is no such margin
+ */
+gboolean cpdbGetMediaViewMargin(const cpdb_options_t *options, int index, int margin,
+                                cpdb_margin_t *out);
+
+/**
+ * Get an empty cpdb_options_t struct with no 'options' in it,
+ * with a reference count of 1. Its tables don't own their entries,
+ * the options and media of the library live in the options' arena.
  * 
  * @return                  Options object
  */
 cpdb_options_t *cpdbGetNewOptions();
 
 /**
- * Free up an options object.
+ * Take a reference to an options object. Options aren't changed
+ * once filled in, so they can be shared between threads.
+ * 
+ * @param options           Options object
+ *
+ * @return                  The options object
+ */
+cpdb_options_t *cpdbRefOptions(cpdb_options_t *options);
+
+/**
+ * Drop a reference to an options object, freeing it with the last one.
+ * 
+ * @param options           Options object
+ */
+void cpdbUnrefOptions(cpdb_options_t *options);
+
+/**
+ * Drop a reference to an options object, same as cpdbUnrefOptions().
  * 
  * @param options           Options object
  */
@@ -854,13 +1604,17 @@ ______________________________________ cpdb_option_t ___________________________
 struct cpdb_option_s
 {
     char *option_name;
-    char *group_name;
+    char *group_name;               /** Shared with the other options, like the supported values */
     int num_supported;
     char **supported_values;
     char *default_value;
 };
 
 /**
+ * Free up an option built on the heap by the caller, field by field.
+ * Never use it on the options of a cpdb_options_t object, they belong
+ * to the object and are freed with its last reference.
+ *
  * @param opt               Option object
  */
 void cpdbDeleteOption(cpdb_option_t *);
@@ -896,7 +1650,9 @@ struct cpdb_media_s
 };
 
 /**
- * Free up a media-size object.
+ * Free up a media-size object built on the heap by the caller. Never
+ * use it on the media of a cpdb_options_t object, they belong to the
+ * object and are freed with its last reference.
  * 
  * @param media             Media-size object
  */
@@ -48,6 +48,7 @@ const char *cpdbGroupTable[][2] = {
 };
 
 static void cpdbDebugLog(CpdbDebugLevel msg_lvl, const char *msg);
+static CpdbDebugLevel cpdbGetDebugLevel();
 
 const char *cpdbGetVersion()
 {
@@ -91,6 +92,217 @@ char *cpdbConcat(const char *s1, const char *s2)
     return s;
 }
 
+const char *cpdbInternString(const char *str)
+{
+    return g_intern_string(str);
+}
+
+#define CPDB_ARENA_BLOCK_SIZE 4096
+#define CPDB_ARENA_ALIGN(n) (((n) + 15) & ~((gsize) 15))
+
+typedef struct cpdb_arena_block_s {
+    struct cpdb_arena_block_s *next;
+    gsize size;
+    gsize used;
+} cpdb_arena_block_t;
+
+#define CPDB_ARENA_HEADER CPDB_ARENA_ALIGN(sizeof(cpdb_arena_block_t))
+
+struct cpdb_arena_s {
+    cpdb_arena_block_t *blocks; /** The first block is allocated from **/
+    gsize block_size;
+};
+
+cpdb_arena_t *cpdbNewArena(gsize block_size)
+{
+    cpdb_arena_t *arena;
+
+    arena = g_new0(cpdb_arena_t, 1);
+    arena->block_size = block_size ? block_size : CPDB_ARENA_BLOCK_SIZE;
+    return arena;
+}
+
+gpointer cpdbArenaAlloc(cpdb_arena_t *arena, gsize size)
+{
+    cpdb_arena_block_t *block;
+    gsize block_size;
+
+    if (arena == NULL)
+        return g_malloc0(size);
+
+    size = CPDB_ARENA_ALIGN(size);
+    block = arena->blocks;
+    if (block && block->size - block->used >= size)
+    {
+        block->used += size;
+        return (char *) block + CPDB_ARENA_HEADER + block->used - size;
+    }
+
+    /* Large allocations get a block of their own, which goes behind
+     * the current one so that its free space isn't thrown away */
+    block_size = MAX(size, arena->block_size);
+    block = g_malloc0(CPDB_ARENA_HEADER + block_size);
+    block->size = block_size;
+    block->used = size;
+    if (arena->blocks && size > arena->block_size / 4)
+    {
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+    }
+    else
+    {
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    return (char *) block + CPDB_ARENA_HEADER;
+}
+
+char *cpdbArenaStrdup(cpdb_arena_t *arena, const char *str)
+{
+    gsize len;
+    char *copy;
+
+    if (str == NULL)
+        return NULL;
+    if (arena == NULL)
+        return g_strdup(str);
+
+    len = strlen(str) + 1;
+    copy = cpdbArenaAlloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void cpdbFreeArena(cpdb_arena_t *arena)
+{
+    cpdb_arena_block_t *block, *next;
+
+    if (arena == NULL)
+        return;
+
+    for (block = arena->blocks; block; block = next)
+    {
+        next = block->next;
+        g_free(block);
+    }
+    g_free(arena);
+}
+
+static const struct {
+    const char *key;
+    const char *type;
+} cpdb_filter_keys[] = {
+    { CPDB_FILTER_ACCEPTING_JOBS,   "b" },
+    { CPDB_FILTER_STATE,            "s" },
+    { CPDB_FILTER_LOCATION_PREFIX,  "s" },
+    { CPDB_FILTER_MAKE_AND_MODEL,   "s" },
+    { CPDB_FILTER_COLOR,            "b" },
+};
+
+/* Type of the value of a filter key, NULL for unknown keys */
+static const char *cpdbGetFilterKeyType(const char *key)
+{
+    gsize i;
+
+    for (i = 0; i < G_N_ELEMENTS(cpdb_filter_keys); i++)
+    {
+        if (strcmp(key, cpdb_filter_keys[i].key) == 0)
+            return cpdb_filter_keys[i].type;
+    }
+    return NULL;
+}
+
+gboolean cpdbIsValidPrinterFilter(GVariant *filter)
+{
+    GVariantIter iter;
+    GVariant *value;
+    const char *type;
+    char *key;
+    gboolean valid = TRUE;
+
+    if (filter == NULL ||
+        !g_variant_is_of_type(filter, G_VARIANT_TYPE(CPDB_FILTER_ARGS)))
+        return FALSE;
+
+    g_variant_iter_init(&iter, filter);
+    while (valid && g_variant_iter_next(&iter, "{sv}", &key, &value))
+    {
+        type = cpdbGetFilterKeyType(key);
+        valid = type == NULL || g_variant_is_of_type(value, G_VARIANT_TYPE(type));
+        g_free(key);
+        g_variant_unref(value);
+    }
+    return valid;
+}
+
+static gboolean cpdbMatchFilterKey(const char *key,
+                                   GVariant *value,
+                                   const char *location,
+                                   const char *make_and_model,
+                                   const char *state,
+                                   gboolean accepting_jobs,
+                                   int color)
+{
+    const char *type;
+    gboolean match;
+    char *haystack, *needle;
+
+    /* Unknown keys are left to whoever knows them, known ones with
+     * the wrong type can't match anything */
+    if ((type = cpdbGetFilterKeyType(key)) == NULL)
+        return TRUE;
+    if (!g_variant_is_of_type(value, G_VARIANT_TYPE(type)))
+        return FALSE;
+
+    if (strcmp(key, CPDB_FILTER_ACCEPTING_JOBS) == 0)
+        return !accepting_jobs == !g_variant_get_boolean(value);
+    if (strcmp(key, CPDB_FILTER_COLOR) == 0)
+        return color >= 0 && !color == !g_variant_get_boolean(value);
+    if (strcmp(key, CPDB_FILTER_STATE) == 0)
+        return g_strcmp0(state, g_variant_get_string(value, NULL)) == 0;
+    if (strcmp(key, CPDB_FILTER_LOCATION_PREFIX) == 0)
+        return g_str_has_prefix(location ? location : "",
+                                g_variant_get_string(value, NULL));
+    if (strcmp(key, CPDB_FILTER_MAKE_AND_MODEL) == 0)
+    {
+        haystack = g_ascii_strdown(make_and_model ? make_and_model : "", -1);
+        needle = g_ascii_strdown(g_variant_get_string(value, NULL), -1);
+        match = strstr(haystack, needle) != NULL;
+        g_free(haystack);
+        g_free(needle);
+        return match;
+    }
+    return TRUE;
+}
+
+gboolean cpdbMatchPrinterFilter(GVariant *filter,
+                                const char *location,
+                                const char *make_and_model,
+                                const char *state,
+                                gboolean accepting_jobs,
+                                int color)
+{
+    GVariantIter iter;
+    GVariant *value;
+    char *key;
+    gboolean match = TRUE;
+
+    if (filter == NULL)
+        return TRUE;
+    if (!g_variant_is_of_type(filter, G_VARIANT_TYPE(CPDB_FILTER_ARGS)))
+        return FALSE;
+
+    g_variant_iter_init(&iter, filter);
+    while (match && g_variant_iter_next(&iter, "{sv}", &key, &value))
+    {
+        match = cpdbMatchFilterKey(key, value, location, make_and_model,
+                                   state, accepting_jobs, color);
+        g_free(key);
+        g_variant_unref(value);
+    }
+    return match;
+}
+
 char *cpdbConcatSep(const char *s1, const char *s2)
 {
     char *s = malloc(strlen(s1) + strlen(s2) + 2);
@@ -303,26 +515,30 @@ char *cpdbGetGroupTranslation2(const char *group_name, const char *lang)
     return g_strdup(_(group_name));
 }
 
-static void cpdbDebugLog(CpdbDebugLevel msg_lvl, const char *msg)
+static CpdbDebugLevel cpdbGetDebugLevel()
 {
-    FILE *log_file = NULL, *out;
-    char *env_cdl, *env_cdlf;
-    CpdbDebugLevel dbg_lvl;
+    char *env_cdl;
 
-    if (msg == NULL)
-        return;
-
-    dbg_lvl = CPDB_DEBUG_LEVEL_ERROR;
     if (env_cdl = getenv(CPDB_DEBUG_LEVEL))
     {
 		if (strncasecmp(env_cdl, "debug", 5) == 0)
-			dbg_lvl = CPDB_DEBUG_LEVEL_DEBUG;
+			return CPDB_DEBUG_LEVEL_DEBUG;
         else if (strncasecmp(env_cdl, "info", 4) == 0)
-            dbg_lvl = CPDB_DEBUG_LEVEL_INFO;
+            return CPDB_DEBUG_LEVEL_INFO;
         else if (strncasecmp(env_cdl, "warn", 4) == 0)
-            dbg_lvl = CPDB_DEBUG_LEVEL_WARN;
+            return CPDB_DEBUG_LEVEL_WARN;
     }
-    if (msg_lvl < dbg_lvl)
+    return CPDB_DEBUG_LEVEL_ERROR;
+}
+
+static void cpdbDebugLog(CpdbDebugLevel msg_lvl, const char *msg)
+{
+    FILE *log_file = NULL, *out;
+    char *env_cdlf;
+
+    if (msg == NULL)
+        return;
+    if (msg_lvl < cpdbGetDebugLevel())
 		return;
     
     out = stderr;
@@ -353,6 +569,10 @@ void cpdbFDebugPrintf(CpdbDebugLevel msg_lvl, const char *fmt, ...)
 {
     va_list argptr;
 	char buf[CPDB_BSIZE], msg[CPDB_BSIZE + 12];
+
+    /* Don't format messages nobody gets to see */
+    if (msg_lvl < cpdbGetDebugLevel())
+        return;
 	
 	va_start(argptr, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, argptr);
@@ -367,6 +587,9 @@ void cpdbBDebugPrintf(CpdbDebugLevel msg_lvl, const char *backend_name,
 {
     va_list argptr;
 	char buf[CPDB_BSIZE], msg[CPDB_BSIZE + 12];
+
+    if (msg_lvl < cpdbGetDebugLevel())
+        return;
 	
 	va_start(argptr, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, argptr);
@@ -45,6 +45,16 @@ extern "C" {
 #define CPDB_JOB_ARGS "(ssssssi)"
 #define CPDB_JOB_ARRAY_ARGS "a(ssssssi)"
 
+/* Printer filters, evaluated by the backends before listing printers.
+ * Each key narrows the listing, unknown keys are ignored. Known keys
+ * with a value of another type than noted below make a filter invalid. */
+#define CPDB_FILTER_ARGS "a{sv}"
+#define CPDB_FILTER_ACCEPTING_JOBS  "accepting-jobs"    /* b */
+#define CPDB_FILTER_STATE           "state"             /* s, e.g. "idle" */
+#define CPDB_FILTER_LOCATION_PREFIX "location-prefix"   /* s */
+#define CPDB_FILTER_MAKE_AND_MODEL  "make-and-model"    /* s, matched anywhere, ignoring case */
+#define CPDB_FILTER_COLOR           "color"             /* b */
+
 typedef enum {
     CPDB_DEBUG_LEVEL_DEBUG,
     CPDB_DEBUG_LEVEL_INFO,
@@ -73,6 +83,79 @@ char **cpdbNewCStringArray(int num_elems);
  */
 gboolean cpdbGetBoolean(const char *);
 
+/**
+ * Get the canonical copy of a string from a process wide pool.
+ * Equal strings give the same pointer, which must not be freed.
+ * The pool never shrinks, so it is only meant for small closed sets
+ * of strings, like printer states and backend names.
+ * Thread-safe, NULL gives NULL.
+ */
+const char *cpdbInternString(const char *str);
+
+/**
+ * Bump allocator for data which is freed all at once.
+ * Not thread-safe, a NULL arena allocates on the heap instead.
+ */
+typedef struct cpdb_arena_s cpdb_arena_t;
+
+/**
+ * Get a new empty arena.
+ *
+ * @param block_size        Size of the blocks the arena allocates from,
+ *                          0 for the default
+ *
+ * @return                  Arena, to be freed with cpdbFreeArena()
+ */
+cpdb_arena_t *cpdbNewArena(gsize block_size);
+
+/**
+ * Allocate zeroed memory from an arena, or from the heap if arena is NULL.
+ * Memory from an arena must not be freed on its own.
+ *
+ * @param arena             Arena
+ * @param size              Size in bytes
+ */
+gpointer cpdbArenaAlloc(cpdb_arena_t *arena, gsize size);
+
+/**
+ * Copy a string into an arena, or onto the heap if arena is NULL.
+ * NULL gives NULL.
+ */
+char *cpdbArenaStrdup(cpdb_arena_t *arena, const char *str);
+
+/**
+ * Free an arena along with everything allocated from it.
+ */
+void cpdbFreeArena(cpdb_arena_t *arena);
+
+/**
+ * Check whether a filter is of type CPDB_FILTER_ARGS and its known
+ * CPDB_FILTER_* keys have values of the right type.
+ *
+ * @param filter            Filter
+ */
+gboolean cpdbIsValidPrinterFilter(GVariant *filter);
+
+/**
+ * Check whether a printer matches a filter, a dictionary of
+ * CPDB_FILTER_* keys. A NULL filter matches every printer, an invalid
+ * one none.
+ *
+ * @param filter            Filter of type CPDB_FILTER_ARGS
+ * @param location          Printer location
+ * @param make_and_model    Printer make and model
+ * @param state             Printer state
+ * @param accepting_jobs    Whether the printer accepts jobs
+ * @param color             1 if the printer prints in color, 0 if it doesn't,
+ *                          -1 if unknown, which matches no color filter
+ */
+gboolean cpdbMatchPrinterFilter(GVariant *filter,
+                                const char *location,
+                                const char *make_and_model,
+                                const char *state,
+                                gboolean accepting_jobs,
+                                int color);
+
 /**
  * Concatenate two strings.
  */
@@ -248,6 +331,7 @@ GVariant *cpdbPackMediaArray(int num_val, int (*margins)[4]);
 #define CPDB_SIGNAL_PRINTER_ADDED "PrinterAdded"
 #define CPDB_SIGNAL_PRINTER_STATE_CHANGED "PrinterStateChanged"
 #define CPDB_SIGNAL_PRINTER_REMOVED "PrinterRemoved"
+#define CPDB_SIGNAL_PRINTERS_CHANGED "PrintersChanged"
 #define CPDB_SIGNAL_HIDE_REMOTE "HideRemotePrinters"
 #define CPDB_SIGNAL_UNHIDE_REMOTE "UnhideRemotePrinters"
 #define CPDB_SIGNAL_HIDE_TEMP "HideTemporaryPrinters"
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cpdb/frontend.h>
+
+/* Compares looking up printers by a "id#backend" string, the way the
+ * printer table used to be keyed, with looking them up by a
+ * cpdb_printer_key_t on the stack. */
+
+#define NUM_BACKENDS 3
+
+static const char *backends[NUM_BACKENDS] = { "CUPS", "FILE", "GCP" };
+
+static double benchConcatKey(char **ids, int num_printers, int rounds)
+{
+    GHashTable *table;
+    gint64 start;
+    char *key;
+    int i, r, found = 0;
+
+    table = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    for (i = 0; i < num_printers; i++)
+        g_hash_table_insert(table,
+                            cpdbConcatSep(ids[i], backends[i % NUM_BACKENDS]),
+                            ids[i]);
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++)
+    {
+        for (i = 0; i < num_printers; i++)
+        {
+            key = cpdbConcatSep(ids[i], backends[i % NUM_BACKENDS]);
+            if (g_hash_table_lookup(table, key))
+                found++;
+            free(key);
+        }
+    }
+    start = g_get_monotonic_time() - start;
+
+    g_hash_table_destroy(table);
+    if (found != num_printers * rounds)
+        fprintf(stderr, "Concatenated key: found %d of %d\n", found, num_printers * rounds);
+    return start * 1000.0 / ((double) num_printers * rounds);
+}
+
+static double benchPrinterKey(char **ids, int num_printers, int rounds)
+{
+    GHashTable *table;
+    cpdb_printer_key_t *keys, key;
+    gint64 start;
+    int i, r, found = 0;
+
+    table = g_hash_table_new(cpdbPrinterKeyHash, cpdbPrinterKeyEqual);
+    keys = g_new(cpdb_printer_key_t, num_printers);
+    for (i = 0; i < num_printers; i++)
+    {
+        cpdbInitPrinterKey(&keys[i], ids[i], backends[i % NUM_BACKENDS]);
+        g_hash_table_insert(table, &keys[i], ids[i]);
+    }
+
+    start = g_get_monotonic_time();
+    for (r = 0; r < rounds; r++)
+    {
+        for (i = 0; i < num_printers; i++)
+        {
+            cpdbInitPrinterKey(&key, ids[i], backends[i % NUM_BACKENDS]);
+            if (g_hash_table_lookup(table, &key))
+                found++;
+        }
+    }
+    start = g_get_monotonic_time() - start;
+
+    g_hash_table_destroy(table);
+    g_free(keys);
+    if (found != num_printers * rounds)
+        fprintf(stderr, "Printer key: found %d of %d\n", found, num_printers * rounds);
+    return start * 1000.0 / ((double) num_printers * rounds);
+}
+
+int main(int argc, char **argv)
+{
+    int num_printers = 3000, rounds = 200, i;
+    double concat_ns, key_ns;
+    char **ids;
+
+    if (argc > 1)
+        num_printers = atoi(argv[1]);
+    if (argc > 2)
+        rounds = atoi(argv[2]);
+    if (num_printers <= 0 || rounds <= 0)
+    {
+        printf("Usage : %s [num_printers] [rounds]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    ids = g_new(char *, num_printers);
+    for (i = 0; i < num_printers; i++)
+        ids[i] = g_strdup_printf("printer-%d-on-some-print-server", i);
+
+    concat_ns = benchConcatKey(ids, num_printers, rounds);
+    key_ns = benchPrinterKey(ids, num_printers, rounds);
+    printf("%d printers, %d rounds\n", num_printers, rounds);
+    printf("  \"id#backend\" key    : %8.1f ns/lookup\n", concat_ns);
+    printf("  cpdb_printer_key_t  : %8.1f ns/lookup\n", key_ns);
+    printf("  speedup             : %8.2fx\n", concat_ns / key_ns);
+
+    for (i = 0; i < num_printers; i++)
+        g_free(ids[i]);
+    g_free(ids);
+    return 0;
+}
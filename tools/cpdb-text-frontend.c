@@ -197,14 +197,14 @@ gpointer control_thread(gpointer user_data)
             cpdb_options_t *opts = cpdbGetAllOptions(p);
 
             printf("Retrieved %d options.\n", opts->count);
-            GHashTableIter iter;
-            gpointer value;
-
-            g_hash_table_iter_init(&iter, opts->table);
-            while (g_hash_table_iter_next(&iter, NULL, &value))
+            for (int g = 0; g < opts->group_count; g++)
             {
-                printOption(value);
+                const cpdb_option_group_t *group = &opts->groups[g];
+
+                for (int i = group->first; i < group->first + group->count; i++)
+                    printOption(&opts->list[i]);
             }
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-all-media") == 0)
         {
@@ -231,6 +231,7 @@ gpointer control_thread(gpointer user_data)
             {
                 printMedia(value);
             }
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-default") == 0)
         {
@@ -248,6 +249,7 @@ gpointer control_thread(gpointer user_data)
                 printf("cpdb_option_t %s doesn't exist.", option_name);
             else
                 printf("Default : %s\n", ans);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-setting") == 0)
         {
@@ -264,6 +266,7 @@ gpointer control_thread(gpointer user_data)
                 printf("Setting %s doesn't exist.\n", setting_name);
             else
                 printf("Setting value : %s\n", ans);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-current") == 0)
         {
@@ -280,6 +283,7 @@ gpointer control_thread(gpointer user_data)
                 printf("cpdb_option_t %s doesn't exist.", option_name);
             else
                 printf("Current value : %s\n", ans);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "add-setting") == 0)
         {
@@ -293,6 +297,7 @@ gpointer control_thread(gpointer user_data)
             }
             printf("%s : %s\n", option_name, option_val);
             cpdbAddSettingToPrinter(p, g_strdup(option_name), g_strdup(option_val));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "clear-setting") == 0)
         {
@@ -305,6 +310,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             cpdbClearSettingFromPrinter(p, option_name);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-state") == 0)
         {
@@ -318,6 +324,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             printf("%s\n", cpdbGetState(p));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "is-accepting-jobs") == 0)
         {
@@ -331,6 +338,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             printf("Accepting jobs ? : %d \n", cpdbIsAcceptingJobs(p));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "help") == 0)
         {
@@ -347,6 +355,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             print_backend_call_ping_sync(p->backend_proxy, p->id, NULL, NULL);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-default-printer") == 0)
         {
@@ -355,6 +364,7 @@ gpointer control_thread(gpointer user_data)
                 printf("%s#%s\n", p->name, p->backend_name);
             else
                 printf("No default printer found\n");
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-default-printer-for-backend") == 0)
         {
@@ -369,6 +379,7 @@ gpointer control_thread(gpointer user_data)
                 printf("%s\n", p->name);
             else
                 printf("No default printer for backend found\n");
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "set-user-default-printer") == 0)
         {
@@ -387,6 +398,7 @@ gpointer control_thread(gpointer user_data)
             {
                 puts(MESSAGE_PRINTER_NOT_FOUND);
             }
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "set-system-default-printer") == 0)
         {
@@ -405,6 +417,7 @@ gpointer control_thread(gpointer user_data)
             {
                 puts(MESSAGE_PRINTER_NOT_FOUND);
             }
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "print-file") == 0)
         {
@@ -421,6 +434,7 @@ gpointer control_thread(gpointer user_data)
             }
             cpdbAddSettingToPrinter(p, "copies", "3");
             cpdbPrintFile(p, file_path);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "pickle-printer") == 0)
         {
@@ -435,6 +449,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             cpdbPicklePrinterToFile(p, "/tmp/.printer-pickle", f);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-option-translation") == 0)
         {
@@ -449,6 +464,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             printf("%s\n", cpdbGetOptionTranslation(p, option_name, locale));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-choice-translation") == 0)
         {
@@ -464,6 +480,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             printf("%s\n", cpdbGetChoiceTranslation(p, option_name, choice_name, locale));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-group-translation") == 0)
         {
@@ -478,6 +495,7 @@ gpointer control_thread(gpointer user_data)
                 continue;
             }
             printf("%s\n", cpdbGetGroupTranslation(p, group_name, locale));
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-all-translations") == 0)
         {
@@ -492,6 +510,7 @@ gpointer control_thread(gpointer user_data)
             }
             cpdbGetAllTranslations(p, locale);
             printTranslations(p);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-media-size") == 0)
         {
@@ -509,6 +528,7 @@ gpointer control_thread(gpointer user_data)
             int ok = cpdbGetMediaSize(p, media, &width, &length);
             if (ok)
                 printf("%dx%d\n", width, length);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "get-media-margins") == 0)
         {
@@ -527,6 +547,7 @@ gpointer control_thread(gpointer user_data)
             int num_margins = cpdbGetMediaMargins(p, media, &margins);
             for (int i = 0; i < num_margins; i++)
                 printf("%d %d %d %d\n", margins[i].left, margins[i].right, margins[i].top, margins[i].bottom);
+            cpdbUnrefPrinterObj(p);
         }
         else if (strcmp(buf, "acquire-details") == 0)
         {
@@ -543,6 +564,7 @@ gpointer control_thread(gpointer user_data)
 
             g_message("Acquiring printer details asynchronously...\n");
             cpdbAcquireDetails(p, acquire_details_callback, NULL);
+            cpdbUnrefPrinterObj(p);
 	}
         else if (strcmp(buf, "acquire-translations") == 0)
         {
@@ -559,6 +581,7 @@ gpointer control_thread(gpointer user_data)
 
             g_message("Acquiring printer translations asynchronously...\n");
             cpdbAcquireTranslations(p, locale, acquire_translations_callback, NULL);
+            cpdbUnrefPrinterObj(p);
         }
     }
     
@@ -0,0 +1,680 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* Built together with the library source, so that internals like the
+ * option grouping can be checked without a backend */
+#include <cpdb/cpdb-frontend.c>
+
+/* Unit tests of the frontend library which don't need a bus or any
+ * backend. Printers get added to a frontend instance directly, with a
+ * stand-in for their backend proxy which is never called. */
+
+#define TEST_BACKEND "TEST"
+
+static cpdb_frontend_obj_t *newTestFrontend(void)
+{
+    cpdb_frontend_obj_t *f = cpdbGetNewFrontendObj(NULL);
+
+    g_hash_table_insert(f->backend, g_strdup(TEST_BACKEND),
+                        g_object_new(G_TYPE_OBJECT, NULL));
+    f->num_backends++;
+    return f;
+}
+
+static cpdb_printer_obj_t *addTestPrinter(cpdb_frontend_obj_t *f,
+                                          const char *id,
+                                          const char *name,
+                                          const char *info,
+                                          const char *location,
+                                          const char *make_and_model)
+{
+    cpdb_printer_obj_t *p = cpdbGetNewPrinterObj();
+
+    p->id = g_strdup(id);
+    p->name = g_strdup(name);
+    p->info = g_strdup(info);
+    p->location = g_strdup(location);
+    p->make_and_model = g_strdup(make_and_model);
+    p->backend_name = (char *) cpdbInternString(TEST_BACKEND);
+    p->state = (char *) cpdbInternString(CPDB_STATE_IDLE);
+    p->accepting_jobs = TRUE;
+    g_assert_true(cpdbAddPrinter(f, p));
+    return p;
+}
+
+static cpdb_frontend_obj_t *newSearchFrontend(void)
+{
+    cpdb_frontend_obj_t *f = newTestFrontend();
+
+    addTestPrinter(f, "a", "Office Laser", "Second floor", "Building 1", "HP LaserJet 4000");
+    addTestPrinter(f, "b", "Lab Color", "Laser lab", "Room 101", "Canon ImageRunner");
+    addTestPrinter(f, "c", "Reception", "Front desk", "Lobby", "Brother Multilaser 200");
+    return f;
+}
+
+/* Search and compare the ids of the results with a space separated list */
+static void assertSearch(cpdb_frontend_obj_t *f,
+                         const char *query,
+                         cpdb_search_mode_t mode,
+                         int limit,
+                         const char *expected)
+{
+    cpdb_printer_obj_t **printers;
+    GString *ids = g_string_new(NULL);
+    int i, n;
+
+    printers = cpdbSearchPrinters(f, query, mode, limit, &n);
+    g_assert_nonnull(printers);
+    for (i = 0; printers[i]; i++)
+        g_string_append_printf(ids, "%s%s", i ? " " : "", printers[i]->id);
+    g_assert_cmpint(i, ==, n);
+    g_assert_cmpstr(ids->str, ==, expected);
+
+    g_string_free(ids, TRUE);
+    cpdbUnrefPrinterArray(printers);
+}
+
+static void testSearchPrefix(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+
+    /* Name start, then a word of the name, then a word of another field */
+    assertSearch(f, "off", CPDB_SEARCH_PREFIX, 0, "a");
+    assertSearch(f, "laser", CPDB_SEARCH_PREFIX, 0, "a b");
+    /* Never inside a word */
+    assertSearch(f, "aser", CPDB_SEARCH_PREFIX, 0, "");
+    /* Every word has to match, whatever the case */
+    assertSearch(f, "LAB laser", CPDB_SEARCH_PREFIX, 0, "b");
+    assertSearch(f, "lab reception", CPDB_SEARCH_PREFIX, 0, "");
+    assertSearch(f, " ,. ", CPDB_SEARCH_PREFIX, 0, "");
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testSearchSubstring(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+
+    /* Matches inside words come last */
+    assertSearch(f, "laser", CPDB_SEARCH_SUBSTRING, 0, "a b c");
+    assertSearch(f, "aser", CPDB_SEARCH_SUBSTRING, 0, "b a c");
+    assertSearch(f, "laser", CPDB_SEARCH_SUBSTRING, 1, "a");
+    assertSearch(f, "xyz", CPDB_SEARCH_SUBSTRING, 0, "");
+    /* Too short for a trigram, so all printers get checked */
+    assertSearch(f, "la", CPDB_SEARCH_SUBSTRING, 0, "b a c");
+    assertSearch(f, "la 10", CPDB_SEARCH_SUBSTRING, 0, "b");
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testSearchRemoved(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+    cpdb_printer_obj_t *p;
+
+    assertSearch(f, "imagerunner", CPDB_SEARCH_SUBSTRING, 0, "b");
+    p = cpdbRemovePrinter(f, "b", TEST_BACKEND);
+    g_assert_nonnull(p);
+    cpdbDeletePrinterObj(p);
+    assertSearch(f, "imagerunner", CPDB_SEARCH_SUBSTRING, 0, "");
+    assertSearch(f, "lab", CPDB_SEARCH_PREFIX, 0, "");
+
+    addTestPrinter(f, "d", "Lab Mono", "", "", "Canon ImageRunner");
+    assertSearch(f, "imagerunner", CPDB_SEARCH_SUBSTRING, 0, "d");
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testRegistryReplace(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+    cpdb_printer_obj_t *old, *p;
+
+    old = cpdbRefPrinterObj(cpdbLookupPrinter(f, "b", TEST_BACKEND));
+    p = addTestPrinter(f, "b", "Lab Mono", "", "", "");
+    g_assert_cmpint(f->num_printers, ==, 3);
+    g_assert_true(cpdbLookupPrinter(f, "b", TEST_BACKEND) == p);
+    /* Only our reference to the replaced printer is left */
+    g_assert_cmpint(old->ref_count, ==, 1);
+    cpdbUnrefPrinterObj(old);
+    assertSearch(f, "lab", CPDB_SEARCH_PREFIX, 0, "b");
+    assertSearch(f, "color", CPDB_SEARCH_PREFIX, 0, "");
+
+    /* Adding the same printer again changes nothing */
+    g_assert_true(cpdbAddPrinter(f, p));
+    g_assert_cmpint(f->num_printers, ==, 3);
+    g_assert_cmpint(p->ref_count, ==, 1);
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testRegistryRename(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+    cpdb_printer_record_t record = {
+        .id = "a",
+        .name = "Office Mono",
+        .info = "Second floor",
+        .location = "Building 1",
+        .make_and_model = "HP LaserJet 4000",
+        .accepting_jobs = TRUE,
+        .state = CPDB_STATE_IDLE,
+        .backend_name = TEST_BACKEND,
+    };
+    cpdb_printer_obj_t *p;
+    const char *old_name;
+
+    p = cpdbRefPrinterObj(cpdbLookupPrinter(f, "a", TEST_BACKEND));
+    old_name = p->name;
+    cpdbLockRegistry(f);
+    g_assert_true(cpdbMergePrinter(f, &record, FALSE) == p);
+    cpdbUnlockRegistry(f);
+
+    /* Whoever read the old name can still use it */
+    g_assert_cmpstr(p->name, ==, "Office Mono");
+    g_assert_cmpstr(old_name, ==, "Office Laser");
+    assertSearch(f, "mono", CPDB_SEARCH_PREFIX, 0, "a");
+    assertSearch(f, "office laser", CPDB_SEARCH_PREFIX, 0, "");
+
+    cpdbDeleteFrontendObj(f);
+    g_assert_cmpstr(old_name, ==, "Office Laser");
+    cpdbUnrefPrinterObj(p);
+}
+
+static int num_added;
+
+static void countAdded(cpdb_frontend_obj_t *f,
+                       cpdb_printer_obj_t *p,
+                       cpdb_printer_update_t change)
+{
+    if (change == CPDB_CHANGE_PRINTER_ADDED)
+        num_added++;
+}
+
+/* Printers the background thread adds are reported from the main
+ * context which started it */
+static void testRegistryBackground(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+    cpdb_printer_record_t record = {
+        .id = "d",
+        .name = "Basement Plotter",
+        .info = "",
+        .location = "",
+        .make_and_model = "",
+        .accepting_jobs = TRUE,
+        .state = CPDB_STATE_IDLE,
+        .backend_name = TEST_BACKEND,
+    };
+
+    while (g_main_context_iteration(NULL, FALSE));
+    f->printer_cb = countAdded;
+    num_added = 0;
+    f->callback_context = g_main_context_ref_thread_default();
+    f->background_context = g_main_context_new();
+
+    g_main_context_push_thread_default(f->background_context);
+    cpdbLockRegistry(f);
+    g_assert_nonnull(cpdbMergePrinter(f, &record, TRUE));
+    cpdbUnlockRegistry(f);
+    g_main_context_pop_thread_default(f->background_context);
+    g_assert_cmpint(num_added, ==, 0);
+    assertSearch(f, "plotter", CPDB_SEARCH_PREFIX, 0, "d");
+
+    while (g_main_context_iteration(NULL, FALSE));
+    g_assert_cmpint(num_added, ==, 1);
+
+    g_main_context_unref(f->background_context);
+    f->background_context = NULL;
+    cpdbDeleteFrontendObj(f);
+}
+
+static gboolean matchFilter(const char *filter_text,
+                            const char *location,
+                            const char *make_and_model,
+                            const char *state,
+                            gboolean accepting_jobs,
+                            int color)
+{
+    GVariant *filter;
+    gboolean match;
+
+    filter = g_variant_ref_sink(g_variant_new_parsed(filter_text));
+    match = cpdbMatchPrinterFilter(filter, location, make_and_model,
+                                   state, accepting_jobs, color);
+    g_variant_unref(filter);
+    return match;
+}
+
+static gboolean validFilter(const char *filter_text)
+{
+    GVariant *filter;
+    gboolean valid;
+
+    filter = g_variant_ref_sink(g_variant_new_parsed(filter_text));
+    valid = cpdbIsValidPrinterFilter(filter);
+    g_variant_unref(filter);
+    return valid;
+}
+
+static void testFilterMatch(void)
+{
+    g_assert_true(cpdbMatchPrinterFilter(NULL, NULL, NULL, NULL, FALSE, -1));
+    g_assert_true(matchFilter("@a{sv} {}", NULL, NULL, NULL, FALSE, -1));
+
+    g_assert_true(matchFilter("{'accepting-jobs': <true>}", "", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'accepting-jobs': <true>}", "", "", "idle", FALSE, -1));
+    g_assert_true(matchFilter("{'state': <'idle'>}", "", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'state': <'idle'>}", "", "", "stopped", TRUE, -1));
+    g_assert_true(matchFilter("{'location-prefix': <'Building'>}", "Building 1", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'location-prefix': <'Building'>}", "Old Building", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'location-prefix': <'Building'>}", NULL, "", "idle", TRUE, -1));
+    g_assert_true(matchFilter("{'make-and-model': <'laserjet'>}", "", "HP LaserJet 4000", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'make-and-model': <'inkjet'>}", "", "HP LaserJet 4000", "idle", TRUE, -1));
+
+    /* Every key has to match */
+    g_assert_true(matchFilter("{'state': <'idle'>, 'accepting-jobs': <true>}",
+                              "", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'state': <'idle'>, 'accepting-jobs': <false>}",
+                               "", "", "idle", TRUE, -1));
+}
+
+static void testFilterColor(void)
+{
+    g_assert_true(matchFilter("{'color': <true>}", "", "", "idle", TRUE, 1));
+    g_assert_false(matchFilter("{'color': <true>}", "", "", "idle", TRUE, 0));
+    g_assert_true(matchFilter("{'color': <false>}", "", "", "idle", TRUE, 0));
+    /* Printers of unknown color match neither way */
+    g_assert_false(matchFilter("{'color': <true>}", "", "", "idle", TRUE, -1));
+    g_assert_false(matchFilter("{'color': <false>}", "", "", "idle", TRUE, -1));
+}
+
+static void testFilterInvalid(void)
+{
+    cpdb_frontend_obj_t *f;
+    GVariant *filter;
+    int n = -1;
+
+    /* Unknown keys are ignored, known ones of the wrong type never match */
+    g_assert_true(validFilter("{'duplex': <true>}"));
+    g_assert_true(matchFilter("{'duplex': <true>}", "", "", "idle", TRUE, -1));
+    g_assert_false(validFilter("{'accepting-jobs': <'yes'>}"));
+    g_assert_false(matchFilter("{'accepting-jobs': <'yes'>}", "", "", "idle", TRUE, -1));
+    g_assert_false(validFilter("{'state': <1>}"));
+    g_assert_false(validFilter("{'state': 'idle'}"));
+    g_assert_false(cpdbIsValidPrinterFilter(NULL));
+
+    f = newTestFrontend();
+    filter = g_variant_new_parsed("{'color': <1>}");
+    g_assert_null(cpdbGetMatchingPrinters(f, filter, &n));
+    g_assert_cmpint(n, ==, 0);
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testArenaSmall(void)
+{
+    cpdb_arena_t *arena = cpdbNewArena(64);
+    guchar *chunks[40];
+    gsize size;
+    int i, j;
+
+    /* A few allocations fill a block, the next ones spill into new ones */
+    for (i = 0; i < 40; i++)
+    {
+        size = i % 20 + 1;
+        chunks[i] = cpdbArenaAlloc(arena, size);
+        g_assert_nonnull(chunks[i]);
+        g_assert_cmpuint(GPOINTER_TO_SIZE(chunks[i]) % 16, ==, 0);
+        for (j = 0; j < (int) size; j++)
+            g_assert_cmpuint(chunks[i][j], ==, 0);
+        memset(chunks[i], i + 1, size);
+    }
+    /* None of them overlap */
+    for (i = 0; i < 40; i++)
+    {
+        size = i % 20 + 1;
+        for (j = 0; j < (int) size; j++)
+            g_assert_cmpuint(chunks[i][j], ==, i + 1);
+    }
+
+    cpdbFreeArena(arena);
+}
+
+static void testArenaLarge(void)
+{
+    cpdb_arena_t *arena = cpdbNewArena(64);
+    guchar *small, *large, *after;
+    int i;
+
+    small = cpdbArenaAlloc(arena, 8);
+    memset(small, 0x11, 8);
+
+    /* Bigger than the blocks, so it gets a block of its own */
+    large = cpdbArenaAlloc(arena, 1000);
+    g_assert_cmpuint(GPOINTER_TO_SIZE(large) % 16, ==, 0);
+    for (i = 0; i < 1000; i++)
+        g_assert_cmpuint(large[i], ==, 0);
+    memset(large, 0x22, 1000);
+
+    /* The free space of the current block is still used afterwards */
+    after = cpdbArenaAlloc(arena, 8);
+    g_assert_cmpuint(GPOINTER_TO_SIZE(after) % 16, ==, 0);
+    for (i = 0; i < 8; i++)
+        g_assert_cmpuint(after[i], ==, 0);
+    memset(after, 0x33, 8);
+
+    for (i = 0; i < 8; i++)
+        g_assert_cmpuint(small[i], ==, 0x11);
+    for (i = 0; i < 1000; i++)
+        g_assert_cmpuint(large[i], ==, 0x22);
+
+    cpdbFreeArena(arena);
+}
+
+static void testArenaStrdup(void)
+{
+    cpdb_arena_t *arena = cpdbNewArena(0);
+    char *copy;
+
+    copy = cpdbArenaStrdup(arena, "Office Laser");
+    g_assert_cmpstr(copy, ==, "Office Laser");
+    g_assert_cmpuint(GPOINTER_TO_SIZE(copy) % 16, ==, 0);
+    g_assert_null(cpdbArenaStrdup(arena, NULL));
+    g_assert_cmpstr(cpdbArenaStrdup(arena, ""), ==, "");
+    cpdbFreeArena(arena);
+
+    /* Without an arena they come from the heap */
+    copy = cpdbArenaStrdup(NULL, "Lab Color");
+    g_assert_cmpstr(copy, ==, "Lab Color");
+    g_free(copy);
+    copy = cpdbArenaAlloc(NULL, 4);
+    g_assert_cmpint(copy[0] | copy[1] | copy[2] | copy[3], ==, 0);
+    g_free(copy);
+}
+
+static cpdb_options_t *newTestOptions(const char *reply_text)
+{
+    cpdb_options_t *options;
+    GVariant *reply;
+
+    reply = g_variant_ref_sink(g_variant_new_parsed(reply_text));
+    g_assert_true(g_variant_is_of_type(reply,
+                                       G_VARIANT_TYPE(CPDB_ALL_OPTIONS_REPLY_ARGS)));
+    options = cpdbOptionsFromReply(reply);
+    g_variant_unref(reply);
+    cpdbEnsureOptionTables(options);
+    return options;
+}
+
+static void testOptionGroups(void)
+{
+    cpdb_options_t *options;
+    const cpdb_option_group_t *group;
+    static const char *order[] = {
+        "copies", "media", "sides", "number-up", "print-color-mode",
+    };
+    int i;
+
+    options = newTestOptions(
+        "(5, [('copies', 'General', '1', 0, @a(s) []),"
+        "     ('sides', 'Layout', 'one-sided', 2,"
+        "      [('one-sided',), ('two-sided-long-edge',)]),"
+        "     ('media', 'General', 'iso_a4_210x297mm', 1,"
+        "      [('iso_a4_210x297mm',)]),"
+        "     ('print-color-mode', 'Color', 'color', 2,"
+        "      [('color',), ('monochrome',)]),"
+        "     ('number-up', 'Layout', '1', 2, [('1',), ('2',)])],"
+        " 1, [('iso_a4_210x297mm', 21000, 29700, 1, [(0, 0, 0, 0)])])");
+
+    /* Each group is contiguous, groups keep their first appearance order */
+    g_assert_cmpint(options->count, ==, 5);
+    for (i = 0; i < 5; i++)
+        g_assert_cmpstr(options->list[i].option_name, ==, order[i]);
+    g_assert_cmpint(options->group_count, ==, 3);
+
+    group = cpdbGetOptionGroup(options, "General");
+    g_assert_nonnull(group);
+    g_assert_cmpint(group->first, ==, 0);
+    g_assert_cmpint(group->count, ==, 2);
+    group = cpdbGetOptionGroup(options, "Layout");
+    g_assert_nonnull(group);
+    g_assert_cmpint(group->first, ==, 2);
+    g_assert_cmpint(group->count, ==, 2);
+    group = cpdbGetOptionGroup(options, "Color");
+    g_assert_nonnull(group);
+    g_assert_cmpint(group->first, ==, 4);
+    g_assert_cmpint(group->count, ==, 1);
+    g_assert_null(cpdbGetOptionGroup(options, "Finishing"));
+
+    /* The table points into the list, group names are shared */
+    g_assert_true(g_hash_table_lookup(options->table, "sides") == &options->list[2]);
+    g_assert_true(options->list[2].group_name == options->list[3].group_name);
+    g_assert_cmpstr(options->list[3].supported_values[1], ==, "2");
+    g_assert_nonnull(g_hash_table_lookup(options->media, "iso_a4_210x297mm"));
+
+    cpdbUnrefOptions(options);
+}
+
+static void testOptionGroupsEmpty(void)
+{
+    cpdb_options_t *options;
+
+    options = newTestOptions("(0, @a(sssia(s)) [], 0, @a(siiia(iiii)) [])");
+    g_assert_cmpint(options->count, ==, 0);
+    g_assert_cmpint(options->group_count, ==, 0);
+    g_assert_null(cpdbGetOptionGroup(options, "General"));
+    cpdbUnrefOptions(options);
+}
+
+/* Get a page of sorted printers and compare their ids with a space
+ * separated list */
+static void assertSorted(cpdb_frontend_obj_t *f,
+                         cpdb_sort_order_t order,
+                         int offset,
+                         int limit,
+                         const char *expected)
+{
+    cpdb_printer_obj_t **printers;
+    GString *ids = g_string_new(NULL);
+    int i, n;
+
+    printers = cpdbGetSortedPrinters(f, order, offset, limit, &n);
+    g_assert_nonnull(printers);
+    for (i = 0; printers[i]; i++)
+        g_string_append_printf(ids, "%s%s", i ? " " : "", printers[i]->id);
+    g_assert_cmpint(i, ==, n);
+    g_assert_cmpstr(ids->str, ==, expected);
+
+    g_string_free(ids, TRUE);
+    cpdbUnrefPrinterArray(printers);
+}
+
+static void testSortedPages(void)
+{
+    cpdb_frontend_obj_t *f = newTestFrontend();
+    int n = -1;
+
+    addTestPrinter(f, "b", "Beta", "", "", "");
+    addTestPrinter(f, "c", "Alpha", "", "", "");
+    addTestPrinter(f, "d", "Gamma", "", "", "");
+    addTestPrinter(f, "a", "Alpha", "", "", "");
+
+    /* Printers of the same name are ordered by id */
+    assertSorted(f, CPDB_SORT_BY_NAME, 0, 0, "a c b d");
+    assertSorted(f, CPDB_SORT_BY_NAME, 0, 2, "a c");
+    assertSorted(f, CPDB_SORT_BY_NAME, 2, 2, "b d");
+    assertSorted(f, CPDB_SORT_BY_NAME, 3, 2, "d");
+    assertSorted(f, CPDB_SORT_BY_NAME, 4, 2, "");
+    assertSorted(f, CPDB_SORT_BY_NAME, 10, 0, "");
+    assertSorted(f, CPDB_SORT_BY_BACKEND, 1, 2, "c b");
+    assertSorted(f, CPDB_SORT_BY_COLLATION, 0, 0, "a c b d");
+
+    g_assert_null(cpdbGetSortedPrinters(f, CPDB_SORT_BY_NAME, -1, 0, &n));
+    g_assert_cmpint(n, ==, 0);
+    g_assert_null(cpdbGetSortedPrinters(f, CPDB_SORT_COUNT, 0, 0, &n));
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testSortedPosition(void)
+{
+    cpdb_frontend_obj_t *f = newTestFrontend();
+    cpdb_printer_obj_t *p, *beta;
+
+    beta = addTestPrinter(f, "b", "Beta", "", "", "");
+    addTestPrinter(f, "c", "Alpha", "", "", "");
+    g_assert_cmpint(cpdbGetSortedPosition(f, CPDB_SORT_BY_NAME, beta), ==, 1);
+
+    /* The sorted view is kept up to date once it exists */
+    addTestPrinter(f, "e", "Aardvark", "", "", "");
+    addTestPrinter(f, "d", "Gamma", "", "", "");
+    g_assert_cmpint(cpdbGetSortedPosition(f, CPDB_SORT_BY_NAME, beta), ==, 2);
+    assertSorted(f, CPDB_SORT_BY_NAME, 0, 0, "e c b d");
+
+    p = cpdbRemovePrinter(f, "c", TEST_BACKEND);
+    g_assert_nonnull(p);
+    g_assert_cmpint(cpdbGetSortedPosition(f, CPDB_SORT_BY_NAME, p), ==, -1);
+    cpdbDeletePrinterObj(p);
+    g_assert_cmpint(cpdbGetSortedPosition(f, CPDB_SORT_BY_NAME, beta), ==, 1);
+    assertSorted(f, CPDB_SORT_BY_NAME, 0, 0, "e b d");
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static const cpdb_printer_view_t *findView(const cpdb_printer_snapshot_t *snapshot,
+                                           const char *id)
+{
+    int i;
+
+    for (i = 0; i < snapshot->num_printers; i++)
+    {
+        if (g_strcmp0(snapshot->printers[i].id, id) == 0)
+            return &snapshot->printers[i];
+    }
+    return NULL;
+}
+
+static void testSnapshotRefs(void)
+{
+    cpdb_frontend_obj_t *f = newTestFrontend();
+    cpdb_printer_snapshot_t *empty, *again, *current;
+
+    /* A new frontend has an empty snapshot, held by the frontend */
+    empty = cpdbGetPrinterSnapshot(f);
+    g_assert_nonnull(empty);
+    g_assert_cmpint(empty->num_printers, ==, 0);
+    again = cpdbGetPrinterSnapshot(f);
+    g_assert_true(again == empty);
+    g_assert_cmpint(empty->ref_count, ==, 3);
+    cpdbUnrefPrinterSnapshot(again);
+
+    /* A change publishes a new one, the old one stays as it was */
+    addTestPrinter(f, "a", "Office Laser", "Second floor", "Building 1", "HP LaserJet 4000");
+    g_assert_cmpint(empty->ref_count, ==, 1);
+    g_assert_cmpint(empty->num_printers, ==, 0);
+    current = cpdbGetPrinterSnapshot(f);
+    g_assert_true(current != empty);
+    g_assert_cmpint(current->num_printers, ==, 1);
+    g_assert_cmpint(current->ref_count, ==, 2);
+    cpdbUnrefPrinterSnapshot(empty);
+
+    /* Nothing changed, so the same one is handed out */
+    again = cpdbGetPrinterSnapshot(f);
+    g_assert_true(again == current);
+    cpdbUnrefPrinterSnapshot(again);
+    cpdbUnrefPrinterSnapshot(current);
+
+    cpdbDeleteFrontendObj(f);
+}
+
+static void testSnapshotOutlivesPrinter(void)
+{
+    cpdb_frontend_obj_t *f = newSearchFrontend();
+    cpdb_printer_snapshot_t *before, *after;
+    const cpdb_printer_view_t *view;
+    cpdb_printer_obj_t *p;
+
+    before = cpdbGetPrinterSnapshot(f);
+    g_assert_cmpint(before->num_printers, ==, 3);
+
+    p = cpdbRemovePrinter(f, "b", TEST_BACKEND);
+    g_assert_nonnull(p);
+    cpdbDeletePrinterObj(p);
+
+    /* The views own copies of the strings */
+    view = findView(before, "b");
+    g_assert_nonnull(view);
+    g_assert_cmpstr(view->name, ==, "Lab Color");
+    g_assert_cmpstr(view->location, ==, "Room 101");
+    g_assert_cmpstr(view->backend_name, ==, TEST_BACKEND);
+    g_assert_true(view->accepting_jobs);
+
+    after = cpdbGetPrinterSnapshot(f);
+    g_assert_cmpint(after->num_printers, ==, 2);
+    g_assert_null(findView(after, "b"));
+    g_assert_nonnull(findView(after, "a"));
+
+    /* Still readable after the frontend is gone */
+    cpdbDeleteFrontendObj(f);
+    g_assert_cmpstr(findView(after, "c")->make_and_model, ==, "Brother Multilaser 200");
+    cpdbUnrefPrinterSnapshot(after);
+    cpdbUnrefPrinterSnapshot(before);
+}
+
+/* A blocking cpdbConnectToDBus() lists the printers while iterating a
+ * private main context, which is dropped once the backends are active */
+static void testPrefetchContext(void)
+{
+    cpdb_frontend_obj_t *f = newTestFrontend();
+    cpdb_default_prefetch_t *d;
+    GMainContext *context;
+
+    while (g_main_context_iteration(NULL, FALSE));
+    cpdbSetDefaultPrinterPrefetch(f, "en");
+    d = f->default_prefetch;
+    g_assert_nonnull(d);
+    g_ptr_array_set_size(d->candidates, 0);
+    g_ptr_array_add(d->candidates, g_strdup("a#" TEST_BACKEND));
+    d->best = d->candidates->len;
+
+    context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+    addTestPrinter(f, "a", "Office Laser", "", "", "");
+    g_assert_cmpint(d->best, ==, 0);
+    g_assert_false(g_main_context_pending(context));
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    /* The prefetch waits in the context it was set up from, where the
+     * cancellation keeps it off the stand-in backend proxy */
+    g_assert_true(g_main_context_pending(NULL));
+    cpdbDeleteFrontendObj(f);
+    while (g_main_context_iteration(NULL, FALSE));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/search/prefix", testSearchPrefix);
+    g_test_add_func("/search/substring", testSearchSubstring);
+    g_test_add_func("/search/removed", testSearchRemoved);
+    g_test_add_func("/registry/replace", testRegistryReplace);
+    g_test_add_func("/registry/rename", testRegistryRename);
+    g_test_add_func("/registry/background", testRegistryBackground);
+    g_test_add_func("/filter/match", testFilterMatch);
+    g_test_add_func("/filter/color", testFilterColor);
+    g_test_add_func("/filter/invalid", testFilterInvalid);
+    g_test_add_func("/arena/small", testArenaSmall);
+    g_test_add_func("/arena/large", testArenaLarge);
+    g_test_add_func("/arena/strdup", testArenaStrdup);
+    g_test_add_func("/options/groups", testOptionGroups);
+    g_test_add_func("/options/groups-empty", testOptionGroupsEmpty);
+    g_test_add_func("/sorted/pages", testSortedPages);
+    g_test_add_func("/sorted/position", testSortedPosition);
+    g_test_add_func("/snapshot/refs", testSnapshotRefs);
+    g_test_add_func("/snapshot/outlives-printer", testSnapshotOutlivesPrinter);
+    g_test_add_func("/prefetch/context", testPrefetchContext);
+
+    return g_test_run();
+}